@@ -21,7 +21,9 @@
 # SOFTWARE.
 
 
+import os
 from typing import List
+from ament_index_python.packages import get_package_share_directory
 from launch import LaunchDescription
 from launch_ros.actions import Node
 from launch.substitutions import LaunchConfiguration, PythonExpression
@@ -67,6 +69,10 @@ def generate_launch_description():
         "no_kv_offload": LaunchConfiguration("no_kv_offload", default=False),
         "cache_type_k": LaunchConfiguration("cache_type_k", default="f16"),
         "cache_type_v": LaunchConfiguration("cache_type_v", default="f16"),
+        "kv_tier_type": LaunchConfiguration("kv_tier_type", default=""),
+        "kv_tier_threshold": LaunchConfiguration("kv_tier_threshold", default=0),
+        "kv_tier_n_ctx": LaunchConfiguration("kv_tier_n_ctx", default=0),
+        "prefetch_layers": LaunchConfiguration("prefetch_layers", default=0),
 
         "n_threads": LaunchConfiguration("n_threads", default=1),
         "n_threads_batch": LaunchConfiguration("n_threads_batch", default=-1),
@@ -77,25 +83,52 @@ def generate_launch_description():
         "lora_adapter": LaunchConfiguration("lora_adapter", default=""),
         "lora_base": LaunchConfiguration("lora_base", default=""),
         "mmproj": LaunchConfiguration("mmproj", default=""),
+        "image_change_threshold": LaunchConfiguration("image_change_threshold", default=0.0),
+        "max_image_tiles": LaunchConfiguration("max_image_tiles", default=1),
+        "vision_workers": LaunchConfiguration("vision_workers", default=1),
+        "lazy_vision": LaunchConfiguration("lazy_vision", default=False),
         "numa": LaunchConfiguration("numa", default="none"),
         "pooling_type": LaunchConfiguration("pooling_type", default=""),
 
+        "compressor_model": LaunchConfiguration("compressor_model", default=""),
+        "compression_ratio": LaunchConfiguration("compression_ratio", default=0.5),
+        "compression_budget": LaunchConfiguration("compression_budget", default=0),
+        "embeddings_batch_window_us": LaunchConfiguration("embeddings_batch_window_us", default=0),
+        "min_tokens_per_second": LaunchConfiguration("min_tokens_per_second", default=0.0),
+        "token_ring_capacity": LaunchConfiguration("token_ring_capacity", default=0),
+        "client_timeout_ms": LaunchConfiguration("client_timeout_ms", default=0),
+
+        "cascade_model": LaunchConfiguration("cascade_model", default=""),
+        "cascade_threshold": LaunchConfiguration("cascade_threshold", default=0.5),
+        "cascade_window": LaunchConfiguration("cascade_window", default=4),
+        "cascade_reuse_output": LaunchConfiguration("cascade_reuse_output", default=True),
+
+        "thread_budget": LaunchConfiguration("thread_budget", default=-1),
+        "thread_budget_yield_us": LaunchConfiguration("thread_budget_yield_us", default=50),
+        "thread_budget_priority": ParameterValue(LaunchConfiguration("thread_budget_priority", default=["generation", "vision", "embeddings"]), value_type=List[str]),
+
         "prefix": ParameterValue(LaunchConfiguration("prefix", default=""), value_type=str),
         "suffix": ParameterValue(LaunchConfiguration("suffix", default=""), value_type=str),
         "stopping_words": ParameterValue(LaunchConfiguration("stopping_words", default=[]), value_type=List[str]),
+        "logits_processors": ParameterValue(LaunchConfiguration("logits_processors", default=[]), value_type=List[str]),
 
         "system_prompt": ParameterValue(LaunchConfiguration("system_prompt", default=""), value_type=str),
         "system_prompt_file": ParameterValue(LaunchConfiguration("system_prompt_file", default=""), value_type=str),
         "debug": LaunchConfiguration("debug", default=True),
     }
 
+    logits_processors_file = LaunchConfiguration(
+        "logits_processors_file",
+        default=os.path.join(get_package_share_directory("llama_bringup"),
+                             "params", "logits_processors.yaml"))
+
     return LaunchDescription([
         Node(
             package="llama_ros",
             executable="llama_node",
             name="llama_node",
             namespace="llama",
-            parameters=[params],
+            parameters=[params, logits_processors_file],
             condition=UnlessCondition(PythonExpression(
                 [LaunchConfiguration("use_llava")]))
         ),
@@ -104,8 +137,10 @@ def generate_launch_description():
             package="llama_ros",
             executable="llava_node",
             name="llava_node",
-            namespace="llava",
-            parameters=[params],
+            namespace=PythonExpression([
+                "'llama' if ", LaunchConfiguration("unified", default=False),
+                " else 'llava'"]),
+            parameters=[params, logits_processors_file],
             condition=IfCondition(PythonExpression(
                 [LaunchConfiguration("use_llava")]))
         ),
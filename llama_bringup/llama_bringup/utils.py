@@ -51,6 +51,7 @@ def get_prompt_path(prompt_file_name: str) -> str:
 
 def create_llama_launch(
     use_llava: bool = False,
+    unified: bool = False,
 
     seed: int = -1,
     n_ctx: int = 512,
@@ -87,6 +88,10 @@ def create_llama_launch(
     no_kv_offload: bool = False,
     cache_type_k: str = "f16",
     cache_type_v: str = "f16",
+    kv_tier_type: str = "",
+    kv_tier_threshold: int = 0,
+    kv_tier_n_ctx: int = 0,
+    prefetch_layers: int = 0,
 
     n_threads: int = 4,
     n_threads_batch: int = -1,
@@ -105,12 +110,39 @@ def create_llama_launch(
     mmproj_repo: str = "",
     mmproj_filename: str = "",
 
+    image_change_threshold: float = 0.0,
+    max_image_tiles: int = 1,
+    vision_workers: int = 1,
+
     numa: str = "none",
     pooling_type: str = "",
 
+    compressor_model: str = "",
+    compressor_model_repo: str = "",
+    compressor_model_filename: str = "",
+    compression_ratio: float = 0.5,
+    compression_budget: int = 0,
+    embeddings_batch_window_us: int = 0,
+    min_tokens_per_second: float = 0.0,
+    token_ring_capacity: int = 0,
+    client_timeout_ms: int = 0,
+
+    cascade_model: str = "",
+    cascade_model_repo: str = "",
+    cascade_model_filename: str = "",
+    cascade_threshold: float = 0.5,
+    cascade_window: int = 4,
+    cascade_reuse_output: bool = True,
+
+    thread_budget: int = -1,
+    thread_budget_yield_us: int = 50,
+    thread_budget_priority: List[str] = ["generation", "vision", "embeddings"],
+
     prefix: str = "",
     suffix: str = "",
     stopping_words: List[str] = [],
+    logits_processors: List[str] = [],
+    logits_processors_file: str = "",
 
     system_prompt: str = "",
     system_prompt_file: str = "",
@@ -130,6 +162,25 @@ def create_llama_launch(
     if not mmproj:
         mmproj = download_model(mmproj_repo, mmproj_filename)
 
+    # a single llava node serves text and image goals
+    if unified:
+        use_llava = True
+
+    if not logits_processors_file:
+        logits_processors_file = os.path.join(
+            get_package_share_directory("llama_bringup"),
+            "params",
+            "logits_processors.yaml"
+        )
+
+    if not compressor_model:
+        compressor_model = download_model(
+            compressor_model_repo, compressor_model_filename)
+
+    if not cascade_model:
+        cascade_model = download_model(
+            cascade_model_repo, cascade_model_filename)
+
     return IncludeLaunchDescription(
         PythonLaunchDescriptionSource(
             os.path.join(
@@ -140,6 +191,7 @@ def create_llama_launch(
         ),
         launch_arguments={
             "use_llava": str(use_llava),
+            "unified": str(unified),
 
             "seed": str(seed),
             "n_ctx": str(n_ctx),
@@ -175,6 +227,10 @@ def create_llama_launch(
             "no_kv_offload": str(no_kv_offload),
             "cache_type_k": cache_type_k,
             "cache_type_v": cache_type_v,
+            "kv_tier_type": kv_tier_type,
+            "kv_tier_threshold": str(kv_tier_threshold),
+            "kv_tier_n_ctx": str(kv_tier_n_ctx),
+            "prefetch_layers": str(prefetch_layers),
 
             "n_threads": str(n_threads),
             "n_threads_batch": str(n_threads_batch),
@@ -184,12 +240,35 @@ def create_llama_launch(
             "model": model,
             "lora_base": lora_base,
             "mmproj": mmproj,
+            "image_change_threshold": str(image_change_threshold),
+            "max_image_tiles": str(max_image_tiles),
+            "vision_workers": str(vision_workers),
+            "lazy_vision": str(unified),
             "numa": numa,
             "pooling_type": pooling_type,
 
+            "compressor_model": compressor_model,
+            "compression_ratio": str(compression_ratio),
+            "compression_budget": str(compression_budget),
+            "embeddings_batch_window_us": str(embeddings_batch_window_us),
+            "min_tokens_per_second": str(min_tokens_per_second),
+            "token_ring_capacity": str(token_ring_capacity),
+            "client_timeout_ms": str(client_timeout_ms),
+
+            "cascade_model": cascade_model,
+            "cascade_threshold": str(cascade_threshold),
+            "cascade_window": str(cascade_window),
+            "cascade_reuse_output": str(cascade_reuse_output),
+
+            "thread_budget": str(thread_budget),
+            "thread_budget_yield_us": str(thread_budget_yield_us),
+            "thread_budget_priority": str(thread_budget_priority),
+
             "prefix": prefix,
             "suffix": suffix,
             "stopping_words": str(stopping_words),
+            "logits_processors": str(logits_processors),
+            "logits_processors_file": logits_processors_file,
 
             "system_prompt": system_prompt,
             "system_prompt_file": system_prompt_file,
@@ -0,0 +1,288 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Mixed-load benchmark for the shared compute pool on the real llama.cpp and
+// clip paths. Generation (one token per llama_decode), image encoding and
+// embeddings (one prompt per llama_decode) run concurrently on the same model,
+// first with every call using all the threads and then with each call leasing
+// its threads from the pool. Tiny random weights can be generated with
+// make_tiny_llava.py.
+//
+// usage: compute_pool_benchmark model.gguf mmproj.gguf [options]
+//   --threads N      threads per call and pool size (default: all cores)
+//   --seconds N      duration of each run (default: 5)
+//   --yield-us N     lease yield wait before sleeping (default: 50)
+//   --image-size N   side of the synthetic image (default: 336)
+//   --prompt N       tokens per embeddings prompt (default: 128)
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "clip.h"
+#include "common.h"
+#include "llama.h"
+#include "llama_utils/compute_pool.hpp"
+#include "llava.h"
+
+using namespace llama_utils;
+
+struct workload_result {
+  std::string name;
+  int64_t n_calls;
+  double total_ms;
+  double max_ms;
+};
+
+static double cpu_seconds() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+}
+
+static void run(bool use_pool, struct llama_model *model,
+                struct clip_ctx *ctx_clip, int n_threads, int seconds,
+                int image_size, int n_prompt) {
+
+  auto cparams = llama_context_default_params();
+  cparams.n_ctx = std::max(512, n_prompt);
+  cparams.n_batch = cparams.n_ctx;
+  cparams.n_ubatch = cparams.n_ctx;
+
+  struct llama_context *ctx_gen = llama_new_context_with_model(model, cparams);
+  cparams.embeddings = true;
+  struct llama_context *ctx_embd = llama_new_context_with_model(model, cparams);
+
+  if (ctx_gen == nullptr || ctx_embd == nullptr) {
+    fprintf(stderr, "Unable to create the contexts\n");
+    llama_free(ctx_gen);
+    llama_free(ctx_embd);
+    return;
+  }
+
+  // synthetic image and prompt
+  std::mt19937 rng(42);
+  std::vector<unsigned char> pixels(image_size * image_size * 3);
+  for (auto &p : pixels) {
+    p = rng() % 256;
+  }
+  struct clip_image_u8 *img = clip_image_u8_init();
+  clip_build_img_from_pixels(pixels.data(), image_size, image_size, img);
+
+  const int n_vocab = llama_n_vocab(model);
+  std::vector<llama_token> prompt(n_prompt);
+  for (auto &t : prompt) {
+    t = rng() % n_vocab;
+  }
+
+  // each call runs with all the threads or with the threads of its lease
+  auto call = [use_pool, n_threads](compute_workload workload,
+                                    std::function<void(int)> fn) {
+    if (use_pool) {
+      ComputeLease lease(n_threads, workload);
+      fn(lease.get_n_threads());
+    } else {
+      fn(n_threads);
+    }
+  };
+
+  std::vector<std::function<void()>> workloads = {
+      // generation, one token per decode until the context is full
+      [&, n_past = 0]() mutable {
+        if (n_past >= (int)cparams.n_ctx) {
+          llama_kv_cache_clear(ctx_gen);
+          n_past = 0;
+        }
+
+        struct llama_batch batch = llama_batch_init(1, 0, 1);
+        llama_batch_add(batch, prompt[n_past % n_prompt], n_past, {0}, true);
+        n_past++;
+
+        call(GENERATION, [&](int n) {
+          llama_set_n_threads(ctx_gen, n, n);
+          llama_decode(ctx_gen, batch);
+        });
+        llama_batch_free(batch);
+      },
+
+      // vision, one clip encode
+      [&]() {
+        call(VISION, [&](int n) {
+          float *embd = nullptr;
+          int n_pos = 0;
+          if (llava_image_embed_make_with_clip_img(ctx_clip, n, img, &embd,
+                                                   &n_pos)) {
+            free(embd);
+          }
+        });
+      },
+
+      // embeddings, one prompt per decode
+      [&]() {
+        struct llama_batch batch = llama_batch_init(n_prompt, 0, 1);
+        for (int i = 0; i < n_prompt; i++) {
+          llama_batch_add(batch, prompt[i], i, {0}, i == n_prompt - 1);
+        }
+
+        call(EMBEDDINGS, [&](int n) {
+          llama_set_n_threads(ctx_embd, n, n);
+          llama_decode(ctx_embd, batch);
+        });
+        llama_kv_cache_clear(ctx_embd);
+        llama_batch_free(batch);
+      },
+  };
+
+  std::vector<struct workload_result> results = {
+      {"generation", 0, 0.0, 0.0},
+      {"vision", 0, 0.0, 0.0},
+      {"embeddings", 0, 0.0, 0.0},
+  };
+
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> clients;
+
+  double cpu_start = cpu_seconds();
+  auto wall_start = std::chrono::steady_clock::now();
+
+  for (size_t w = 0; w < workloads.size(); w++) {
+    clients.emplace_back([&, w] {
+      while (!stop) {
+        auto start = std::chrono::steady_clock::now();
+        workloads[w]();
+        double ms = std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+
+        results[w].n_calls++;
+        results[w].total_ms += ms;
+        results[w].max_ms = std::max(results[w].max_ms, ms);
+      }
+    });
+  }
+
+  std::this_thread::sleep_for(std::chrono::seconds(seconds));
+  stop = true;
+
+  for (auto &t : clients) {
+    t.join();
+  }
+
+  double wall = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - wall_start)
+                    .count();
+  double cpu = cpu_seconds() - cpu_start;
+
+  fprintf(stdout, "%s\n", use_pool ? "shared pool" : "per-call threads");
+  for (const auto &result : results) {
+    fprintf(stdout, "  %-10s %8.2f calls/s  mean %8.2f ms  max %8.2f ms\n",
+            result.name.c_str(), result.n_calls / wall,
+            result.n_calls > 0 ? result.total_ms / result.n_calls : 0.0,
+            result.max_ms);
+  }
+  fprintf(stdout, "  cpu usage  %8.1f %%\n", 100.0 * cpu / wall);
+
+  clip_image_u8_free(img);
+  llama_free(ctx_embd);
+  llama_free(ctx_gen);
+}
+
+int main(int argc, char *argv[]) {
+
+  if (argc < 3) {
+    fprintf(stderr,
+            "usage: %s model.gguf mmproj.gguf [--threads N] [--seconds N] "
+            "[--yield-us N] [--image-size N] [--prompt N]\n",
+            argv[0]);
+    return 1;
+  }
+
+  int n_threads = std::thread::hardware_concurrency();
+  int seconds = 5;
+  int yield_us = 50;
+  int image_size = 336;
+  int n_prompt = 128;
+
+  for (int i = 3; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--threads" && i + 1 < argc) {
+      n_threads = std::atoi(argv[++i]);
+    } else if (arg == "--seconds" && i + 1 < argc) {
+      seconds = std::atoi(argv[++i]);
+    } else if (arg == "--yield-us" && i + 1 < argc) {
+      yield_us = std::atoi(argv[++i]);
+    } else if (arg == "--image-size" && i + 1 < argc) {
+      image_size = std::atoi(argv[++i]);
+    } else if (arg == "--prompt" && i + 1 < argc) {
+      n_prompt = std::max(1, std::atoi(argv[++i]));
+    }
+  }
+
+  log_disable();
+  llama_backend_init();
+
+  struct llama_model *model =
+      llama_load_model_from_file(argv[1], llama_model_default_params());
+  if (model == nullptr) {
+    fprintf(stderr, "Unable to load model %s\n", argv[1]);
+    return 1;
+  }
+
+  struct clip_ctx *ctx_clip = clip_model_load(argv[2], 0);
+  if (ctx_clip == nullptr) {
+    fprintf(stderr, "Unable to load mmproj %s\n", argv[2]);
+    llama_free_model(model);
+    return 1;
+  }
+
+  ComputePool::get_instance().configure(n_threads, yield_us,
+                                        {GENERATION, VISION, EMBEDDINGS});
+
+  fprintf(stdout, "threads = %d, duration = %d s, yield = %d us\n", n_threads,
+          seconds, yield_us);
+
+  run(false, model, ctx_clip, n_threads, seconds, image_size, n_prompt);
+  run(true, model, ctx_clip, n_threads, seconds, image_size, n_prompt);
+
+  auto stats = ComputePool::get_instance().get_stats();
+  fprintf(stdout,
+          "budget: leases = %ld, yield hits = %ld, sleeps = %ld, "
+          "wait = %.1f ms\n",
+          stats.n_leases, stats.n_yield_hits, stats.n_sleeps,
+          stats.wait_us / 1000.0);
+
+  clip_free(ctx_clip);
+  llama_free_model(model);
+  llama_backend_free();
+
+  return 0;
+}
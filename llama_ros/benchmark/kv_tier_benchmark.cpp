@@ -0,0 +1,249 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// Compares the KV cache types used by KV tiering: cache size, perplexity over
+// a text file and decode speed with the cache full. The prefill time is also
+// the cost of moving a conversation of n_ctx tokens to the quantized tier.
+//
+// usage: kv_tier_benchmark model.gguf text.txt [options]
+//   --ctx N          context size and perplexity window (default: 2048)
+//   --threads N      threads (default: 4)
+//   --flash-attn     use flash attention, also quantizes the V cache
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "llama.h"
+
+struct kv_result {
+  std::string type;
+  double kv_mib;
+  double ppl;
+  double prefill_ms;
+  double decode_tps;
+};
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+// negative log-likelihood of the second half of each window, as llama.cpp
+// perplexity does, so every scored token has at least n_ctx / 2 of context
+static bool eval_window(struct llama_context *ctx, struct llama_batch &batch,
+                        const std::vector<llama_token> &tokens, size_t start,
+                        int n_ctx, int n_batch, double &nll, int &n_scored) {
+
+  const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+  llama_kv_cache_clear(ctx);
+
+  for (int i = 0; i < n_ctx; i += n_batch) {
+    int n_eval = std::min(n_batch, n_ctx - i);
+
+    llama_batch_clear(batch);
+    for (int j = 0; j < n_eval; j++) {
+      llama_batch_add(batch, tokens[start + i + j], i + j, {0}, true);
+    }
+
+    if (llama_decode(ctx, batch)) {
+      return false;
+    }
+
+    for (int j = 0; j < n_eval; j++) {
+      int pos = i + j;
+      if (pos < n_ctx / 2 || pos + 1 >= n_ctx) {
+        continue;
+      }
+
+      const float *logits = llama_get_logits_ith(ctx, j);
+      float max_logit = logits[0];
+      for (int k = 1; k < n_vocab; k++) {
+        max_logit = std::max(max_logit, logits[k]);
+      }
+
+      double sum = 0.0;
+      for (int k = 0; k < n_vocab; k++) {
+        sum += std::exp(logits[k] - max_logit);
+      }
+
+      nll += std::log(sum) + max_logit - logits[tokens[start + pos + 1]];
+      n_scored++;
+    }
+  }
+
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+
+  if (argc < 3) {
+    fprintf(stderr,
+            "usage: %s model.gguf text.txt [--ctx N] [--threads N] "
+            "[--flash-attn]\n",
+            argv[0]);
+    return 1;
+  }
+
+  int n_ctx = 2048;
+  int n_threads = 4;
+  bool flash_attn = false;
+
+  for (int i = 3; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--ctx" && i + 1 < argc) {
+      n_ctx = std::atoi(argv[++i]);
+    } else if (arg == "--threads" && i + 1 < argc) {
+      n_threads = std::atoi(argv[++i]);
+    } else if (arg == "--flash-attn") {
+      flash_attn = true;
+    }
+  }
+
+  std::ifstream file(argv[2]);
+  if (!file) {
+    fprintf(stderr, "Unable to read %s\n", argv[2]);
+    return 1;
+  }
+  std::stringstream text;
+  text << file.rdbuf();
+
+  log_disable();
+  llama_backend_init();
+
+  gpt_params params;
+  params.model = argv[1];
+  params.n_ctx = n_ctx;
+  params.n_batch = std::min(n_ctx, 512);
+  params.n_ubatch = params.n_batch;
+  params.n_threads = n_threads;
+  params.n_threads_batch = n_threads;
+  params.flash_attn = flash_attn;
+
+  struct llama_model *model = llama_load_model_from_file(
+      params.model.c_str(), llama_model_params_from_gpt_params(params));
+  if (model == nullptr) {
+    fprintf(stderr, "Unable to load %s\n", argv[1]);
+    return 1;
+  }
+
+  std::vector<llama_token> tokens =
+      ::llama_tokenize(model, text.str(), true, false);
+  const int n_windows = tokens.size() / n_ctx;
+
+  if (n_windows == 0) {
+    fprintf(stderr, "The text has %ld tokens, at least %d are needed\n",
+            tokens.size(), n_ctx);
+    llama_free_model(model);
+    return 1;
+  }
+
+  const int n_gen = std::min(64, n_ctx / 4);
+  struct llama_batch batch = llama_batch_init(params.n_batch, 0, 1);
+  std::vector<struct kv_result> results;
+
+  for (const std::string type : {"f16", "q8_0", "q4_0"}) {
+
+    params.cache_type_k = type;
+    params.cache_type_v = flash_attn ? type : "f16";
+
+    struct llama_context *ctx = llama_new_context_with_model(
+        model, llama_context_params_from_gpt_params(params));
+    if (ctx == nullptr) {
+      fprintf(stderr, "Unable to create a %s context\n", type.c_str());
+      continue;
+    }
+
+    // perplexity
+    double nll = 0.0;
+    int n_scored = 0;
+    bool ok = true;
+
+    for (int w = 0; w < n_windows && ok; w++) {
+      ok = eval_window(ctx, batch, tokens, w * n_ctx, n_ctx, params.n_batch,
+                       nll, n_scored);
+    }
+
+    // prefill the context leaving room for the generated tokens
+    const int n_prefill = n_ctx - n_gen;
+    llama_kv_cache_clear(ctx);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n_prefill && ok; i += params.n_batch) {
+      int n_eval = std::min(params.n_batch, n_prefill - i);
+      ok = llama_decode(ctx, llama_batch_get_one(tokens.data() + i, n_eval, i,
+                                                 0)) == 0;
+    }
+    double prefill_ms = elapsed_ms(start);
+
+    double kv_mib = llama_state_seq_get_size(ctx, 0) / (1024.0 * 1024.0);
+
+    // greedy decode at depth
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n_gen && ok; i++) {
+      const float *logits = llama_get_logits_ith(ctx, -1);
+      llama_token token =
+          std::max_element(logits, logits + llama_n_vocab(model)) - logits;
+      ok = llama_decode(ctx, llama_batch_get_one(&token, 1, n_prefill + i,
+                                                 0)) == 0;
+    }
+    double decode_ms = elapsed_ms(start);
+
+    llama_free(ctx);
+
+    if (!ok) {
+      fprintf(stderr, "Failed to eval with a %s cache\n", type.c_str());
+      continue;
+    }
+
+    results.push_back({type, kv_mib, std::exp(nll / n_scored), prefill_ms,
+                       1000.0 * n_gen / decode_ms});
+  }
+
+  llama_batch_free(batch);
+  llama_free_model(model);
+  llama_backend_free();
+
+  // report
+  fprintf(stdout, "n_ctx %d, %d windows, %d threads, flash attention %s\n",
+          n_ctx, n_windows, n_threads, flash_attn ? "on" : "off");
+  fprintf(stdout, "  %-6s %10s %10s %10s %12s %12s\n", "type", "KV MiB",
+          "ppl", "delta", "prefill ms", "decode t/s");
+
+  for (auto &r : results) {
+    double delta = r.ppl - results.front().ppl;
+    fprintf(stdout, "  %-6s %10.2f %10.4f %+10.4f %12.1f %12.2f\n",
+            r.type.c_str(), r.kv_mib, r.ppl, delta, r.prefill_ms,
+            r.decode_tps);
+  }
+
+  return 0;
+}
@@ -0,0 +1,265 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// Measures each stage of the llava image path on synthetic images, from the
+// ROS image message to the first generated token. Tiny random weights can be
+// generated with make_tiny_llava.py.
+//
+// usage: llava_benchmark model.gguf mmproj.gguf [options]
+//   --width W --height H   image resolution (default: 640x480)
+//   --encoding E           rgb8, bgr8, bgra8 or mono8 (default: bgr8)
+//   --iterations N         iterations per stage (default: 10)
+//   --threads N            threads (default: 4)
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cv_bridge/cv_bridge.h>
+#include <opencv2/opencv.hpp>
+#include <sensor_msgs/msg/image.hpp>
+
+#include "base64.hpp"
+#include "clip.h"
+#include "llava.h"
+#include "llava_ros/llava.hpp"
+#include "llava_ros/llava_node.hpp"
+
+using namespace llava_ros;
+
+// exposes the protected image path of Llava
+class LlavaBenchmark : public Llava {
+
+public:
+  using Llava::Llava;
+
+  struct clip_ctx *get_clip() { return this->ctx_llava->ctx_clip; }
+  bool prefill_image(struct llava_image_embed *embed) {
+    return this->eval_image(embed);
+  }
+};
+
+struct stage_result {
+  std::string name;
+  double ms;
+};
+
+static double time_ms(int iterations, std::function<void()> fn) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    fn();
+  }
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+             .count() /
+         iterations;
+}
+
+static sensor_msgs::msg::Image make_image(int width, int height,
+                                          const std::string &encoding) {
+
+  int channels = 3;
+  if (encoding == "mono8") {
+    channels = 1;
+  } else if (encoding == "bgra8") {
+    channels = 4;
+  }
+
+  sensor_msgs::msg::Image msg;
+  msg.width = width;
+  msg.height = height;
+  msg.encoding = encoding;
+  msg.step = width * channels;
+  msg.data.resize(msg.step * height);
+
+  // gradients plus noise, so the jpeg encoder has some real work to do
+  uint32_t seed = 12345;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width * channels; x++) {
+      seed = seed * 1664525u + 1013904223u;
+      msg.data[y * msg.step + x] =
+          (uint8_t)((x / channels + y + (x % channels) * 85) / 4 +
+                    (seed >> 28));
+    }
+  }
+
+  return msg;
+}
+
+int main(int argc, char *argv[]) {
+
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s model.gguf mmproj.gguf [--width W] "
+                    "[--height H] [--encoding E] [--iterations N] "
+                    "[--threads N]\n",
+            argv[0]);
+    return 1;
+  }
+
+  int width = 640;
+  int height = 480;
+  std::string encoding = "bgr8";
+  int iterations = 10;
+  int n_threads = 4;
+
+  for (int i = 3; i + 1 < argc; i += 2) {
+    std::string arg = argv[i];
+    if (arg == "--width") {
+      width = std::atoi(argv[i + 1]);
+    } else if (arg == "--height") {
+      height = std::atoi(argv[i + 1]);
+    } else if (arg == "--encoding") {
+      encoding = argv[i + 1];
+    } else if (arg == "--iterations") {
+      iterations = std::atoi(argv[i + 1]);
+    } else if (arg == "--threads") {
+      n_threads = std::atoi(argv[i + 1]);
+    }
+  }
+
+  auto params = std::make_shared<struct gpt_params>();
+  params->model = argv[1];
+  params->mmproj = argv[2];
+  params->n_ctx = 4096;
+  params->n_batch = 512;
+  params->n_threads = n_threads;
+  params->n_threads_batch = n_threads;
+  params->n_predict = 4096;
+  params->embedding = false;
+
+  LlavaBenchmark llava(params, false);
+  struct clip_ctx *ctx_clip = llava.get_clip();
+
+  auto image_msg = make_image(width, height, encoding);
+  std::vector<struct stage_result> results;
+
+  // cv_bridge
+  cv_bridge::CvImagePtr cv_ptr;
+  results.push_back({"cv_bridge conversion", time_ms(iterations, [&] {
+                       cv_ptr = cv_bridge::toCvCopy(image_msg,
+                                                    image_msg.encoding);
+                     })});
+
+  // jpeg encode
+  std::vector<uchar> jpeg;
+  results.push_back({"jpeg encode", time_ms(iterations, [&] {
+                       jpeg.clear();
+                       cv::imencode(".jpg", cv_ptr->image, jpeg);
+                     })});
+
+  // base64 encode
+  std::string encoded;
+  results.push_back({"base64 encode", time_ms(iterations, [&] {
+                       encoded = LlavaNode::base64_encode(jpeg.data(),
+                                                          jpeg.size());
+                     })});
+
+  // base64 decode
+  std::vector<unsigned char> decoded;
+  results.push_back(
+      {"base64 decode", time_ms(iterations, [&] {
+         decoded = std::vector<unsigned char>(
+             base64::required_encode_size(encoded.size()));
+         base64::decode(encoded.begin(), encoded.end(), decoded.begin());
+       })});
+
+  // jpeg decode inside clip
+  struct clip_image_u8 *img = clip_image_u8_init();
+  results.push_back({"jpeg decode", time_ms(iterations, [&] {
+                       clip_image_load_from_bytes(decoded.data(),
+                                                  decoded.size(), img);
+                     })});
+
+  // clip preprocessing
+  double preprocess_ms = time_ms(iterations, [&] {
+    struct clip_image_f32_batch batch = {nullptr, 0};
+    clip_image_preprocess(ctx_clip, img, &batch);
+    clip_image_f32_batch_free(&batch);
+  });
+  results.push_back({"clip preprocessing", preprocess_ms});
+
+  // clip encode, llava preprocesses again internally
+  float *image_embd = nullptr;
+  int n_image_pos = 0;
+  double encode_ms = time_ms(iterations, [&] {
+    free(image_embd);
+    llava_image_embed_make_with_clip_img(ctx_clip, n_threads, img, &image_embd,
+                                         &n_image_pos);
+  });
+  results.push_back({"clip encode", encode_ms - preprocess_ms});
+  clip_image_u8_free(img);
+
+  // image tokens prefill
+  struct llava_image_embed embed = {image_embd, n_image_pos};
+  double prefill_ms = 0.0;
+
+  for (int i = 0; i < iterations; i++) {
+    llava.reset();
+    prefill_ms += time_ms(1, [&] { llava.prefill_image(&embed); });
+  }
+  results.push_back({"image prefill (" + std::to_string(n_image_pos) +
+                         " tokens)",
+                     prefill_ms / iterations});
+  free(image_embd);
+
+  // first token latency from the base64 image
+  double first_token_ms = 0.0;
+
+  for (int i = 0; i < iterations; i++) {
+    llava.reset();
+
+    auto start = std::chrono::steady_clock::now();
+    llava.load_image(encoded);
+    llava.generate_response("Describe the image.",
+                            [&](struct completion_output completion) {
+                              (void)completion;
+                              first_token_ms +=
+                                  std::chrono::duration<double, std::milli>(
+                                      std::chrono::steady_clock::now() - start)
+                                      .count();
+                              llava.cancel();
+                            });
+  }
+  first_token_ms /= iterations;
+
+  // report
+  double total_ms = 0.0;
+  for (auto &r : results) {
+    total_ms += r.ms;
+  }
+
+  fprintf(stdout, "image %dx%d %s, %d iterations, %d threads\n", width, height,
+          encoding.c_str(), iterations, n_threads);
+  for (auto &r : results) {
+    fprintf(stdout, "  %-32s %10.3f ms %6.1f %%\n", r.name.c_str(), r.ms,
+            100.0 * r.ms / total_ms);
+  }
+  fprintf(stdout, "  %-32s %10.3f ms\n", "first token latency",
+          first_token_ms);
+
+  return 0;
+}
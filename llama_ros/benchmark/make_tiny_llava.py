@@ -0,0 +1,203 @@
+#!/usr/bin/env python3
+
+#!/usr/bin/env python3
+
+# MIT License
+
+# Copyright (c) 2024  Miguel Ángel González Santamarta
+
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+
+
+# Generates a tiny random llama model and llava projector to run the
+# vision benchmark without downloading real weights. Requires the gguf
+# python package (llama_cpp/gguf-py).
+#
+# usage: make_tiny_llava.py [output_dir]
+
+import os
+import sys
+import numpy as np
+import gguf
+
+
+N_EMBD = 64
+N_HEAD = 4
+N_LAYER = 2
+N_FF = 128
+N_CTX = 4096
+
+V_IMAGE_SIZE = 336
+V_PATCH_SIZE = 14
+V_N_EMBD = 64
+V_N_HEAD = 4
+V_N_LAYER = 2
+V_N_FF = 128
+
+
+def rand(*shape, dtype=np.float32) -> np.ndarray:
+    return (np.random.standard_normal(shape) * 0.02).astype(dtype)
+
+
+def ones(*shape) -> np.ndarray:
+    return np.ones(shape, dtype=np.float32)
+
+
+def zeros(*shape) -> np.ndarray:
+    return np.zeros(shape, dtype=np.float32)
+
+
+def make_vocab():
+    tokens = ["<unk>", "<s>", "</s>"]
+    types = [gguf.TokenType.UNKNOWN,
+             gguf.TokenType.CONTROL, gguf.TokenType.CONTROL]
+
+    # byte fallback
+    for i in range(256):
+        tokens.append(f"<0x{i:02X}>")
+        types.append(gguf.TokenType.BYTE)
+
+    # printable characters and words
+    for c in [chr(i) for i in range(33, 127)] + ["▁"]:
+        tokens.append(c)
+        types.append(gguf.TokenType.NORMAL)
+
+    scores = [-float(i) for i in range(len(tokens))]
+    return tokens, scores, types
+
+
+def make_model(path: str) -> None:
+    tokens, scores, types = make_vocab()
+    n_vocab = len(tokens)
+
+    writer = gguf.GGUFWriter(path, "llama")
+    writer.add_name("tiny-llama")
+    writer.add_context_length(N_CTX)
+    writer.add_embedding_length(N_EMBD)
+    writer.add_block_count(N_LAYER)
+    writer.add_feed_forward_length(N_FF)
+    writer.add_rope_dimension_count(N_EMBD // N_HEAD)
+    writer.add_head_count(N_HEAD)
+    writer.add_head_count_kv(N_HEAD)
+    writer.add_layer_norm_rms_eps(1e-5)
+    writer.add_file_type(0)
+
+    writer.add_tokenizer_model("llama")
+    writer.add_token_list(tokens)
+    writer.add_token_scores(scores)
+    writer.add_token_types(types)
+    writer.add_unk_token_id(0)
+    writer.add_bos_token_id(1)
+    writer.add_eos_token_id(2)
+
+    writer.add_tensor("token_embd.weight", rand(n_vocab, N_EMBD))
+    writer.add_tensor("output_norm.weight", ones(N_EMBD))
+    writer.add_tensor("output.weight", rand(n_vocab, N_EMBD))
+
+    for i in range(N_LAYER):
+        writer.add_tensor(f"blk.{i}.attn_norm.weight", ones(N_EMBD))
+        writer.add_tensor(f"blk.{i}.attn_q.weight", rand(N_EMBD, N_EMBD))
+        writer.add_tensor(f"blk.{i}.attn_k.weight", rand(N_EMBD, N_EMBD))
+        writer.add_tensor(f"blk.{i}.attn_v.weight", rand(N_EMBD, N_EMBD))
+        writer.add_tensor(f"blk.{i}.attn_output.weight",
+                          rand(N_EMBD, N_EMBD))
+        writer.add_tensor(f"blk.{i}.ffn_norm.weight", ones(N_EMBD))
+        writer.add_tensor(f"blk.{i}.ffn_gate.weight", rand(N_FF, N_EMBD))
+        writer.add_tensor(f"blk.{i}.ffn_up.weight", rand(N_FF, N_EMBD))
+        writer.add_tensor(f"blk.{i}.ffn_down.weight", rand(N_EMBD, N_FF))
+
+    writer.write_header_to_file()
+    writer.write_kv_data_to_file()
+    writer.write_tensors_to_file()
+    writer.close()
+
+
+def make_mmproj(path: str) -> None:
+    n_pos = (V_IMAGE_SIZE // V_PATCH_SIZE) ** 2 + 1
+
+    writer = gguf.GGUFWriter(path, "clip")
+    writer.add_bool("clip.has_text_encoder", False)
+    writer.add_bool("clip.has_vision_encoder", True)
+    writer.add_bool("clip.has_llava_projector", True)
+    writer.add_string("clip.projector_type", "mlp")
+    writer.add_file_type(1)
+    writer.add_name("tiny-clip")
+    writer.add_description("tiny random projector for benchmarks")
+
+    writer.add_uint32("clip.vision.image_size", V_IMAGE_SIZE)
+    writer.add_uint32("clip.vision.patch_size", V_PATCH_SIZE)
+    writer.add_uint32("clip.vision.embedding_length", V_N_EMBD)
+    writer.add_uint32("clip.vision.feed_forward_length", V_N_FF)
+    writer.add_uint32("clip.vision.projection_dim", N_EMBD)
+    writer.add_uint32("clip.vision.attention.head_count", V_N_HEAD)
+    writer.add_float32("clip.vision.attention.layer_norm_epsilon", 1e-5)
+    writer.add_uint32("clip.vision.block_count", V_N_LAYER)
+    writer.add_array("clip.vision.image_mean", [0.48145466, 0.4578275, 0.40821073])
+    writer.add_array("clip.vision.image_std", [0.26862954, 0.26130258, 0.27577711])
+    writer.add_bool("clip.use_gelu", False)
+
+    writer.add_tensor("v.class_embd", rand(V_N_EMBD))
+    writer.add_tensor("v.patch_embd.weight",
+                      rand(V_N_EMBD, 3, V_PATCH_SIZE, V_PATCH_SIZE, dtype=np.float16))
+    writer.add_tensor("v.position_embd.weight", rand(n_pos, V_N_EMBD))
+    writer.add_tensor("v.pre_ln.weight", ones(V_N_EMBD))
+    writer.add_tensor("v.pre_ln.bias", zeros(V_N_EMBD))
+
+    for i in range(V_N_LAYER):
+        for name in ["attn_q", "attn_k", "attn_v", "attn_out"]:
+            writer.add_tensor(f"v.blk.{i}.{name}.weight",
+                              rand(V_N_EMBD, V_N_EMBD))
+            writer.add_tensor(f"v.blk.{i}.{name}.bias", zeros(V_N_EMBD))
+
+        for name in ["ln1", "ln2"]:
+            writer.add_tensor(f"v.blk.{i}.{name}.weight", ones(V_N_EMBD))
+            writer.add_tensor(f"v.blk.{i}.{name}.bias", zeros(V_N_EMBD))
+
+        writer.add_tensor(f"v.blk.{i}.ffn_down.weight", rand(V_N_FF, V_N_EMBD))
+        writer.add_tensor(f"v.blk.{i}.ffn_down.bias", zeros(V_N_FF))
+        writer.add_tensor(f"v.blk.{i}.ffn_up.weight", rand(V_N_EMBD, V_N_FF))
+        writer.add_tensor(f"v.blk.{i}.ffn_up.bias", zeros(V_N_EMBD))
+
+    writer.add_tensor("mm.0.weight", rand(N_EMBD, V_N_EMBD))
+    writer.add_tensor("mm.0.bias", zeros(N_EMBD))
+    writer.add_tensor("mm.2.weight", rand(N_EMBD, N_EMBD))
+    writer.add_tensor("mm.2.bias", zeros(N_EMBD))
+
+    writer.write_header_to_file()
+    writer.write_kv_data_to_file()
+    writer.write_tensors_to_file()
+    writer.close()
+
+
+def main():
+    out_dir = sys.argv[1] if len(sys.argv) > 1 else "."
+    os.makedirs(out_dir, exist_ok=True)
+    np.random.seed(0)
+
+    model_path = os.path.join(out_dir, "tiny-llama.gguf")
+    mmproj_path = os.path.join(out_dir, "tiny-mmproj.gguf")
+
+    make_model(model_path)
+    make_mmproj(mmproj_path)
+
+    print(model_path)
+    print(mmproj_path)
+
+
+if __name__ == "__main__":
+    main()
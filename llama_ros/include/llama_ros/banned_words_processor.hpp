@@ -0,0 +1,51 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef LLAMA_ROS__BANNED_WORDS_PROCESSOR_HPP
+#define LLAMA_ROS__BANNED_WORDS_PROCESSOR_HPP
+
+#include <string>
+#include <vector>
+
+#include "llama_ros/logits_processor.hpp"
+
+namespace llama_ros {
+
+// Never generates the words of the <name>.words parameter. Each word is
+// tokenized with and without a leading space and its last token is banned
+// once the previous ones have been generated.
+class BannedWordsProcessor : public LogitsProcessor {
+
+public:
+  void initialize(rclcpp::Node *node, const std::string &name,
+                  const TokenizeFunction &tokenize, int n_vocab) override;
+
+  void process(float *logits, int n_vocab,
+               const std::vector<llama_token> &response) override;
+
+private:
+  std::vector<std::vector<llama_token>> sequences;
+};
+
+} // namespace llama_ros
+
+#endif
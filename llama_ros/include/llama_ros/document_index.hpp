@@ -0,0 +1,65 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef LLAMA_ROS__DOCUMENT_INDEX_HPP
+#define LLAMA_ROS__DOCUMENT_INDEX_HPP
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace llama_ros {
+
+struct retrieved_document {
+  int id;
+  std::string text;
+  float score;
+};
+
+// In-memory index of normalized chunk embeddings searched by exact inner
+// product, used by the retrieval action of the node.
+class DocumentIndex {
+
+public:
+  void add(const std::string &text, const std::vector<float> &embedding);
+  void clear();
+  size_t size();
+
+  std::vector<struct retrieved_document>
+  search(const std::vector<float> &query, int k);
+  std::vector<struct retrieved_document>
+  rerank(const std::vector<float> &query,
+         const std::vector<struct retrieved_document> &candidates, int k,
+         float lambda);
+
+private:
+  std::mutex mutex;
+  std::vector<std::string> documents;
+  std::vector<std::vector<float>> embeddings;
+
+  float dot(const std::vector<float> &a, const std::vector<float> &b);
+};
+
+} // namespace llama_ros
+
+#endif
@@ -23,15 +23,21 @@
 #ifndef LLAMA_ROS__LLAMA_HPP
 #define LLAMA_ROS__LLAMA_HPP
 
+#include <atomic>
 #include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "common.h"
 #include "common/grammar-parser.h"
 #include "llama.h"
+#include "llama_ros/logits_processor.hpp"
+#include "llama_utils/regex_index.hpp"
+#include "llama_utils/token_trie.hpp"
 #include "llama_utils/spinner.hpp"
 
 // llama logs
@@ -66,6 +72,13 @@ struct response_output {
   stop_type stop;
 };
 
+// logit bias compiled for the vocabulary, dense when it touches many tokens
+struct logit_bias_profile {
+  std::vector<float> dense;
+  std::vector<llama_token> tokens;
+  std::vector<float> biases;
+};
+
 struct embeddings_ouput {
   std::vector<float> embeddings;
   int32_t n_tokens;
@@ -87,12 +100,28 @@ public:
 
   void reset();
   void cancel();
+  bool set_regex(const std::string &pattern);
+  void add_logit_bias_profile(
+      const std::string &name,
+      const std::vector<std::pair<llama_token, float>> &logit_bias);
+  bool remove_logit_bias_profile(const std::string &name);
+  bool set_logit_bias_profile(const std::string &name);
+  void set_logits_processors(
+      const std::vector<std::shared_ptr<LogitsProcessor>> &processors);
+  void enable_kv_tiering(const std::string &type, int threshold, int n_ctx);
+  bool is_kv_tiered();
+  int get_kv_used() { return this->n_kv_used; }
+  int get_kv_size() { return this->n_kv_size; }
 
   embeddings_ouput generate_embeddings(const std::string &input_prompt,
                                        bool normalize = true);
+  std::vector<embeddings_ouput>
+  generate_embeddings(const std::vector<std::string> &input_prompts,
+                      bool normalize = true);
   response_output
   generate_response(const std::string &input_prompt,
-                    GenerateResponseCallback callbakc = nullptr);
+                    GenerateResponseCallback callbakc = nullptr,
+                    const std::vector<llama_token> &response_prefix = {});
 
   const struct llama_context *get_ctx() { return this->ctx; }
   int get_n_ctx() { return llama_n_ctx(this->ctx); }
@@ -104,9 +133,12 @@ public:
     return llama_should_add_bos_token(this->model);
   }
   llama_token get_token_eos() { return llama_token_eos(this->model); }
+  bool has_constraint_failed() { return this->constraint_failed; }
 
 protected:
   std::shared_ptr<struct gpt_params> params;
+  // params the contexts are created with, including the embedding sequences
+  struct gpt_params ctx_params;
 
   // model
   struct llama_context *ctx;
@@ -125,15 +157,47 @@ protected:
   int32_t n_consumed;
   int32_t ga_i;
 
+  // cache usage, read without the lock
+  std::atomic<int> n_kv_used;
+  std::atomic<int> n_kv_size;
+
+  // text of each token and end-of-generation tokens
+  std::shared_ptr<const std::vector<std::string>> token_pieces;
+  std::vector<llama_token> eog_tokens;
+  std::vector<bool> eog_flags;
+
+  // regex constraint
+  std::map<std::string, std::shared_ptr<llama_utils::RegexIndex>> regex_cache;
+  std::shared_ptr<llama_utils::RegexIndex> regex_index;
+  int regex_state;
+
+  // a sampled token broke the grammar or the regex of the goal
+  bool constraint_failed;
+
+  // logit bias profiles
+  std::map<std::string, std::shared_ptr<struct logit_bias_profile>>
+      logit_bias_profiles;
+  std::shared_ptr<struct logit_bias_profile> logit_bias_profile;
+
+  // logits processor plugins of the goal and the tokens they see
+  std::vector<std::shared_ptr<LogitsProcessor>> logits_processors;
+  std::vector<llama_token> response_tokens;
+
   virtual void load_prompt(const std::string &input_prompt, bool add_pfx,
                            bool add_sfx);
 
+  // stopping words, compiled into token sequences with a text fallback
+  std::vector<std::string> stop_words;
+  llama_utils::TokenTrie stop_trie;
+  std::string stop_text;
+  size_t max_stop_len;
+
+  void load_token_pieces();
+  std::string get_token_text(llama_token token);
+  void compile_stop_words(const std::vector<std::string> &stopping_words);
   stop_type
-  find_stop(std::vector<struct completion_output> completion_result_list,
-            std::vector<std::string> stopping_words);
-  stop_type
-  find_stop_word(std::vector<struct completion_output> completion_result_list,
-                 std::string stopping_word);
+  find_stop(std::vector<struct completion_output> completion_result_list);
+  stop_type find_stop_text(const std::string &piece);
 
   bool eval_system_prompt();
   virtual bool eval_prompt();
@@ -143,10 +207,28 @@ protected:
   bool eval(struct llama_batch batch);
 
   std::vector<token_prob> get_probs();
+  void apply_regex();
+  void apply_logit_bias_profile();
   struct completion_output sample();
+  void accept_token(llama_token id);
   void update_sampling_params(const struct llama_sampling_params &params);
 
-private:
+  // kv tiering: recent conversations live in the f16 context, long ones are
+  // moved to a context with a quantized cache and only one of them is kept
+  struct llama_context *ctx_hot;
+  struct llama_context *ctx_cold;
+  std::string kv_tier_type;
+  int kv_tier_threshold;
+  int kv_tier_n_ctx;
+  std::vector<llama_token> kv_tokens;
+  bool kv_has_embd;
+  std::atomic<int> kv_version;
+  std::atomic<bool> kv_tier_running;
+  std::thread kv_tier_worker;
+
+  void start_kv_tiering();
+  void migrate_kv();
+
   // lock
   std::recursive_mutex mutex;
 };
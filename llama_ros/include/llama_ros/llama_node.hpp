@@ -23,19 +23,41 @@
 #ifndef LLAMA_ROS__LLAMA_NODE_HPP
 #define LLAMA_ROS__LLAMA_NODE_HPP
 
+#include <diagnostic_updater/diagnostic_updater.hpp>
+#include <pluginlib/class_loader.hpp>
 #include <rclcpp/rclcpp.hpp>
 #include <rclcpp_action/rclcpp_action.hpp>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "common.h"
 #include "llama.h"
 #include "llama_msgs/action/generate_response.hpp"
+#include "llama_msgs/action/generate_with_retrieval.hpp"
+#include "llama_msgs/msg/goal_heartbeat.hpp"
+#include "llama_msgs/msg/token_stream_descriptor.hpp"
+#include "llama_msgs/srv/add_documents.hpp"
 #include "llama_msgs/srv/generate_embeddings.hpp"
+#include "llama_msgs/srv/set_logit_bias_profile.hpp"
 #include "llama_msgs/srv/tokenize.hpp"
+#include "llama_ros/document_index.hpp"
 #include "llama_ros/llama.hpp"
+#include "llama_ros/logits_processor.hpp"
+#include "llama_ros/prompt_compressor.hpp"
 #include "llama_utils/gpt_params.hpp"
+#include "llama_utils/numa.hpp"
+#include "llama_utils/token_ring.hpp"
 
 namespace llama_ros {
 
@@ -44,36 +66,230 @@ class LlamaNode : public rclcpp::Node {
   using GenerateResponse = llama_msgs::action::GenerateResponse;
   using GoalHandleGenerateResponse =
       rclcpp_action::ServerGoalHandle<GenerateResponse>;
+  using GenerateWithRetrieval = llama_msgs::action::GenerateWithRetrieval;
+  using GoalHandleGenerateWithRetrieval =
+      rclcpp_action::ServerGoalHandle<GenerateWithRetrieval>;
+
+  // embeddings request waiting to be batched
+  struct EmbeddingsRequest {
+    std::shared_ptr<rmw_request_id_t> header;
+    std::shared_ptr<llama_msgs::srv::GenerateEmbeddings::Request> request;
+    int n_tokens;
+    std::chrono::steady_clock::time_point stamp;
+  };
+
+  // identical deterministic goals sharing one generation
+  struct GoalFlight {
+    std::shared_ptr<GoalHandleGenerateResponse> leader;
+    std::vector<std::shared_ptr<GoalHandleGenerateResponse>> followers;
+    std::vector<std::shared_ptr<GenerateResponse::Feedback>> feedbacks;
+  };
+
+  // engine pinned to one NUMA node with its own weights and KV
+  struct LlamaReplica {
+    struct llama_utils::numa_node node;
+    std::shared_ptr<Llama> llama;
+    llama_utils::GptParams gpt_params;
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::shared_ptr<GoalHandleGenerateResponse>> goals;
+    std::shared_ptr<GoalHandleGenerateResponse> current_goal;
+    bool retrieving;
+  };
 
 public:
   LlamaNode(bool load_llama = true);
+  ~LlamaNode();
 
 protected:
   std::shared_ptr<Llama> llama;
+  std::shared_ptr<PromptCompressor> prompt_compressor;
   llama_utils::GptParams gpt_params;
   std::shared_ptr<GoalHandleGenerateResponse> goal_handle_;
 
+  void load_prompt_compressor();
+
+  // logits processor plugins, the loader must outlive the instances
+  std::unique_ptr<pluginlib::ClassLoader<LogitsProcessor>> processor_loader;
+  std::map<Llama *, std::map<std::string, std::shared_ptr<LogitsProcessor>>>
+      logits_processors;
+
+  void load_logits_processors();
+  bool
+  get_logits_processors(std::shared_ptr<Llama> llama,
+                        const std::vector<std::string> &names,
+                        std::vector<std::shared_ptr<LogitsProcessor>> &out);
+
+  // token stream for local readers, described on a latched topic
+  std::unique_ptr<llama_utils::TokenRingWriter> token_ring;
+  rclcpp::Publisher<llama_msgs::msg::TokenStreamDescriptor>::SharedPtr
+      token_stream_pub_;
+
+  void load_token_ring();
+  void start_client_liveness();
   virtual bool goal_empty(std::shared_ptr<const GenerateResponse::Goal> goal);
   virtual void
   execute(const std::shared_ptr<GoalHandleGenerateResponse> goal_handle);
-  void send_text(const struct completion_output &completion);
+  void generate(const std::shared_ptr<GoalHandleGenerateResponse> goal_handle,
+                std::shared_ptr<Llama> llama,
+                llama_utils::GptParams &gpt_params,
+                std::shared_ptr<GenerateResponse::Result> result = nullptr);
+  void
+  finish_goal(const std::shared_ptr<GoalHandleGenerateResponse> goal_handle,
+              std::shared_ptr<GenerateResponse::Result> result, stop_type stop);
+  void log_weight_streaming(llama_utils::GptParams &gpt_params);
+  void send_text(const struct completion_output &completion,
+                 std::shared_ptr<GoalHandleGenerateResponse> goal_handle,
+                 std::shared_ptr<Llama> llama);
+  llama_msgs::msg::PartialResponse
+  create_partial_response(const struct completion_output &completion,
+                          std::shared_ptr<Llama> llama);
+  llama_msgs::msg::Response
+  create_response(const std::vector<struct completion_output> &completions,
+                  std::shared_ptr<Llama> llama);
 
 private:
+  // numa replicas
+  std::atomic<bool> stop_replicas;
+  std::vector<std::unique_ptr<LlamaReplica>> replicas;
+
+  bool create_numa_replicas();
+  void stop_numa_replicas();
+  void run_replica(LlamaReplica *replica, std::promise<bool> loaded);
+  LlamaReplica *get_least_loaded_replica();
+  LlamaReplica *get_idle_replica(bool reserve);
+  void release_replica(LlamaReplica *replica);
+  std::shared_ptr<Llama> get_least_loaded_llama();
+
+  // goal coalescing
+  std::mutex flights_mutex;
+  std::vector<struct GoalFlight> flights;
+
+  static bool
+  is_coalescable(std::shared_ptr<const GenerateResponse::Goal> goal);
+  bool can_join_flight(std::shared_ptr<const GenerateResponse::Goal> goal);
+  bool
+  join_flight(const std::shared_ptr<GoalHandleGenerateResponse> goal_handle);
+  void
+  start_flight(const std::shared_ptr<GoalHandleGenerateResponse> goal_handle);
+  std::vector<std::shared_ptr<GoalHandleGenerateResponse>>
+  get_flight_subscribers(
+      const std::shared_ptr<GoalHandleGenerateResponse> leader,
+      std::shared_ptr<GenerateResponse::Feedback> feedback = nullptr);
+  std::vector<std::shared_ptr<GoalHandleGenerateResponse>>
+  end_flight(const std::shared_ptr<GoalHandleGenerateResponse> leader);
+  std::shared_ptr<GoalHandleGenerateResponse>
+  get_flight_leader(const std::shared_ptr<GoalHandleGenerateResponse> goal);
+  bool is_flight_shared(const std::shared_ptr<GoalHandleGenerateResponse> goal);
+
+  // model cascade, the owner is the model of the current conversation
+  static constexpr int CASCADE_N_PROBS = 8;
+  std::shared_ptr<struct gpt_params> cascade_params;
+  std::shared_ptr<Llama> cascade_llama;
+  std::shared_ptr<Llama> cascade_owner;
+
+  void load_cascade();
+  struct response_output generate_cascade(const std::string &prompt,
+                                          GenerateResponseCallback callback);
+
+  // diagnostics
+  enum generation_phase {
+    PHASE_IDLE = -1,
+    PHASE_PREFILL,
+    PHASE_DECODE,
+    PHASE_PUBLISHING,
+    N_PHASES,
+  };
+
+  static constexpr int TELEMETRY_SHORT_WINDOW = 5;
+  static constexpr int TELEMETRY_LONG_WINDOW = 60;
+
+  std::atomic<int> n_phase_goals[N_PHASES];
+  std::mutex telemetry_mutex;
+  std::deque<std::chrono::steady_clock::time_point> token_times;
+  std::chrono::steady_clock::time_point decode_start;
+  std::unique_ptr<diagnostic_updater::Updater> diagnostics;
+
+  void set_phase(int &phase, int next);
+  void record_token();
+  double get_tokens_per_second(int window_s, double &decode_s);
+  void update_diagnostics(diagnostic_updater::DiagnosticStatusWrapper &stat);
+
+  // client liveness: clients are alive while they send heartbeats for their
+  // goals, running goals whose clients are gone are canceled by the timer.
+  // The heartbeats and the timer have their own callback group so blocking
+  // service callbacks do not hold them back
+  std::mutex liveness_mutex;
+  std::map<rclcpp_action::GoalUUID, std::chrono::steady_clock::time_point>
+      heartbeats;
+  std::chrono::steady_clock::time_point last_client_check;
+  rclcpp::CallbackGroup::SharedPtr liveness_group_;
+  std::set<rclcpp_action::GoalUUID> orphaned_goals;
+  rclcpp::Subscription<llama_msgs::msg::GoalHeartbeat>::SharedPtr
+      heartbeat_sub_;
+  rclcpp::TimerBase::SharedPtr liveness_timer_;
+
+  void heartbeat_callback(const llama_msgs::msg::GoalHeartbeat::SharedPtr msg);
+  void check_clients();
+  void watch_client(const rclcpp_action::GoalUUID &goal_id);
+  bool is_client_alive(const rclcpp_action::GoalUUID &goal_id);
+  bool is_orphaned(const std::shared_ptr<GoalHandleGenerateResponse> leader);
+  bool take_orphaned(const rclcpp_action::GoalUUID &goal_id);
+
+  // embeddings batching
+  std::thread embeddings_worker;
+  std::mutex embeddings_mutex;
+  std::condition_variable embeddings_cv;
+  std::deque<struct EmbeddingsRequest> embeddings_queue;
+  bool stop_embeddings;
+
+  void run_embeddings_worker();
+  void stop_embeddings_worker();
+
+  // retrieval
+  DocumentIndex document_index;
+  std::shared_ptr<GoalHandleGenerateWithRetrieval> retrieval_goal_handle_;
+  std::shared_ptr<Llama> retrieval_llama;
+
+  std::string build_retrieval_prompt(
+      std::shared_ptr<Llama> llama,
+      std::shared_ptr<const GenerateWithRetrieval::Goal> goal,
+      std::shared_ptr<GenerateWithRetrieval::Result> result);
+  void execute_retrieval(
+      const std::shared_ptr<GoalHandleGenerateWithRetrieval> goal_handle);
+
   // ros2
   rclcpp::Service<llama_msgs::srv::Tokenize>::SharedPtr tokenize_service_;
   rclcpp::Service<llama_msgs::srv::GenerateEmbeddings>::SharedPtr
       generate_embeddings_service_;
+  rclcpp::Service<llama_msgs::srv::AddDocuments>::SharedPtr
+      add_documents_service_;
+  rclcpp::Service<llama_msgs::srv::SetLogitBiasProfile>::SharedPtr
+      set_logit_bias_profile_service_;
   rclcpp_action::Server<GenerateResponse>::SharedPtr
       generate_response_action_server_;
+  rclcpp_action::Server<GenerateWithRetrieval>::SharedPtr
+      generate_with_retrieval_action_server_;
 
   // methods
   void tokenize_service_callback(
       const std::shared_ptr<llama_msgs::srv::Tokenize::Request> request,
       std::shared_ptr<llama_msgs::srv::Tokenize::Response> response);
   void generate_embeddings_service_callback(
+      const std::shared_ptr<rmw_request_id_t> request_header,
       const std::shared_ptr<llama_msgs::srv::GenerateEmbeddings::Request>
+          request);
+  void add_documents_service_callback(
+      const std::shared_ptr<llama_msgs::srv::AddDocuments::Request> request,
+      std::shared_ptr<llama_msgs::srv::AddDocuments::Response> response);
+  void set_logit_bias_profile_service_callback(
+      const std::shared_ptr<llama_msgs::srv::SetLogitBiasProfile::Request>
           request,
-      std::shared_ptr<llama_msgs::srv::GenerateEmbeddings::Response> response);
+      std::shared_ptr<llama_msgs::srv::SetLogitBiasProfile::Response>
+          response);
+
+  bool is_busy();
 
   rclcpp_action::GoalResponse
   handle_goal(const rclcpp_action::GoalUUID &uuid,
@@ -82,6 +298,14 @@ private:
   handle_cancel(const std::shared_ptr<GoalHandleGenerateResponse> goal_handle);
   void handle_accepted(
       const std::shared_ptr<GoalHandleGenerateResponse> goal_handle);
+
+  rclcpp_action::GoalResponse handle_retrieval_goal(
+      const rclcpp_action::GoalUUID &uuid,
+      std::shared_ptr<const GenerateWithRetrieval::Goal> goal);
+  rclcpp_action::CancelResponse handle_retrieval_cancel(
+      const std::shared_ptr<GoalHandleGenerateWithRetrieval> goal_handle);
+  void handle_retrieval_accepted(
+      const std::shared_ptr<GoalHandleGenerateWithRetrieval> goal_handle);
 };
 
 } // namespace llama_ros
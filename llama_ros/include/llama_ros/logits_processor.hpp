@@ -0,0 +1,71 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef LLAMA_ROS__LOGITS_PROCESSOR_HPP
+#define LLAMA_ROS__LOGITS_PROCESSOR_HPP
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "llama.h"
+
+// the engine does not depend on rclcpp, plugins include it
+namespace rclcpp {
+class Node;
+} // namespace rclcpp
+
+namespace llama_ros {
+
+// Base class of the logits processor plugins. Processors are loaded with
+// pluginlib when the node starts, one instance per name in the
+// logits_processors parameter and per engine, so each NUMA replica has its
+// own, and goals enable them by name in their sampling config. They run in
+// the sampling loop on the logits buffer of the context, before the
+// llama.cpp samplers build the candidates, so any change is seen by the whole
+// sampling chain.
+class LogitsProcessor {
+
+public:
+  virtual ~LogitsProcessor() {}
+
+  using TokenizeFunction =
+      std::function<std::vector<llama_token>(const std::string &text)>;
+
+  // called once per engine after the model is loaded, parameters of the
+  // processor are declared under its name by the first instance
+  virtual void initialize(rclcpp::Node *node, const std::string &name,
+                          const TokenizeFunction &tokenize, int n_vocab) = 0;
+
+  // called at the start of each goal that enables the processor
+  virtual void reset() {}
+
+  // logits of the next token, modified in place; response holds the tokens
+  // accepted since the goal started, the newest at the back
+  virtual void process(float *logits, int n_vocab,
+                       const std::vector<llama_token> &response) = 0;
+};
+
+} // namespace llama_ros
+
+#endif
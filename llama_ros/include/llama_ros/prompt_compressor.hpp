@@ -0,0 +1,81 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef LLAMA_ROS__PROMPT_COMPRESSOR_HPP
+#define LLAMA_ROS__PROMPT_COMPRESSOR_HPP
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "llama.h"
+
+namespace llama_ros {
+
+// Drops low-information tokens from the <context>...</context> blocks of a
+// prompt before prefill. Tokens are scored by their surprisal under a small
+// auxiliary model and the most predictable ones are removed until the ratio
+// or the token budget is met. Text outside the blocks is never touched.
+class PromptCompressor {
+
+public:
+  PromptCompressor(const std::string &model_path, int n_threads, float ratio,
+                   int budget);
+  ~PromptCompressor();
+
+  bool is_loaded() { return this->ctx != nullptr; }
+  std::string compress(const std::string &prompt);
+
+  static constexpr const char *CONTEXT_BEGIN = "<context>";
+  static constexpr const char *CONTEXT_END = "</context>";
+
+  // splits the prompt into the kept parts and the text of the blocks, parts
+  // has one more element than blocks
+  static void split(const std::string &prompt, std::vector<std::string> &parts,
+                    std::vector<std::string> &blocks);
+
+  // -log p(token) under the logits of the previous position
+  static float get_surprisal(const float *logits, int n_vocab,
+                             llama_token token);
+
+  // marks the tokens to keep, the most surprising ones first, until the ratio
+  // of the tokens or the budget is reached
+  static std::vector<std::vector<bool>>
+  select(const std::vector<std::vector<float>> &scores, float ratio,
+         int budget);
+
+private:
+  struct llama_model *model;
+  struct llama_context *ctx;
+
+  int n_threads;
+  float ratio;
+  int budget;
+  std::mutex mutex;
+
+  std::vector<float> score(const std::vector<llama_token> &tokens);
+};
+
+} // namespace llama_ros
+
+#endif
@@ -0,0 +1,111 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef LLAMA_ROS__COMPUTE_POOL_HPP
+#define LLAMA_ROS__COMPUTE_POOL_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace llama_utils {
+
+enum compute_workload {
+  GENERATION = 0,
+  VISION,
+  EMBEDDINGS,
+  N_WORKLOADS,
+};
+
+struct compute_pool_stats {
+  int64_t n_leases;
+  int64_t n_yield_hits;
+  int64_t n_sleeps;
+  int64_t wait_us;
+};
+
+// Node-wide thread budget shared by every llama context and the clip
+// encoder. It owns no threads: each llama_decode/clip call leases a number of
+// threads from the budget before running and the ggml threads it starts are
+// its own, so concurrent workloads queue instead of oversubscribing the cores.
+//
+// A lease that does not fit yields the CPU for up to yield_us, which catches
+// budget released between tokens without a futex round trip, and then sleeps
+// on the condition variable until it fits.
+class ComputePool {
+
+public:
+  static ComputePool &get_instance();
+
+  // n_threads <= 0 uses all cores, workloads not in priority go last
+  void configure(int n_threads, int yield_us,
+                 const std::vector<compute_workload> &priority);
+
+  int acquire(int n_threads, compute_workload workload);
+  void release(int n_threads);
+
+  int get_n_threads();
+  struct compute_pool_stats get_stats();
+
+  static compute_workload workload_from_string(const std::string &name);
+
+private:
+  ComputePool();
+
+  bool can_acquire(int n_threads, compute_workload workload);
+
+  std::mutex mutex;
+  std::condition_variable cv;
+
+  // budget size, leased threads are not available
+  int n_threads;
+  int n_available;
+  int yield_us;
+  int rank[N_WORKLOADS];
+  int n_waiting[N_WORKLOADS];
+
+  struct compute_pool_stats stats;
+};
+
+// RAII lease of threads from the budget
+class ComputeLease {
+
+public:
+  ComputeLease(int n_threads, compute_workload workload)
+      : n_threads(ComputePool::get_instance().acquire(n_threads, workload)) {}
+  ~ComputeLease() { ComputePool::get_instance().release(this->n_threads); }
+
+  ComputeLease(const ComputeLease &) = delete;
+  ComputeLease &operator=(const ComputeLease &) = delete;
+
+  int get_n_threads() { return this->n_threads; }
+
+private:
+  int n_threads;
+};
+
+} // namespace llama_utils
+
+#endif
@@ -24,11 +24,14 @@
 #define LLAMA_ROS__GPT_PARAMS_HPP
 
 #include <memory>
+#include <string>
+#include <vector>
 #include <rclcpp/rclcpp.hpp>
 
 #include "common.h"
 #include "llama.h"
 #include "llama_msgs/msg/sampling_config.hpp"
+#include "llama_utils/weight_streamer.hpp"
 
 namespace llama_utils {
 
@@ -42,6 +45,52 @@ public:
                          int n_vocab, llama_token token_eos);
 
   bool debug;
+  bool numa_replicas;
+
+  // prompt compression
+  std::string compressor_model;
+  float compression_ratio;
+  int32_t compression_budget;
+
+  // skip encoding near-identical images
+  float image_change_threshold;
+
+  // embeddings batching
+  int32_t embeddings_batch_window_us;
+
+  // high-resolution image tiling
+  int32_t max_image_tiles;
+  int32_t vision_workers;
+  bool lazy_vision;
+
+  // quantized KV tier for long conversations
+  std::string kv_tier_type;
+  int32_t kv_tier_threshold;
+  int32_t kv_tier_n_ctx;
+
+  // low-memory mode: prefetch the mmapped weights of the next layers
+  int32_t prefetch_layers;
+  std::shared_ptr<WeightStreamer> weight_streamer;
+
+  // diagnostics
+  float min_tokens_per_second;
+
+  // shared-memory token stream, 0 disables it
+  int32_t token_ring_capacity;
+
+  // abort goals whose client is gone for this time, 0 disables it
+  int32_t client_timeout_ms;
+
+  // cascade: goals start on a small model and move to the main model when
+  // the mean probability of the last tokens drops below the threshold
+  std::string cascade_model;
+  float cascade_threshold;
+  int32_t cascade_window;
+  bool cascade_reuse_output;
+
+  // logits processor plugins
+  std::vector<std::string> logits_processors;
+
   std::shared_ptr<struct gpt_params> params;
 };
 } // namespace llama_utils
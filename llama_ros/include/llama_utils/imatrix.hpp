@@ -0,0 +1,63 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef LLAMA_ROS__IMATRIX_HPP
+#define LLAMA_ROS__IMATRIX_HPP
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ggml.h"
+
+namespace llama_utils {
+
+// Accumulates the squared activations that reach each weight matrix. It is
+// installed as the eval callback of a context (gpt_params::cb_eval) while
+// calibration prompts are evaluated and the result is passed to
+// llama_model_quantize as importance matrix.
+class ImatrixCollector {
+
+public:
+  static bool eval_callback(struct ggml_tensor *t, bool ask, void *user_data);
+
+  std::unordered_map<std::string, std::vector<float>> get_imatrix();
+  size_t get_n_tensors() { return this->stats.size(); }
+
+private:
+  struct tensor_stats {
+    std::vector<float> values;
+    int ncall = 0;
+  };
+
+  std::mutex mutex;
+  std::vector<float> buffer;
+  std::unordered_map<std::string, struct tensor_stats> stats;
+
+  bool collect(struct ggml_tensor *t, bool ask);
+};
+
+} // namespace llama_utils
+
+#endif
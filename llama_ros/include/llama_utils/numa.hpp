@@ -0,0 +1,49 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef LLAMA_ROS__NUMA_HPP
+#define LLAMA_ROS__NUMA_HPP
+
+#include <string>
+#include <vector>
+
+namespace llama_utils {
+
+struct numa_node {
+  int id;
+  std::vector<int> cpus;
+};
+
+// parse sysfs lists like "0-3,8-11"
+std::vector<int> parse_cpu_list(const std::string &list);
+
+// NUMA nodes with at least one online cpu, empty if sysfs is not available
+std::vector<struct numa_node> get_numa_nodes();
+
+// bind the calling thread to the given cpus, threads created afterwards
+// (including ggml workers) inherit the mask
+bool pin_thread_to_cpus(const std::vector<int> &cpus);
+
+} // namespace llama_utils
+
+#endif
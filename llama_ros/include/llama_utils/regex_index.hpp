@@ -0,0 +1,81 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef LLAMA_ROS__REGEX_INDEX_HPP
+#define LLAMA_ROS__REGEX_INDEX_HPP
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace llama_utils {
+
+// Byte-level regex compiled into a DFA, with a lazily built table from each
+// DFA state to the vocab tokens that keep the match alive and the state each
+// one leads to. The whole generated text must match the pattern. End tokens
+// (eos and end-of-turn markers) close the text and do not move the DFA.
+// Supported syntax: literals, ., [...], [^...], \d \w \s (and negations),
+// groups, |, *, +, ? and {m}, {m,}, {m,n}.
+class RegexIndex {
+
+public:
+  RegexIndex(const std::string &pattern,
+             std::shared_ptr<const std::vector<std::string>> token_pieces,
+             const std::vector<int32_t> &end_tokens = {});
+
+  bool is_valid() { return this->error.empty(); }
+  const std::string &get_error() { return this->error; }
+  int get_n_states() { return (int)this->transitions.size(); }
+
+  int get_start_state() { return 0; }
+  bool is_accepting(int state);
+  bool is_end_token(int32_t token);
+  const std::vector<int32_t> &get_allowed_tokens(int state);
+  const std::vector<int32_t> &get_token_mask(int state);
+  int get_next_state(int state, int32_t token);
+
+private:
+  struct token_table {
+    bool built = false;
+    std::vector<int32_t> tokens; // sorted
+    std::vector<int> next_states;
+    std::vector<int32_t> mask; // sorted, tokens that can be sampled
+  };
+
+  std::string error;
+  std::shared_ptr<const std::vector<std::string>> token_pieces;
+  std::vector<int32_t> end_tokens; // sorted
+
+  std::vector<std::array<int, 256>> transitions; // -1 = dead
+  std::vector<bool> accepting;
+  std::vector<struct token_table> token_tables;
+
+  void compile(const std::string &pattern);
+  void build_token_table(int state);
+};
+
+} // namespace llama_utils
+
+#endif
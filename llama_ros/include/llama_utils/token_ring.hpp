@@ -0,0 +1,202 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef LLAMA_ROS__TOKEN_RING_HPP
+#define LLAMA_ROS__TOKEN_RING_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace llama_utils {
+
+constexpr uint32_t TOKEN_RING_MAGIC = 0x4c52494e; // LRIN
+constexpr uint32_t TOKEN_RING_VERSION = 2;
+constexpr size_t TOKEN_RING_TEXT_SIZE = 88;
+
+enum token_ring_flags : uint32_t {
+  TOKEN_RING_CONTINUATION = 1, // more text of the previous token
+  TOKEN_RING_END = 2,          // end of a stream, the text is the stop reason
+  TOKEN_RING_JOIN = 4,         // the goal follows the stream of the goal id
+                               // in the text
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "the token ring needs lock-free 64-bit atomics");
+
+struct token_ring_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t capacity;
+  uint32_t slot_size;
+  std::atomic<uint64_t> write_seq;
+};
+
+// a slot holds seq + 1 once written and 0 while it is being written
+struct alignas(64) token_ring_slot {
+  std::atomic<uint64_t> seq;
+  uint8_t goal_id[16];
+  int32_t token;
+  uint32_t flags;
+  uint32_t text_len;
+  char text[TOKEN_RING_TEXT_SIZE];
+};
+
+static_assert(sizeof(token_ring_slot) == 128, "unexpected token ring slot");
+
+// Fixed-capacity ring of generated tokens in POSIX shared memory. The node
+// writes every token of every generation and any number of processes on the
+// host follow the stream with a TokenRingReader, without copies per reader.
+// Goals coalesced into a running generation get a join slot instead of a copy
+// of each token. Readers that fall more than capacity slots behind skip the
+// lost tokens. The object is only readable by the user of the node by default
+// and the writer never takes over an existing one.
+class TokenRingWriter {
+
+public:
+  TokenRingWriter(const std::string &name, uint32_t capacity,
+                  mode_t mode = 0600);
+  ~TokenRingWriter();
+
+  bool is_open() { return this->header != nullptr; }
+  const std::string &get_name() { return this->name; }
+  uint32_t get_capacity() { return this->capacity; }
+
+  void write(const uint8_t *goal_id, int32_t token, const std::string &text);
+  void end(const uint8_t *goal_id, const std::string &reason);
+  void join(const uint8_t *goal_id, const uint8_t *leader_id);
+
+private:
+  std::string name;
+  uint32_t capacity;
+  size_t size;
+
+  std::mutex mutex;
+  struct token_ring_header *header;
+  struct token_ring_slot *slots;
+
+  void write_slot(const uint8_t *goal_id, int32_t token, uint32_t flags,
+                  const char *text, size_t text_len);
+};
+
+// Header-only reader for consumers in other processes. It starts at the
+// newest token.
+class TokenRingReader {
+
+public:
+  enum read_result { READ_OK, READ_EMPTY, READ_LOST };
+
+  TokenRingReader(const std::string &name)
+      : size(0), header(nullptr), slots(nullptr), next_seq(0) {
+
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+      return;
+    }
+
+    struct token_ring_header probe;
+    if (pread(fd, &probe, sizeof(probe), 0) != sizeof(probe) ||
+        probe.magic != TOKEN_RING_MAGIC ||
+        probe.version != TOKEN_RING_VERSION ||
+        probe.slot_size != sizeof(struct token_ring_slot)) {
+      close(fd);
+      return;
+    }
+
+    this->size = sizeof(struct token_ring_slot) * (probe.capacity + 1);
+    void *data = mmap(nullptr, this->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+      return;
+    }
+
+    this->header = (struct token_ring_header *)data;
+    this->slots = (struct token_ring_slot *)data + 1;
+    this->next_seq = this->header->write_seq.load(std::memory_order_acquire);
+  }
+
+  ~TokenRingReader() {
+    if (this->header != nullptr) {
+      munmap(this->header, this->size);
+    }
+  }
+
+  bool is_open() { return this->header != nullptr; }
+
+  // copies the next slot, on READ_LOST the reader jumps to the oldest slot
+  read_result read(struct token_ring_slot &out) {
+
+    uint64_t write_seq = this->header->write_seq.load(std::memory_order_acquire);
+
+    if (this->next_seq >= write_seq) {
+      return READ_EMPTY;
+    }
+
+    if (write_seq - this->next_seq > this->header->capacity) {
+      this->next_seq = write_seq - this->header->capacity;
+      return READ_LOST;
+    }
+
+    const auto &slot = this->slots[this->next_seq % this->header->capacity];
+
+    // seqlock, the copy is valid if the slot did not change meanwhile
+    uint64_t seq = slot.seq.load(std::memory_order_acquire);
+    std::memcpy(out.goal_id, slot.goal_id, sizeof(out.goal_id));
+    out.token = slot.token;
+    out.flags = slot.flags;
+    out.text_len = std::min<uint32_t>(slot.text_len, TOKEN_RING_TEXT_SIZE);
+    std::memcpy(out.text, slot.text, out.text_len);
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    if (seq != this->next_seq + 1 ||
+        slot.seq.load(std::memory_order_relaxed) != seq) {
+      if (seq == 0 || seq <= this->next_seq) {
+        return READ_EMPTY;
+      }
+      this->next_seq = write_seq - this->header->capacity;
+      return READ_LOST;
+    }
+
+    out.seq.store(seq, std::memory_order_relaxed);
+    this->next_seq++;
+    return READ_OK;
+  }
+
+private:
+  size_t size;
+  struct token_ring_header *header;
+  const struct token_ring_slot *slots;
+  uint64_t next_seq;
+};
+
+} // namespace llama_utils
+
+#endif
@@ -0,0 +1,69 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef LLAMA_ROS__TOKEN_TRIE_HPP
+#define LLAMA_ROS__TOKEN_TRIE_HPP
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace llama_utils {
+
+enum token_trie_match {
+  TRIE_NO_MATCH = 0,
+  TRIE_PARTIAL_MATCH,
+  TRIE_FULL_MATCH,
+};
+
+// Trie of token sequences matched against a stream of tokens. Every pushed
+// token advances the matches in progress and starts a new one, so sequences
+// are found anywhere in the stream with integer comparisons only.
+class TokenTrie {
+
+public:
+  TokenTrie();
+
+  void clear();
+  void add(const std::vector<int32_t> &tokens);
+  bool empty() { return this->n_sequences == 0; }
+
+  void reset() { this->active.clear(); }
+  token_trie_match push(int32_t token);
+
+private:
+  struct trie_node {
+    std::vector<std::pair<int32_t, int>> children; // sorted by token
+    bool terminal = false;
+  };
+
+  std::vector<struct trie_node> nodes;
+  std::vector<int> active;
+  int n_sequences;
+
+  int get_child(int node, int32_t token);
+};
+
+} // namespace llama_utils
+
+#endif
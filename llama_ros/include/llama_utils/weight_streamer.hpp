@@ -0,0 +1,105 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef LLAMA_ROS__WEIGHT_STREAMER_HPP
+#define LLAMA_ROS__WEIGHT_STREAMER_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "ggml.h"
+
+namespace llama_utils {
+
+struct weight_streamer_stats {
+  int n_layers;
+  float residency;
+  int64_t n_prefetches;
+  int64_t n_stalls;
+  int64_t stall_us;
+};
+
+// Streams the mmapped weights of the repeating layers while the model is
+// evaluated. It is installed as the eval callback of a context
+// (gpt_params::cb_eval): the graph is split at the output node of each layer
+// (l_out-N), and before a layer is computed the pages of the next layers are
+// read into the page cache by a worker thread, so decode does not wait on page
+// faults from slow storage. Layers computed with weights out of memory are
+// counted as stalls. Once a whole graph runs with every layer in memory the
+// callback stops splitting the graph, until the worker finds evicted pages.
+class WeightStreamer {
+
+public:
+  WeightStreamer(int n_prefetch_layers);
+  ~WeightStreamer();
+
+  static bool eval_callback(struct ggml_tensor *t, bool ask, void *user_data);
+
+  struct weight_streamer_stats get_stats();
+
+private:
+  struct page_range {
+    uintptr_t start;
+    size_t size;
+  };
+
+  // layer being evaluated by each context thread
+  struct eval_state {
+    int chunk_layer = -1;
+    bool chunk_resident = true;
+    int64_t chunk_start_us = 0;
+    bool pass_resident = false;
+  };
+
+  bool on_eval(struct ggml_tensor *t, bool ask);
+  int get_layer(struct ggml_tensor *t);
+  bool is_resident(int layer);
+  bool is_all_resident();
+  void run_prefetch();
+
+  int n_prefetch_layers;
+  size_t page_size;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<std::vector<struct page_range>> layers;
+  std::set<const void *> known_weights;
+  std::unordered_map<std::thread::id, struct eval_state> states;
+  std::deque<int> prefetch_queue;
+  struct weight_streamer_stats stats;
+
+  std::atomic<bool> streaming;
+  bool running;
+  std::thread worker;
+};
+
+} // namespace llama_utils
+
+#endif
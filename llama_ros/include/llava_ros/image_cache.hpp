@@ -0,0 +1,54 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef LLAMA_ROS__IMAGE_CACHE_HPP
+#define LLAMA_ROS__IMAGE_CACHE_HPP
+
+#include <cstdint>
+#include <vector>
+
+namespace llava_ros {
+
+// Decides whether a new frame can reuse the cached image embedding. Frames
+// are compared with the thumbnail of the frame that produced the embedding,
+// not with the previous frame, so slow drifts still trigger a re-encode.
+class ImageCache {
+
+public:
+  ImageCache();
+
+  float get_difference(const std::vector<uint8_t> &thumbnail);
+  bool can_reuse(const std::vector<uint8_t> &thumbnail, int n_tiles,
+                 float threshold, float &difference);
+
+  void set_encoded(const std::vector<uint8_t> &thumbnail, int n_tiles);
+  void clear();
+  bool empty() { return this->thumbnail.empty(); }
+
+private:
+  std::vector<uint8_t> thumbnail;
+  int n_tiles;
+};
+
+} // namespace llava_ros
+
+#endif
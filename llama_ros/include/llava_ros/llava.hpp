@@ -38,6 +38,12 @@
 
 namespace llava_ros {
 
+struct rgb_image {
+  std::vector<uint8_t> data;
+  int width;
+  int height;
+};
+
 struct llava_context {
   struct clip_ctx *ctx_clip = NULL;
   struct llama_context *ctx_llama = NULL;
@@ -47,10 +53,18 @@ struct llava_context {
 class Llava : public llama_ros::Llama {
 
 public:
-  Llava(std::shared_ptr<struct gpt_params> params, bool debug = false);
+  Llava(std::shared_ptr<struct gpt_params> params, bool debug = false,
+        int n_vision_workers = 1, bool lazy_vision = false);
   ~Llava();
 
+  bool load_clip();
   bool load_image(std::string base64_str);
+  bool load_image_tiles(const std::vector<struct rgb_image> &tiles);
+  bool reuse_image();
+  int get_clip_image_size();
+  std::vector<std::vector<float>>
+  generate_image_embeddings(const std::vector<struct rgb_image> &images,
+                            bool normalize = true);
   struct llava_image_embed *
   base64_image_to_embed(const std::string &base64_str);
 
@@ -59,12 +73,20 @@ protected:
                    bool add_sfx) override;
   bool eval_image(struct llava_image_embed *image_embed);
   bool eval_prompt();
+  bool encode_images(const std::vector<struct rgb_image> &images,
+                     std::vector<float *> &embeds, std::vector<int> &n_pos);
 
   struct llava_context *ctx_llava;
 
+  // extra clip contexts to encode tiles in parallel, a clip_ctx cannot run
+  // two encodes at the same time
+  std::vector<struct clip_ctx *> clip_workers;
+  int n_vision_workers;
+
   std::string system_prompt;
   std::string user_prompt;
   struct llava_image_embed *image_embed;
+  struct llava_image_embed *last_image_embed;
 
 private:
   void free_image();
@@ -26,12 +26,20 @@
 #include <rclcpp/rclcpp.hpp>
 #include <rclcpp_action/rclcpp_action.hpp>
 
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <opencv2/opencv.hpp>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "common.h"
 #include "llama_msgs/action/generate_response.hpp"
+#include "llama_msgs/srv/generate_image_embeddings.hpp"
 #include "llama_ros/llama_node.hpp"
+#include "llava_ros/image_cache.hpp"
 #include "llava_ros/llava.hpp"
 
 namespace llava_ros {
@@ -42,14 +50,48 @@ class LlavaNode : public llama_ros::LlamaNode {
   using GoalHandleGenerateResponse =
       rclcpp_action::ServerGoalHandle<GenerateResponse>;
 
+  struct ImageEmbeddingsRequest {
+    std::shared_ptr<rmw_request_id_t> header;
+    std::shared_ptr<llama_msgs::srv::GenerateImageEmbeddings::Request>
+        request;
+  };
+
 public:
   LlavaNode();
+  ~LlavaNode();
 
-  std::string base64_encode(unsigned char const *bytes_to_encode, size_t in_len,
-                            bool url = false);
+  static std::string base64_encode(unsigned char const *bytes_to_encode,
+                                   size_t in_len, bool url = false);
 
 protected:
   std::shared_ptr<Llava> llava;
+  ImageCache image_cache;
+
+  rclcpp::Service<llama_msgs::srv::GenerateImageEmbeddings>::SharedPtr
+      generate_image_embeddings_service_;
+
+  void generate_image_embeddings_service_callback(
+      const std::shared_ptr<rmw_request_id_t> request_header,
+      const std::shared_ptr<llama_msgs::srv::GenerateImageEmbeddings::Request>
+          request);
+
+  // requests are answered from a worker since encoding waits for the
+  // running goal
+  std::thread image_embeddings_worker;
+  std::mutex image_embeddings_mutex;
+  std::condition_variable image_embeddings_cv;
+  std::deque<struct ImageEmbeddingsRequest> image_embeddings_queue;
+  bool stop_image_embeddings;
+
+  void run_image_embeddings_worker();
+  void stop_image_embeddings_worker();
+  bool generate_image_embeddings(
+      const llama_msgs::srv::GenerateImageEmbeddings::Request &request,
+      llama_msgs::srv::GenerateImageEmbeddings::Response &response);
+
+  std::vector<struct rgb_image> get_image_tiles(const cv::Mat &image,
+                                                int max_tiles);
+  std::vector<uint8_t> get_thumbnail(const cv::Mat &image);
 
   bool goal_empty(std::shared_ptr<const GenerateResponse::Goal> goal) override;
   void execute(
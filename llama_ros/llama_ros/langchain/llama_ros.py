@@ -46,6 +46,7 @@ class LlamaROS(LLM):
 
     ignore_eos: bool = False
     logit_bias: Dict[int, float] = {}
+    logit_bias_profile: str = ""
 
     temp: float = 0.80
     dynatemp_range: float = 0.0
@@ -116,6 +117,7 @@ class LlamaROS(LLM):
             lb.token = key
             lb.bias = self.logit_bias[key]
             goal.sampling_config.logit_bias.data.append(lb)
+        goal.sampling_config.logit_bias_profile = self.logit_bias_profile
 
         goal.sampling_config.temp = self.temp
         goal.sampling_config.dynatemp_range = self.dynatemp_range
@@ -27,12 +27,15 @@ from threading import Thread, RLock, Event
 
 from rclpy.node import Node
 from rclpy.client import Client
+from rclpy.timer import Timer
+from rclpy.publisher import Publisher
 from rclpy.action import ActionClient
 from rclpy.action.client import ClientGoalHandle
 from rclpy.callback_groups import ReentrantCallbackGroup
 from rclpy.executors import MultiThreadedExecutor
 
 from action_msgs.msg import GoalStatus
+from llama_msgs.msg import GoalHeartbeat
 from llama_msgs.srv import Tokenize
 from llama_msgs.srv import GenerateEmbeddings
 from llama_msgs.action import GenerateResponse
@@ -46,6 +49,8 @@ class LlamaClientNode(Node):
     _action_client: ActionClient = None
     _tokenize_srv_client: Client = None
     _embeddings_srv_client: Client = None
+    _heartbeat_pub: Publisher = None
+    _heartbeat_timer: Timer = None
 
     _action_done_event: Event = Event()
 
@@ -94,6 +99,12 @@ class LlamaClientNode(Node):
             callback_group=self._callback_group
         )
 
+        # heartbeats keep the goal alive when the server checks clients
+        self._heartbeat_pub = self.create_publisher(
+            GoalHeartbeat, "goal_heartbeat", 10)
+        self._heartbeat_timer = self.create_timer(
+            0.2, self._heartbeat_callback, callback_group=self._callback_group)
+
         # executor
         self._executor = MultiThreadedExecutor()
         self._executor.add_node(self)
@@ -141,6 +152,13 @@ class LlamaClientNode(Node):
     def _feedback_callback(self, feedback) -> None:
         pass
 
+    def _heartbeat_callback(self) -> None:
+        with self._goal_handle_lock:
+            if self._goal_handle is not None:
+                msg = GoalHeartbeat()
+                msg.goal_id = self._goal_handle.goal_id.uuid
+                self._heartbeat_pub.publish(msg)
+
     def cancel_generate_text(self) -> None:
         with self._goal_handle_lock:
             if self._goal_handle is not None:
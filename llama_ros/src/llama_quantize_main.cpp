@@ -0,0 +1,308 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "clip.h"
+#include "common.h"
+#include "llama.h"
+#include "llama_ros/llama.hpp"
+#include "llama_utils/imatrix.hpp"
+
+struct quant_type {
+  const char *name;
+  llama_ftype ftype;
+  ggml_type clip_type; // GGML_TYPE_F32 if not supported by clip
+};
+
+static const std::vector<struct quant_type> QUANT_TYPES = {
+    {"Q4_0", LLAMA_FTYPE_MOSTLY_Q4_0, GGML_TYPE_Q4_0},
+    {"Q4_1", LLAMA_FTYPE_MOSTLY_Q4_1, GGML_TYPE_Q4_1},
+    {"Q5_0", LLAMA_FTYPE_MOSTLY_Q5_0, GGML_TYPE_Q5_0},
+    {"Q5_1", LLAMA_FTYPE_MOSTLY_Q5_1, GGML_TYPE_Q5_1},
+    {"Q8_0", LLAMA_FTYPE_MOSTLY_Q8_0, GGML_TYPE_Q8_0},
+    {"Q2_K", LLAMA_FTYPE_MOSTLY_Q2_K, GGML_TYPE_Q2_K},
+    {"Q3_K_S", LLAMA_FTYPE_MOSTLY_Q3_K_S, GGML_TYPE_Q3_K},
+    {"Q3_K_M", LLAMA_FTYPE_MOSTLY_Q3_K_M, GGML_TYPE_Q3_K},
+    {"Q3_K_L", LLAMA_FTYPE_MOSTLY_Q3_K_L, GGML_TYPE_Q3_K},
+    {"Q4_K_S", LLAMA_FTYPE_MOSTLY_Q4_K_S, GGML_TYPE_Q4_K},
+    {"Q4_K_M", LLAMA_FTYPE_MOSTLY_Q4_K_M, GGML_TYPE_Q4_K},
+    {"Q5_K_S", LLAMA_FTYPE_MOSTLY_Q5_K_S, GGML_TYPE_Q5_K},
+    {"Q5_K_M", LLAMA_FTYPE_MOSTLY_Q5_K_M, GGML_TYPE_Q5_K},
+    {"Q6_K", LLAMA_FTYPE_MOSTLY_Q6_K, GGML_TYPE_Q6_K},
+    {"F16", LLAMA_FTYPE_MOSTLY_F16, GGML_TYPE_F32},
+};
+
+static void print_usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s model.gguf output.gguf type [options]\n\n"
+          "options:\n"
+          "  --calibration FILE   prompts (one per line) to build an "
+          "importance matrix\n"
+          "  --mmproj IN OUT      also quantize a llava projector\n"
+          "  --threads N          number of threads (default: %d)\n"
+          "  --ctx N              context size for calibration and checks "
+          "(default: 512)\n"
+          "  --no-check           skip the footprint and throughput check\n"
+          "  --allow-requantize   quantize models that are already quantized, "
+          "this loses more quality than quantizing the F16/F32 model\n\n"
+          "types:",
+          name, get_math_cpu_count());
+  for (auto &t : QUANT_TYPES) {
+    fprintf(stderr, " %s", t.name);
+  }
+  fprintf(stderr, "\n");
+}
+
+static std::unordered_map<std::string, std::vector<float>>
+collect_imatrix(const std::string &model, const std::string &calibration,
+                int n_threads, int n_ctx) {
+
+  std::ifstream file(calibration);
+  if (!file) {
+    LLAMA_LOG_ERROR("Failed to open %s", calibration.c_str());
+    return {};
+  }
+
+  llama_utils::ImatrixCollector collector;
+
+  auto params = std::make_shared<struct gpt_params>();
+  params->model = model;
+  params->n_ctx = n_ctx;
+  params->n_batch = n_ctx;
+  params->n_threads = n_threads;
+  params->n_threads_batch = n_threads;
+  params->n_predict = 1;
+  params->warmup = false;
+  params->cb_eval = llama_utils::ImatrixCollector::eval_callback;
+  params->cb_eval_user_data = &collector;
+
+  {
+    llama_ros::Llama llama(params, false);
+
+    std::string prompt;
+    int n_prompts = 0;
+
+    while (std::getline(file, prompt)) {
+      if (prompt.empty()) {
+        continue;
+      }
+
+      llama.reset();
+      llama.generate_response(prompt);
+      LLAMA_LOG_INFO("Calibration prompt %d evaluated", ++n_prompts);
+    }
+  }
+
+  LLAMA_LOG_INFO("Importance matrix collected for %ld tensors",
+                 collector.get_n_tensors());
+
+  return collector.get_imatrix();
+}
+
+static void check_model(const std::string &model, int n_threads, int n_ctx) {
+
+  gpt_params params;
+  params.model = model;
+  params.n_ctx = n_ctx;
+  params.n_batch = n_ctx;
+  params.n_threads = n_threads;
+  params.n_threads_batch = n_threads;
+
+  struct llama_model *llama_model;
+  struct llama_context *ctx;
+  std::tie(llama_model, ctx) = llama_init_from_gpt_params(params);
+
+  if (llama_model == NULL || ctx == NULL) {
+    LLAMA_LOG_ERROR("Unable to load %s", model.c_str());
+    return;
+  }
+
+  // memory footprint
+  const double mib = 1024.0 * 1024.0;
+  const double model_size = llama_model_size(llama_model) / mib;
+  const double state_size = llama_state_get_size(ctx) / mib;
+
+  LLAMA_LOG_INFO("Memory: weights = %.1f MiB, context (n_ctx = %d) = %.1f "
+                 "MiB, total = %.1f MiB",
+                 model_size, n_ctx, state_size, model_size + state_size);
+
+  // throughput
+  const int n_prompt = std::min(128, n_ctx / 2);
+  const int n_gen = std::min(32, n_ctx / 4);
+
+  std::vector<llama_token> tokens(n_prompt, llama_token_bos(llama_model));
+  struct llama_batch batch = llama_batch_init(n_prompt, 0, 1);
+
+  for (int i = 0; i < n_prompt; i++) {
+    llama_batch_add(batch, tokens[i], i, {0}, i == n_prompt - 1);
+  }
+
+  auto t_start = std::chrono::steady_clock::now();
+  bool ok = llama_decode(ctx, batch) == 0;
+  auto t_prompt = std::chrono::steady_clock::now();
+
+  const int n_vocab = llama_n_vocab(llama_model);
+  int n_past = n_prompt;
+  int last = n_prompt - 1;
+
+  for (int i = 0; ok && i < n_gen; i++) {
+    const float *logits = llama_get_logits_ith(ctx, last);
+    llama_token next = std::max_element(logits, logits + n_vocab) - logits;
+
+    llama_batch_clear(batch);
+    llama_batch_add(batch, next, n_past++, {0}, true);
+    last = 0;
+
+    ok = llama_decode(ctx, batch) == 0;
+  }
+
+  auto t_gen = std::chrono::steady_clock::now();
+  llama_batch_free(batch);
+
+  if (ok) {
+    double prompt_s = std::chrono::duration<double>(t_prompt - t_start).count();
+    double gen_s = std::chrono::duration<double>(t_gen - t_prompt).count();
+
+    LLAMA_LOG_INFO("Throughput (%d threads): prompt = %.2f t/s, generation = "
+                   "%.2f t/s",
+                   n_threads, n_prompt / prompt_s, n_gen / gen_s);
+  } else {
+    LLAMA_LOG_ERROR("Failed to eval during the throughput check");
+  }
+
+  llama_free(ctx);
+  llama_free_model(llama_model);
+}
+
+int main(int argc, char *argv[]) {
+
+  if (argc < 4) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  std::string model_in = argv[1];
+  std::string model_out = argv[2];
+  std::string type_name = argv[3];
+
+  std::string calibration;
+  std::string mmproj_in;
+  std::string mmproj_out;
+  int n_threads = get_math_cpu_count();
+  int n_ctx = 512;
+  bool check = true;
+  bool allow_requantize = false;
+
+  for (int i = 4; i < argc; i++) {
+    std::string arg = argv[i];
+
+    if (arg == "--calibration" && i + 1 < argc) {
+      calibration = argv[++i];
+    } else if (arg == "--mmproj" && i + 2 < argc) {
+      mmproj_in = argv[++i];
+      mmproj_out = argv[++i];
+    } else if (arg == "--threads" && i + 1 < argc) {
+      n_threads = std::atoi(argv[++i]);
+    } else if (arg == "--ctx" && i + 1 < argc) {
+      n_ctx = std::atoi(argv[++i]);
+    } else if (arg == "--no-check") {
+      check = false;
+    } else if (arg == "--allow-requantize") {
+      allow_requantize = true;
+    } else {
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  const struct quant_type *type = nullptr;
+  for (auto &t : QUANT_TYPES) {
+    if (type_name == t.name) {
+      type = &t;
+    }
+  }
+
+  if (type == nullptr) {
+    LLAMA_LOG_ERROR("Unknown quantization type %s", type_name.c_str());
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  log_disable();
+  llama_backend_init();
+
+  // importance matrix
+  std::unordered_map<std::string, std::vector<float>> imatrix;
+  if (!calibration.empty()) {
+    imatrix = collect_imatrix(model_in, calibration, n_threads, n_ctx);
+  }
+
+  // quantize model
+  llama_model_quantize_params qparams = llama_model_quantize_default_params();
+  qparams.ftype = type->ftype;
+  qparams.nthread = n_threads;
+  qparams.allow_requantize = allow_requantize;
+  if (!imatrix.empty()) {
+    qparams.imatrix = &imatrix;
+  }
+
+  LLAMA_LOG_INFO("Quantizing %s to %s as %s", model_in.c_str(),
+                 model_out.c_str(), type->name);
+
+  if (llama_model_quantize(model_in.c_str(), model_out.c_str(), &qparams)) {
+    LLAMA_LOG_ERROR("Failed to quantize %s", model_in.c_str());
+    llama_backend_free();
+    return 1;
+  }
+
+  // quantize projector
+  if (!mmproj_in.empty()) {
+    if (type->clip_type == GGML_TYPE_F32) {
+      LLAMA_LOG_WARN("%s is not supported for projectors, skipping %s",
+                     type->name, mmproj_in.c_str());
+
+    } else if (!clip_model_quantize(mmproj_in.c_str(), mmproj_out.c_str(),
+                                    type->clip_type)) {
+      LLAMA_LOG_ERROR("Failed to quantize %s", mmproj_in.c_str());
+      llama_backend_free();
+      return 1;
+    }
+  }
+
+  if (check) {
+    check_model(model_out, n_threads, n_ctx);
+  }
+
+  llama_backend_free();
+  return 0;
+}
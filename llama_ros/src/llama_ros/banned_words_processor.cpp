@@ -0,0 +1,80 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include <pluginlib/class_list_macros.hpp>
+#include <rclcpp/rclcpp.hpp>
+
+#include "llama_ros/banned_words_processor.hpp"
+
+using namespace llama_ros;
+
+void BannedWordsProcessor::initialize(rclcpp::Node *node,
+                                      const std::string &name,
+                                      const TokenizeFunction &tokenize,
+                                      int n_vocab) {
+
+  // each engine has its own instance, the first one declares the parameter
+  std::vector<std::string> words;
+  if (!node->get_parameter(name + ".words", words)) {
+    words = node->declare_parameter<std::vector<std::string>>(
+        name + ".words", std::vector<std::string>({}));
+  }
+
+  this->sequences.clear();
+
+  for (const auto &word : words) {
+    for (const auto &text : {word, " " + word}) {
+      auto tokens = tokenize(text);
+
+      if (!tokens.empty() && tokens.back() < n_vocab) {
+        this->sequences.push_back(tokens);
+      }
+    }
+  }
+
+  RCLCPP_INFO(node->get_logger(), "%s bans %ld words", name.c_str(),
+              words.size());
+}
+
+void BannedWordsProcessor::process(float *logits, int n_vocab,
+                                   const std::vector<llama_token> &response) {
+  (void)n_vocab;
+
+  for (const auto &sequence : this->sequences) {
+    size_t n_prefix = sequence.size() - 1;
+
+    // words started in the prompt are not banned
+    if (n_prefix <= response.size() &&
+        std::equal(sequence.begin(), sequence.end() - 1,
+                   response.end() - n_prefix)) {
+      logits[sequence.back()] = -INFINITY;
+    }
+  }
+}
+
+PLUGINLIB_EXPORT_CLASS(llama_ros::BannedWordsProcessor,
+                       llama_ros::LogitsProcessor)
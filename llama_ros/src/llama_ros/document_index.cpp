@@ -0,0 +1,142 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <algorithm>
+#include <cmath>
+
+#include "llama_ros/document_index.hpp"
+
+using namespace llama_ros;
+
+void DocumentIndex::add(const std::string &text,
+                        const std::vector<float> &embedding) {
+  std::lock_guard<std::mutex> lk(this->mutex);
+  this->documents.push_back(text);
+  this->embeddings.push_back(embedding);
+}
+
+void DocumentIndex::clear() {
+  std::lock_guard<std::mutex> lk(this->mutex);
+  this->documents.clear();
+  this->embeddings.clear();
+}
+
+size_t DocumentIndex::size() {
+  std::lock_guard<std::mutex> lk(this->mutex);
+  return this->documents.size();
+}
+
+float DocumentIndex::dot(const std::vector<float> &a,
+                         const std::vector<float> &b) {
+  float sum = 0.0f;
+  for (size_t i = 0; i < std::min(a.size(), b.size()); i++) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+/*
+*****************************
+*          SEARCH           *
+*****************************
+*/
+std::vector<struct retrieved_document>
+DocumentIndex::search(const std::vector<float> &query, int k) {
+
+  std::lock_guard<std::mutex> lk(this->mutex);
+
+  std::vector<struct retrieved_document> results;
+
+  for (size_t i = 0; i < this->embeddings.size(); i++) {
+    results.push_back(
+        {(int)i, this->documents[i], this->dot(query, this->embeddings[i])});
+  }
+
+  k = std::min(k, (int)results.size());
+  std::partial_sort(results.begin(), results.begin() + k, results.end(),
+                    [](const retrieved_document &a,
+                       const retrieved_document &b) {
+                      return a.score > b.score;
+                    });
+  results.resize(k);
+
+  return results;
+}
+
+/*
+*****************************
+*          RERANK           *
+*****************************
+*/
+std::vector<struct retrieved_document> DocumentIndex::rerank(
+    const std::vector<float> &query,
+    const std::vector<struct retrieved_document> &candidates, int k,
+    float lambda) {
+
+  std::lock_guard<std::mutex> lk(this->mutex);
+
+  // maximal marginal relevance: pick the candidate most similar to the query
+  // and least similar to the ones already picked
+  std::vector<struct retrieved_document> results;
+  std::vector<bool> picked(candidates.size(), false);
+
+  while ((int)results.size() < k && results.size() < candidates.size()) {
+
+    int best = -1;
+    float best_score = -INFINITY;
+
+    for (size_t i = 0; i < candidates.size(); i++) {
+      // the index may have been cleared since the search
+      if (picked[i] || candidates[i].id >= (int)this->embeddings.size()) {
+        continue;
+      }
+
+      const auto &embd = this->embeddings[candidates[i].id];
+      float redundancy = -INFINITY;
+
+      for (const auto &result : results) {
+        redundancy =
+            std::max(redundancy, this->dot(embd, this->embeddings[result.id]));
+      }
+
+      float score = lambda * this->dot(query, embd);
+      if (!results.empty()) {
+        score -= (1.0f - lambda) * redundancy;
+      }
+
+      if (score > best_score) {
+        best_score = score;
+        best = i;
+      }
+    }
+
+    if (best == -1) {
+      break;
+    }
+
+    picked[best] = true;
+    results.push_back(candidates[best]);
+  }
+
+  return results;
+}
@@ -20,18 +20,32 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <memory>
+#include <set>
+#include <stdexcept>
 #include <thread>
 
 #include "common.h"
 #include "llama_ros/llama.hpp"
+#include "llama_utils/compute_pool.hpp"
 
 using namespace llama_ros;
 
+// compiled regex kept between goals
+static const size_t MAX_REGEX_CACHE = 32;
+
+// embedding prompts evaluated together, one sequence each
+static const int MAX_EMBEDDINGS_SEQS = 64;
+
 Llama::Llama(std::shared_ptr<struct gpt_params> params, bool debug)
-    : params(params), debug(debug) {
+    : params(params), debug(debug), n_kv_used(0), n_kv_size(0),
+      constraint_failed(false), max_stop_len(0), ctx_cold(nullptr),
+      kv_tier_threshold(0),
+      kv_tier_n_ctx(0), kv_has_embd(false), kv_version(0),
+      kv_tier_running(false) {
 
   // disable llama.cpp logs
   log_disable();
@@ -43,7 +57,16 @@ Llama::Llama(std::shared_ptr<struct gpt_params> params, bool debug)
   llama_backend_init();
   llama_numa_init(this->params->numa);
 
-  std::tie(this->model, this->ctx) = llama_init_from_gpt_params(*this->params);
+  // embedding batches use a sequence per prompt next to the conversation
+  this->ctx_params = *this->params;
+  if (this->ctx_params.embedding) {
+    this->ctx_params.n_parallel =
+        std::max(this->ctx_params.n_parallel, MAX_EMBEDDINGS_SEQS + 1);
+  }
+
+  std::tie(this->model, this->ctx) =
+      llama_init_from_gpt_params(this->ctx_params);
+  this->ctx_hot = this->ctx;
   this->ctx_sampling = llama_sampling_init(this->params->sparams);
 
   if (this->model == NULL) {
@@ -89,8 +112,20 @@ Llama::Llama(std::shared_ptr<struct gpt_params> params, bool debug)
 }
 
 Llama::~Llama() {
+  if (this->kv_tier_worker.joinable()) {
+    this->kv_version++;
+    this->kv_tier_worker.join();
+  }
+
+  if (this->ctx_cold != nullptr) {
+    llama_free(this->ctx_cold);
+  }
+
+  if (this->ctx_hot != nullptr) {
+    llama_free(this->ctx_hot);
+  }
+
   llama_sampling_free(this->ctx_sampling);
-  llama_free(this->ctx);
   llama_free_model(this->model);
   llama_backend_free();
 }
@@ -103,8 +138,8 @@ Llama::~Llama() {
 */
 std::vector<llama_token> Llama::tokenize(const std::string &text, bool add_bos,
                                          bool special) {
-  std::lock_guard<std::recursive_mutex> lk(this->mutex);
-  return llama_tokenize(this->ctx, text, add_bos, special);
+  // only the vocabulary is read, so it does not wait for the running goal
+  return llama_tokenize(this->model, text, add_bos, special);
 }
 
 std::string Llama::detokenize(const std::vector<llama_token> &tokens) {
@@ -120,11 +155,35 @@ std::string Llama::detokenize(const std::vector<llama_token> &tokens) {
 */
 void Llama::reset() {
 
+  std::lock_guard<std::recursive_mutex> lk(this->mutex);
+
+  // back to the f16 context, a running migration is dropped
+  if (this->ctx_cold != nullptr) {
+    struct llama_context *hot = llama_new_context_with_model(
+        this->model, llama_context_params_from_gpt_params(this->ctx_params));
+
+    if (hot != nullptr) {
+      llama_free(this->ctx_cold);
+      this->ctx_cold = nullptr;
+      this->ctx_hot = hot;
+    } else {
+      LLAMA_LOG_ERROR("Failed to restore the f16 KV context, keeping %s",
+                      this->kv_tier_type.c_str());
+    }
+  }
+
+  this->ctx = this->ctx_hot != nullptr ? this->ctx_hot : this->ctx_cold;
+  this->kv_tokens.clear();
+  this->kv_has_embd = false;
+  this->kv_version++;
+
   llama_kv_cache_clear(this->ctx);
   llama_sampling_reset(this->ctx_sampling);
 
   this->canceled = false;
   this->n_past = 0;
+  this->n_kv_used = 0;
+  this->n_kv_size = this->get_n_ctx();
   this->n_remain = this->params->n_predict;
   this->n_consumed = 0;
   this->ga_i = 0;
@@ -151,90 +210,153 @@ void Llama::cancel() { this->canceled = true; }
 */
 embeddings_ouput Llama::generate_embeddings(const std::string &input_prompt,
                                             bool normalize) {
+  return this->generate_embeddings(std::vector<std::string>{input_prompt},
+                                   normalize)
+      .front();
+}
+
+std::vector<embeddings_ouput>
+Llama::generate_embeddings(const std::vector<std::string> &input_prompts,
+                           bool normalize) {
 
   std::lock_guard<std::recursive_mutex> lk(this->mutex);
 
   const int n_embd = this->get_n_embd();
 
-  embeddings_ouput output;
-  output.embeddings = std::vector<float>(n_embd, 0.0f);
-  output.n_tokens = 0;
+  std::vector<embeddings_ouput> outputs(input_prompts.size());
+  for (auto &output : outputs) {
+    output.embeddings = std::vector<float>(n_embd, 0.0f);
+    output.n_tokens = 0;
+  }
 
   if (!this->is_embedding()) {
     LLAMA_LOG_ERROR(
         "Llama must be created with embedding=true to create embeddings");
-    return output;
+    return outputs;
   }
 
-  auto tokens =
-      this->tokenize(input_prompt, this->should_add_bos_token(), false);
-
-  if ((int)tokens.size() > this->get_n_ctx()) {
-    LLAMA_LOG_ERROR("Prompt too long %ld, context size is %d", tokens.size(),
-                    this->get_n_ctx());
-    return output;
+  // pooled embeddings use non-causal attention in most models, which needs
+  // every sequence in a single ubatch, and seq 0 is the conversation
+  int n_batch = this->params->n_batch;
+  if (llama_pooling_type(this->ctx) != LLAMA_POOLING_TYPE_NONE) {
+    n_batch = std::min(n_batch, (int)llama_n_ubatch(this->ctx));
   }
+  const size_t max_seqs = std::max(1, (int)llama_n_seq_max(this->ctx) - 1);
 
-  if ((int)tokens.size() > this->params->n_batch) {
-    LLAMA_LOG_WARN("Prompt too long %ld, batch size %d, truncating...",
-                   tokens.size(), this->params->n_batch);
-    tokens.resize(this->params->n_batch);
-  }
+  // tokenize, prompts that can't be evaluated are left empty
+  std::vector<std::vector<llama_token>> prompts_tokens;
 
-  // add eos if not present
-  if (tokens.back() != this->get_token_eos()) {
-    tokens.push_back(this->get_token_eos());
-  }
+  for (const auto &input_prompt : input_prompts) {
+    auto tokens =
+        this->tokenize(input_prompt, this->should_add_bos_token(), false);
 
-  // llama eval
-  struct llama_batch batch = llama_batch_init(this->params->n_batch, 0, 1);
-  for (size_t i = 0; i < tokens.size(); i++) {
-    llama_batch_add(batch, tokens[i], i, {1}, i == tokens.size() - 1);
-  }
+    if ((int)tokens.size() > this->get_n_ctx()) {
+      LLAMA_LOG_ERROR("Prompt too long %ld, context size is %d",
+                      tokens.size(), this->get_n_ctx());
+      tokens.clear();
 
-  if (llama_decode(this->ctx, batch)) {
-    LLAMA_LOG_ERROR("Failed to eval");
-    return output;
+    } else {
+      if ((int)tokens.size() >= n_batch) {
+        LLAMA_LOG_WARN("Prompt too long %ld, batch size %d, truncating...",
+                       tokens.size(), n_batch);
+        tokens.resize(n_batch - 1);
+      }
+
+      // add eos if not present
+      if (tokens.empty() || tokens.back() != this->get_token_eos()) {
+        tokens.push_back(this->get_token_eos());
+      }
+    }
+
+    prompts_tokens.push_back(tokens);
   }
 
-  // get embeddings
-  std::vector<float> embd_res(n_embd, 0.0f);
+  // llama eval, one sequence per prompt packed in as few batches as possible
+  struct llama_batch batch = llama_batch_init(n_batch, 0, 1);
+  size_t first = 0;
 
-  for (int i = 0; i < batch.n_tokens; ++i) {
+  while (first < prompts_tokens.size()) {
 
-    if (!batch.logits[i]) {
-      continue;
-    }
+    llama_batch_clear(batch);
+    size_t last = first;
 
-    const float *embd = llama_get_embeddings_seq(this->ctx, batch.seq_id[i][0]);
-    if (embd == NULL) {
-      embd = llama_get_embeddings_ith(this->ctx, i);
+    while (last < prompts_tokens.size() && last - first < max_seqs) {
+      const auto &tokens = prompts_tokens[last];
+
+      if (batch.n_tokens > 0 && batch.n_tokens + (int)tokens.size() > n_batch) {
+        break;
+      }
+
+      // seq 0 is the conversation
+      llama_seq_id seq_id = last - first + 1;
+      for (size_t i = 0; i < tokens.size(); i++) {
+        llama_batch_add(batch, tokens[i], i, {seq_id}, i == tokens.size() - 1);
+      }
+
+      last++;
     }
 
-    if (embd == NULL) {
-      LLAMA_LOG_ERROR("Failed to get embeddings");
-      continue;
+    bool failed = false;
+
+    {
+      llama_utils::ComputeLease lease(this->params->n_threads_batch,
+                                      llama_utils::EMBEDDINGS);
+      llama_set_n_threads(this->ctx, lease.get_n_threads(),
+                          lease.get_n_threads());
+
+      if (batch.n_tokens > 0 && llama_decode(this->ctx, batch)) {
+        LLAMA_LOG_ERROR("Failed to eval");
+        failed = true;
+      }
     }
 
-    if (normalize) {
-      llama_embd_normalize(embd, embd_res.data(), n_embd);
+    // get embeddings
+    for (int i = 0; !failed && i < batch.n_tokens; ++i) {
 
-    } else {
-      for (int i = 0; i < n_embd; i++) {
-        embd_res.data()[i] = embd[i];
+      if (!batch.logits[i]) {
+        continue;
       }
+
+      const llama_seq_id seq_id = batch.seq_id[i][0];
+      auto &output = outputs[first + seq_id - 1];
+
+      const float *embd = llama_get_embeddings_seq(this->ctx, seq_id);
+      if (embd == NULL) {
+        embd = llama_get_embeddings_ith(this->ctx, i);
+      }
+
+      if (embd == NULL) {
+        LLAMA_LOG_ERROR("Failed to get embeddings");
+        continue;
+      }
+
+      if (normalize) {
+        llama_embd_normalize(embd, output.embeddings.data(), n_embd);
+
+      } else {
+        for (int j = 0; j < n_embd; j++) {
+          output.embeddings[j] = embd[j];
+        }
+      }
+
+      output.n_tokens = prompts_tokens[first + seq_id - 1].size();
+    }
+
+    // clear, a failed decode may have left part of the batch in the cache
+    for (size_t s = first; s < last; s++) {
+      llama_kv_cache_seq_rm(this->ctx, s - first + 1, 0, -1);
     }
+
+    if (failed) {
+      break;
+    }
+
+    first = last;
   }
 
-  // clear
-  llama_kv_cache_seq_rm(this->ctx, 1, 0, -1);
   llama_batch_free(batch);
 
-  // result
-  output.embeddings = embd_res;
-  output.n_tokens = tokens.size();
-
-  return output;
+  return outputs;
 }
 
 /*
@@ -242,8 +364,10 @@ embeddings_ouput Llama::generate_embeddings(const std::string &input_prompt,
 *     GENERATE RESPONSE     *
 *****************************
 */
-response_output Llama::generate_response(const std::string &input_prompt,
-                                         GenerateResponseCallback callback) {
+response_output
+Llama::generate_response(const std::string &input_prompt,
+                         GenerateResponseCallback callback,
+                         const std::vector<llama_token> &response_prefix) {
 
   std::lock_guard<std::recursive_mutex> lk(this->mutex);
 
@@ -255,10 +379,18 @@ response_output Llama::generate_response(const std::string &input_prompt,
 
   // load params
   this->update_sampling_params(this->params->sparams);
+  this->regex_state = 0;
+  this->constraint_failed = false;
+  this->compile_stop_words(this->params->antiprompt);
 
   // load prompt
   this->load_prompt(input_prompt, true, true);
 
+  // continue a response started by another engine with the same vocab
+  this->prompt_tokens.insert(this->prompt_tokens.end(),
+                             response_prefix.begin(), response_prefix.end());
+  this->n_remain -= response_prefix.size();
+
   // show sampling info
   if (this->debug) {
     LLAMA_LOG_INFO("Sampling params: \n%s\n",
@@ -275,15 +407,20 @@ response_output Llama::generate_response(const std::string &input_prompt,
 
   // eval prompt
   if (!this->eval_prompt()) {
-    output.stop = stop_type::ABORT;
+    output.stop = this->canceled ? stop_type::CANCEL : stop_type::ABORT;
     return output;
   }
 
+  // the grammar and the regex start after the continued response
+  this->response_tokens.clear();
+  for (auto token : response_prefix) {
+    this->accept_token(token);
+  }
+
   // generation loop
   while (this->n_remain != 0) {
 
-    stop_type stopping =
-        this->find_stop(completion_result_list, this->params->antiprompt);
+    stop_type stopping = this->find_stop(completion_result_list);
 
     if (stopping == FULL_STOP) {
       if (this->canceled) {
@@ -322,6 +459,9 @@ response_output Llama::generate_response(const std::string &input_prompt,
 
   LLAMA_LOG_INFO("Finish Response Generation");
 
+  // move long conversations to the quantized cache
+  this->start_kv_tiering();
+
   if (this->debug) {
     llama_print_timings(this->ctx);
   }
@@ -392,26 +532,142 @@ void Llama::load_prompt(const std::string &input_prompt, bool add_pfx,
 *           STOP            *
 *****************************
 */
-stop_type
-Llama::find_stop(std::vector<struct completion_output> completion_result_list,
-                 std::vector<std::string> stopping_words) {
-
-  // check if stop appears at the end of the output
-  const int n_prev = 32;
-  const std::string last_output =
-      llama_sampling_prev_str(this->ctx_sampling, this->ctx, n_prev);
-
-  if (this->params->antiprompt.at(0).size() &&
-      last_output.find(
-          this->params->antiprompt.at(0).c_str(),
-          last_output.length() - this->params->antiprompt.at(0).length(),
-          this->params->antiprompt.at(0).length()) != std::string::npos) {
-    return FULL_STOP;
+void Llama::load_token_pieces() {
+
+  if (this->token_pieces != nullptr) {
+    return;
   }
 
-  // eos
-  if (llama_sampling_last(this->ctx_sampling) == this->get_token_eos()) {
-    return FULL_STOP;
+  // end-of-turn markers of chat templates, some models only flag one of them
+  static const std::set<std::string> eot_markers = {
+      "</s>",          "<|endoftext|>",         "<|end_of_text|>",
+      "<|eot_id|>",    "<|im_end|>",            "<|end|>",
+      "<end_of_turn>", "<|END_OF_TURN_TOKEN|>",
+  };
+
+  auto pieces = std::make_shared<std::vector<std::string>>();
+  std::vector<char> buf(64);
+
+  this->eog_tokens.clear();
+  this->eog_flags.assign(this->get_n_vocab(), false);
+
+  for (llama_token t = 0; t < this->get_n_vocab(); t++) {
+    int n =
+        llama_token_to_piece(this->model, t, buf.data(), buf.size(), false);
+    if (n < 0) {
+      buf.resize(-n);
+      n = llama_token_to_piece(this->model, t, buf.data(), buf.size(), false);
+    }
+
+    pieces->emplace_back(buf.data(), std::max(n, 0));
+
+    // control tokens have no text
+    if (llama_token_is_eog(this->model, t) ||
+        (pieces->back().empty() &&
+         eot_markers.count(this->get_token_text(t)))) {
+      this->eog_tokens.push_back(t);
+      this->eog_flags[t] = true;
+      pieces->back().clear();
+    }
+  }
+
+  this->token_pieces = pieces;
+}
+
+std::string Llama::get_token_text(llama_token token) {
+
+  std::vector<char> buf(64);
+  int n =
+      llama_token_to_piece(this->model, token, buf.data(), buf.size(), true);
+  if (n < 0) {
+    buf.resize(-n);
+    n = llama_token_to_piece(this->model, token, buf.data(), buf.size(), true);
+  }
+
+  return std::string(buf.data(), std::max(n, 0));
+}
+
+void Llama::compile_stop_words(
+    const std::vector<std::string> &stopping_words) {
+
+  this->load_token_pieces();
+
+  this->stop_trie.reset();
+  this->stop_text.clear();
+
+  if (stopping_words == this->stop_words && this->max_stop_len > 0) {
+    return;
+  }
+
+  this->stop_words = stopping_words;
+  this->stop_trie.clear();
+  this->max_stop_len = 0;
+
+  for (const auto &word : stopping_words) {
+
+    if (word.empty()) {
+      continue;
+    }
+
+    this->max_stop_len = std::max(this->max_stop_len, word.size());
+
+    // the word as tokenized, after a space and split in two at each
+    // character, as the model may generate it in any of these pieces
+    std::set<std::vector<llama_token>> sequences;
+    sequences.insert(this->tokenize(word, false, true));
+    sequences.insert(this->tokenize(" " + word, false, true));
+
+    for (size_t i = 1; i < word.size(); i++) {
+      if ((word[i] & 0xC0) == 0x80) {
+        continue;
+      }
+
+      auto sequence = this->tokenize(word.substr(0, i), false, true);
+      auto suffix = this->tokenize(word.substr(i), false, true);
+      sequence.insert(sequence.end(), suffix.begin(), suffix.end());
+      sequences.insert(sequence);
+    }
+
+    // tokenizers may add a space prefix to each piece
+    for (const auto &sequence : sequences) {
+      std::string text;
+      for (llama_token t : sequence) {
+        text += this->get_token_text(t);
+      }
+
+      if (text == word || text == " " + word) {
+        this->stop_trie.add(sequence);
+      }
+    }
+  }
+}
+
+stop_type Llama::find_stop(
+    std::vector<struct completion_output> completion_result_list) {
+
+  llama_utils::token_trie_match match = llama_utils::TRIE_NO_MATCH;
+  stop_type text_stop = NO_STOP;
+
+  // the last token is the only new one since the previous call
+  if (!completion_result_list.empty()) {
+    llama_token token = completion_result_list.back().token;
+
+    // eos, eot and other end-of-turn tokens, ignore_eos only lets eos pass
+    if (this->eog_flags.at(token) &&
+        !(this->params->ignore_eos && token == this->get_token_eos())) {
+      return FULL_STOP;
+    }
+
+    match = this->stop_trie.push(token);
+    if (match == llama_utils::TRIE_FULL_MATCH) {
+      return FULL_STOP;
+    }
+
+    // words generated in pieces that do not start at a token boundary
+    text_stop = this->find_stop_text(this->token_pieces->at(token));
+    if (text_stop == FULL_STOP) {
+      return FULL_STOP;
+    }
   }
 
   // action server is canceled
@@ -430,43 +686,51 @@ Llama::find_stop(std::vector<struct completion_output> completion_result_list,
     return FULL_STOP;
   }
 
-  for (auto w : stopping_words) {
-    stop_type s = this->find_stop_word(completion_result_list, w);
-    if (s != NO_STOP) {
-      return s;
-    }
+  if (match == llama_utils::TRIE_PARTIAL_MATCH || text_stop == PARTIAL_STOP) {
+    return PARTIAL_STOP;
   }
 
   return NO_STOP;
 }
 
-stop_type Llama::find_stop_word(
-    std::vector<struct completion_output> completion_result_list,
-    std::string stopping_word) {
+stop_type Llama::find_stop_text(const std::string &piece) {
 
-  // check new token sequence size
-  if (completion_result_list.size() <= stopping_word.size() &&
-      completion_result_list.size() && stopping_word.size()) {
+  if (this->max_stop_len == 0) {
+    return NO_STOP;
+  }
 
-    std::string completion_text = "";
-    for (auto c : completion_result_list) {
-      completion_text.append(this->detokenize({c.token}));
-    }
+  this->stop_text += piece;
+  stop_type stop = NO_STOP;
 
-    for (size_t i = 0; i < completion_text.size(); i++) {
-      if (completion_text.at(i) != stopping_word.at(i)) {
-        return NO_STOP;
-      }
+  for (const auto &word : this->stop_words) {
+
+    if (word.empty()) {
+      continue;
     }
 
-    if (completion_text.size() == stopping_word.size()) {
+    if (this->stop_text.size() >= word.size() &&
+        this->stop_text.compare(this->stop_text.size() - word.size(),
+                                word.size(), word) == 0) {
+      this->stop_text.clear();
       return FULL_STOP;
-    } else {
-      return PARTIAL_STOP;
+    }
+
+    // the end of the text may be the start of the word
+    for (size_t n = std::min(word.size() - 1, this->stop_text.size()); n > 0;
+         n--) {
+      if (this->stop_text.compare(this->stop_text.size() - n, n, word, 0,
+                                  n) == 0) {
+        stop = PARTIAL_STOP;
+        break;
+      }
     }
   }
 
-  return NO_STOP;
+  if (this->stop_text.size() > this->max_stop_len) {
+    this->stop_text.erase(0, this->stop_text.size() - this->max_stop_len);
+  }
+
+  return stop;
 }
 
 /*
@@ -506,7 +770,8 @@ bool Llama::eval_prompt(std::vector<llama_token> prompt_tokens) {
       ++this->n_consumed;
     }
 
-    if (!this->eval(batch)) {
+    // long prompts can be canceled between batches
+    if (this->canceled || !this->eval(batch)) {
       return false;
     }
 
@@ -556,6 +821,13 @@ bool Llama::eval(struct llama_batch batch) {
                                n_past, -n_discard);
 
         this->n_past -= n_discard;
+
+        if ((int)this->kv_tokens.size() >= this->params->n_keep + n_discard) {
+          this->kv_tokens.erase(this->kv_tokens.begin() + this->params->n_keep,
+                                this->kv_tokens.begin() +
+                                    this->params->n_keep + n_discard);
+        }
+        this->kv_version++;
       }
 
     } else {
@@ -602,15 +874,32 @@ bool Llama::eval(struct llama_batch batch) {
         this->spinner.spin("EVALUATING " + std::to_string(n_eval) + " TOKENS");
       }
 
+      llama_utils::ComputeLease lease(n_eval > 1 ? this->params->n_threads_batch
+                                                 : this->params->n_threads,
+                                      llama_utils::GENERATION);
+      llama_set_n_threads(this->ctx, lease.get_n_threads(),
+                          lease.get_n_threads());
+
       if (llama_decode(this->ctx, batch_view)) {
         LLAMA_LOG_ERROR("Failed to eval");
         return false;
       }
 
       this->n_past += n_eval;
+
+      // tokens in the cache, to rebuild it in another context
+      if (batch_view.token != nullptr) {
+        this->kv_tokens.insert(this->kv_tokens.end(), batch_view.token,
+                               batch_view.token + n_eval);
+      } else {
+        this->kv_has_embd = true;
+      }
     }
   }
 
+  this->n_kv_used = this->n_past;
+  this->n_kv_size = this->get_n_ctx();
+
   return true;
 }
 
@@ -640,9 +929,26 @@ std::vector<token_prob> Llama::get_probs() {
 
 struct completion_output Llama::sample() {
 
+  if (this->logit_bias_profile != nullptr) {
+    this->apply_logit_bias_profile();
+  }
+
+  // plugins work on the logits buffer of the context
+  if (!this->logits_processors.empty()) {
+    float *logits = llama_get_logits_ith(this->ctx, 0);
+    for (auto &processor : this->logits_processors) {
+      processor->process(logits, this->get_n_vocab(), this->response_tokens);
+    }
+  }
+
+  // constrain the token to the regex
+  if (this->regex_index != nullptr) {
+    this->apply_regex();
+  }
+
   // sample token
   llama_token id = llama_sampling_sample(this->ctx_sampling, this->ctx, NULL);
-  llama_sampling_accept(this->ctx_sampling, this->ctx, id, true);
+  this->accept_token(id);
 
   // create output
   struct completion_output result;
@@ -653,6 +959,329 @@ struct completion_output Llama::sample() {
   return result;
 }
 
+void Llama::accept_token(llama_token id) {
+
+  this->response_tokens.push_back(id);
+
+  // llama.cpp throws when the token leaves the grammar without stacks
+  try {
+    llama_sampling_accept(this->ctx_sampling, this->ctx, id, true);
+  } catch (const std::runtime_error &e) {
+    LLAMA_LOG_WARN("Token %d breaks the grammar, disabling it: %s", id,
+                   e.what());
+    llama_grammar_free(this->ctx_sampling->grammar);
+    this->ctx_sampling->grammar = nullptr;
+    this->constraint_failed = true;
+  }
+
+  // advance the regex, end-of-turn tokens (eog_flags) keep the state
+  if (this->regex_index != nullptr) {
+    this->regex_state =
+        this->regex_index->get_next_state(this->regex_state, id);
+
+    if (this->regex_state == -1) {
+      LLAMA_LOG_WARN("Sampled token %d breaks the regex, disabling it", id);
+      this->regex_index = nullptr;
+      this->constraint_failed = true;
+    }
+  }
+}
+
+/*
+*****************************
+*         KV TIERING        *
+*****************************
+*/
+void Llama::enable_kv_tiering(const std::string &type, int threshold,
+                              int n_ctx) {
+
+  std::lock_guard<std::recursive_mutex> lk(this->mutex);
+
+  // bits per cached value
+  static const std::map<std::string, float> type_bits = {
+      {"f16", 16.0f},  {"q8_0", 8.5f}, {"q5_1", 6.0f},   {"q5_0", 5.5f},
+      {"q4_1", 5.0f},  {"q4_0", 4.5f}, {"iq4_nl", 4.5f},
+  };
+
+  auto it = type_bits.find(type);
+  if (it == type_bits.end()) {
+    LLAMA_LOG_ERROR("Unknown KV cache type %s, KV tiering disabled",
+                    type.c_str());
+    return;
+  }
+
+  // by default the quantized context takes the memory of the f16 one, the V
+  // cache is only quantized with flash attention
+  float v_bits = this->params->flash_attn ? it->second : 16.0f;
+  int n_ctx_same_memory = this->get_n_ctx() * 32.0f / (it->second + v_bits);
+
+  this->kv_tier_type = type;
+  this->kv_tier_threshold =
+      threshold > 0 ? threshold : this->get_n_ctx() * 3 / 4;
+  this->kv_tier_n_ctx = n_ctx > 0 ? n_ctx : n_ctx_same_memory;
+}
+
+bool Llama::is_kv_tiered() {
+  std::lock_guard<std::recursive_mutex> lk(this->mutex);
+  return this->ctx_cold != nullptr && this->ctx == this->ctx_cold;
+}
+
+void Llama::start_kv_tiering() {
+
+  if (this->kv_tier_type.empty() || this->is_kv_tiered() ||
+      this->kv_tier_running || this->kv_has_embd ||
+      this->params->grp_attn_n != 1 || this->n_past < this->kv_tier_threshold) {
+    return;
+  }
+
+  if (this->kv_tier_worker.joinable()) {
+    this->kv_tier_worker.join();
+  }
+
+  this->kv_tier_running = true;
+  this->kv_tier_worker = std::thread(&Llama::migrate_kv, this);
+}
+
+void Llama::migrate_kv() {
+
+  std::vector<llama_token> tokens;
+  int version;
+
+  {
+    std::lock_guard<std::recursive_mutex> lk(this->mutex);
+    tokens = this->kv_tokens;
+    version = this->kv_version;
+  }
+
+  // the cold context shares the weights of the model, it is only published
+  // under the lock once it holds the conversation
+  struct gpt_params cold_params = this->ctx_params;
+  cold_params.n_ctx = this->kv_tier_n_ctx;
+  cold_params.cache_type_k = this->kv_tier_type;
+
+  // llama.cpp only quantizes the V cache with flash attention
+  if (cold_params.flash_attn) {
+    cold_params.cache_type_v = this->kv_tier_type;
+  }
+
+  struct llama_context *cold = llama_new_context_with_model(
+      this->model, llama_context_params_from_gpt_params(cold_params));
+
+  if (cold == nullptr) {
+    LLAMA_LOG_ERROR("Failed to create %s KV context, disabling KV tiering",
+                    this->kv_tier_type.c_str());
+    std::lock_guard<std::recursive_mutex> lk(this->mutex);
+    this->kv_tier_type.clear();
+    this->kv_tier_running = false;
+    return;
+  }
+
+  // rebuild the cache without blocking the node, then catch up under the
+  // lock with the tokens evaluated in the meantime
+  auto prefill = [this, cold](std::vector<llama_token> &tokens,
+                              size_t start) {
+    for (size_t i = start; i < tokens.size(); i += this->params->n_batch) {
+      int n_eval = std::min((size_t)this->params->n_batch, tokens.size() - i);
+
+      llama_utils::ComputeLease lease(this->params->n_threads_batch,
+                                      llama_utils::GENERATION);
+      llama_set_n_threads(cold, lease.get_n_threads(), lease.get_n_threads());
+
+      if (llama_decode(cold, llama_batch_get_one(tokens.data() + i, n_eval,
+                                                 i, 0))) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  bool migrated = prefill(tokens, 0) && this->kv_version == version;
+
+  if (migrated) {
+    std::lock_guard<std::recursive_mutex> lk(this->mutex);
+
+    migrated = this->kv_version == version && !this->kv_has_embd &&
+               (int)this->kv_tokens.size() == this->n_past &&
+               this->n_past < this->kv_tier_n_ctx &&
+               prefill(this->kv_tokens, tokens.size());
+
+    // the f16 cache is freed, reset() brings it back for the next
+    // conversation
+    if (migrated) {
+      llama_free(this->ctx_hot);
+      this->ctx_hot = nullptr;
+      this->ctx_cold = cold;
+      this->ctx = cold;
+      this->n_kv_size = this->get_n_ctx();
+      LLAMA_LOG_INFO("Moved %d tokens to the %s KV cache (n_ctx = %d)",
+                     this->n_past, this->kv_tier_type.c_str(),
+                     this->get_n_ctx());
+    }
+  }
+
+  if (!migrated) {
+    LLAMA_LOG_WARN("KV tiering dropped, the conversation changed");
+    llama_free(cold);
+  }
+
+  this->kv_tier_running = false;
+}
+
+/*
+*****************************
+*     LOGIT BIAS PROFILES   *
+*****************************
+*/
+void Llama::add_logit_bias_profile(
+    const std::string &name,
+    const std::vector<std::pair<llama_token, float>> &logit_bias) {
+
+  std::lock_guard<std::recursive_mutex> lk(this->mutex);
+
+  auto profile = std::make_shared<struct logit_bias_profile>();
+  const int n_vocab = this->get_n_vocab();
+
+  std::map<llama_token, float> sorted;
+  for (const auto &bias : logit_bias) {
+    if (bias.first >= 0 && bias.first < n_vocab) {
+      sorted[bias.first] = bias.second;
+    }
+  }
+
+  // a dense add over the vocabulary vectorizes, few scattered adds are
+  // cheaper for small profiles
+  if (sorted.size() > (size_t)n_vocab / 32) {
+    profile->dense.resize(n_vocab, 0.0f);
+    for (const auto &bias : sorted) {
+      profile->dense[bias.first] = bias.second;
+    }
+
+  } else {
+    for (const auto &bias : sorted) {
+      profile->tokens.push_back(bias.first);
+      profile->biases.push_back(bias.second);
+    }
+  }
+
+  this->logit_bias_profiles[name] = profile;
+}
+
+bool Llama::remove_logit_bias_profile(const std::string &name) {
+  std::lock_guard<std::recursive_mutex> lk(this->mutex);
+  return this->logit_bias_profiles.erase(name) > 0;
+}
+
+bool Llama::set_logit_bias_profile(const std::string &name) {
+
+  std::lock_guard<std::recursive_mutex> lk(this->mutex);
+
+  this->logit_bias_profile = nullptr;
+
+  if (name.empty()) {
+    return true;
+  }
+
+  auto it = this->logit_bias_profiles.find(name);
+  if (it == this->logit_bias_profiles.end()) {
+    LLAMA_LOG_ERROR("Unknown logit bias profile %s", name.c_str());
+    return false;
+  }
+
+  this->logit_bias_profile = it->second;
+  return true;
+}
+
+void Llama::apply_logit_bias_profile() {
+
+  float *__restrict logits = llama_get_logits_ith(this->ctx, 0);
+  const auto &profile = *this->logit_bias_profile;
+
+  if (!profile.dense.empty()) {
+    const float *__restrict dense = profile.dense.data();
+    const size_t n_vocab = profile.dense.size();
+
+    for (size_t i = 0; i < n_vocab; i++) {
+      logits[i] += dense[i];
+    }
+
+  } else {
+    for (size_t i = 0; i < profile.tokens.size(); i++) {
+      logits[profile.tokens[i]] += profile.biases[i];
+    }
+  }
+}
+
+/*
+*****************************
+*     LOGITS PROCESSORS     *
+*****************************
+*/
+void Llama::set_logits_processors(
+    const std::vector<std::shared_ptr<LogitsProcessor>> &processors) {
+
+  std::lock_guard<std::recursive_mutex> lk(this->mutex);
+
+  this->logits_processors = processors;
+  for (auto &processor : this->logits_processors) {
+    processor->reset();
+  }
+}
+
+/*
+*****************************
+*           REGEX           *
+*****************************
+*/
+bool Llama::set_regex(const std::string &pattern) {
+
+  std::lock_guard<std::recursive_mutex> lk(this->mutex);
+
+  this->regex_index = nullptr;
+
+  if (pattern.empty()) {
+    return true;
+  }
+
+  // text of each token, shared by all the compiled regex
+  this->load_token_pieces();
+
+  auto it = this->regex_cache.find(pattern);
+
+  if (it == this->regex_cache.end()) {
+    auto regex_index = std::make_shared<llama_utils::RegexIndex>(
+        pattern, this->token_pieces, this->eog_tokens);
+
+    if (!regex_index->is_valid()) {
+      LLAMA_LOG_ERROR("Failed to compile regex '%s': %s", pattern.c_str(),
+                      regex_index->get_error().c_str());
+      return false;
+    }
+
+    if (this->regex_cache.size() >= MAX_REGEX_CACHE) {
+      this->regex_cache.erase(this->regex_cache.begin());
+    }
+
+    it = this->regex_cache.emplace(pattern, regex_index).first;
+  }
+
+  this->regex_index = it->second;
+  return true;
+}
+
+void Llama::apply_regex() {
+
+  float *logits = llama_get_logits_ith(this->ctx, 0);
+  const auto &mask = this->regex_index->get_token_mask(this->regex_state);
+
+  // mask the gaps between the sorted tokens in place
+  llama_token next = 0;
+  for (llama_token t : mask) {
+    std::fill(logits + next, logits + t, -INFINITY);
+    next = t + 1;
+  }
+  std::fill(logits + next, logits + this->get_n_vocab(), -INFINITY);
+}
+
 void Llama::update_sampling_params(const struct llama_sampling_params &params) {
 
   this->ctx_sampling->params = params;
@@ -20,6 +20,7 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <algorithm>
 #include <fstream>
 #include <memory>
 #include <string>
@@ -35,13 +36,30 @@ using namespace llama_ros;
 using std::placeholders::_1;
 using std::placeholders::_2;
 
-LlamaNode::LlamaNode(bool load_llama) : rclcpp::Node("llama_node") {
+LlamaNode::LlamaNode(bool load_llama)
+    : rclcpp::Node("llama_node"), stop_replicas(false),
+      stop_embeddings(false) {
 
   if (load_llama) {
-    this->llama = std::make_shared<Llama>(this->gpt_params.load_params(this),
-                                          this->gpt_params.debug);
+    auto params = this->gpt_params.load_params(this);
+
+    if (!this->gpt_params.numa_replicas || !this->create_numa_replicas()) {
+      this->llama = std::make_shared<Llama>(params, this->gpt_params.debug);
+
+      if (!this->gpt_params.kv_tier_type.empty()) {
+        this->llama->enable_kv_tiering(this->gpt_params.kv_tier_type,
+                                       this->gpt_params.kv_tier_threshold,
+                                       this->gpt_params.kv_tier_n_ctx);
+      }
+    }
   }
 
+  this->load_prompt_compressor();
+  this->load_cascade();
+  this->load_logits_processors();
+  this->load_token_ring();
+  this->start_client_liveness();
+
   // services
   this->tokenize_service_ = this->create_service<llama_msgs::srv::Tokenize>(
       "tokenize",
@@ -51,6 +69,19 @@ LlamaNode::LlamaNode(bool load_llama) : rclcpp::Node("llama_node") {
           "generate_embeddings",
           std::bind(&LlamaNode::generate_embeddings_service_callback, this, _1,
                     _2));
+  this->add_documents_service_ =
+      this->create_service<llama_msgs::srv::AddDocuments>(
+          "add_documents",
+          std::bind(&LlamaNode::add_documents_service_callback, this, _1, _2));
+  this->set_logit_bias_profile_service_ =
+      this->create_service<llama_msgs::srv::SetLogitBiasProfile>(
+          "set_logit_bias_profile",
+          std::bind(&LlamaNode::set_logit_bias_profile_service_callback, this,
+                    _1, _2));
+
+  // embeddings requests are answered from the batching worker
+  this->embeddings_worker =
+      std::thread(&LlamaNode::run_embeddings_worker, this);
 
   // generate response action server
   this->goal_handle_ = nullptr;
@@ -61,9 +92,350 @@ LlamaNode::LlamaNode(bool load_llama) : rclcpp::Node("llama_node") {
           std::bind(&LlamaNode::handle_cancel, this, _1),
           std::bind(&LlamaNode::handle_accepted, this, _1));
 
+  // generate with retrieval action server
+  this->retrieval_goal_handle_ = nullptr;
+  this->generate_with_retrieval_action_server_ =
+      rclcpp_action::create_server<GenerateWithRetrieval>(
+          this, "generate_with_retrieval",
+          std::bind(&LlamaNode::handle_retrieval_goal, this, _1, _2),
+          std::bind(&LlamaNode::handle_retrieval_cancel, this, _1),
+          std::bind(&LlamaNode::handle_retrieval_accepted, this, _1));
+
+  // diagnostics
+  for (auto &n_goals : this->n_phase_goals) {
+    n_goals = 0;
+  }
+  this->diagnostics = std::make_unique<diagnostic_updater::Updater>(this);
+  this->diagnostics->setHardwareID("llama_ros");
+  this->diagnostics->add("llama", this, &LlamaNode::update_diagnostics);
+
   RCLCPP_INFO(this->get_logger(), "%s started", this->get_name());
 }
 
+LlamaNode::~LlamaNode() {
+  this->stop_embeddings_worker();
+  this->stop_numa_replicas();
+}
+
+void LlamaNode::load_prompt_compressor() {
+  if (!this->gpt_params.compressor_model.empty()) {
+    this->prompt_compressor = std::make_shared<PromptCompressor>(
+        this->gpt_params.compressor_model,
+        this->gpt_params.params->n_threads_batch,
+        this->gpt_params.compression_ratio,
+        this->gpt_params.compression_budget);
+  }
+}
+
+void LlamaNode::load_token_ring() {
+
+  if (this->gpt_params.token_ring_capacity <= 0 ||
+      this->token_ring != nullptr) {
+    return;
+  }
+
+  // one shm object per node, e.g. /llama_ros_llama_llama_node
+  std::string shm_name = this->get_fully_qualified_name();
+  std::replace(shm_name.begin(), shm_name.end(), '/', '_');
+  shm_name = "/llama_ros" + shm_name;
+
+  this->token_ring = std::make_unique<llama_utils::TokenRingWriter>(
+      shm_name, this->gpt_params.token_ring_capacity);
+
+  if (!this->token_ring->is_open()) {
+    RCLCPP_ERROR(this->get_logger(),
+                 "Failed to create token ring %s, remove /dev/shm%s if it was "
+                 "left by a node that did not shut down",
+                 shm_name.c_str(), shm_name.c_str());
+    this->token_ring.reset();
+    return;
+  }
+
+  llama_msgs::msg::TokenStreamDescriptor descriptor;
+  descriptor.shm_name = shm_name;
+  descriptor.version = llama_utils::TOKEN_RING_VERSION;
+  descriptor.capacity = this->token_ring->get_capacity();
+  descriptor.slot_size = sizeof(struct llama_utils::token_ring_slot);
+  descriptor.text_size = llama_utils::TOKEN_RING_TEXT_SIZE;
+
+  this->token_stream_pub_ =
+      this->create_publisher<llama_msgs::msg::TokenStreamDescriptor>(
+          "token_stream", rclcpp::QoS(1).transient_local().reliable());
+  this->token_stream_pub_->publish(descriptor);
+
+  RCLCPP_INFO(this->get_logger(), "Streaming tokens to %s (%d slots)",
+              shm_name.c_str(), this->gpt_params.token_ring_capacity);
+}
+
+void LlamaNode::load_logits_processors() {
+
+  if (this->gpt_params.logits_processors.empty() || this->llama == nullptr) {
+    return;
+  }
+
+  // processors keep per-goal state, so each engine gets its own instances
+  std::vector<Llama *> engines;
+  if (this->replicas.empty()) {
+    engines.push_back(this->llama.get());
+  } else {
+    for (auto &replica : this->replicas) {
+      engines.push_back(replica->llama.get());
+    }
+  }
+
+  this->processor_loader =
+      std::make_unique<pluginlib::ClassLoader<LogitsProcessor>>(
+          "llama_ros", "llama_ros::LogitsProcessor");
+
+  for (const auto &name : this->gpt_params.logits_processors) {
+
+    std::string plugin =
+        this->declare_parameter<std::string>(name + ".plugin", "");
+
+    try {
+      for (auto engine : engines) {
+        auto processor = this->processor_loader->createSharedInstance(plugin);
+        processor->initialize(
+            this, name,
+            [engine](const std::string &text) {
+              return engine->tokenize(text, false);
+            },
+            engine->get_n_vocab());
+        this->logits_processors[engine][name] = processor;
+      }
+
+      RCLCPP_INFO(this->get_logger(), "Loaded logits processor %s (%s)",
+                  name.c_str(), plugin.c_str());
+
+    } catch (pluginlib::PluginlibException &e) {
+      RCLCPP_ERROR(this->get_logger(), "Failed to load logits processor %s: %s",
+                   name.c_str(), e.what());
+
+      for (auto engine : engines) {
+        this->logits_processors[engine].erase(name);
+      }
+    }
+  }
+}
+
+bool LlamaNode::get_logits_processors(
+    std::shared_ptr<Llama> llama, const std::vector<std::string> &names,
+    std::vector<std::shared_ptr<LogitsProcessor>> &out) {
+
+  // the cascade drafts with the instances of the main model
+  auto engine_it = this->logits_processors.find(llama.get());
+  if (engine_it == this->logits_processors.end()) {
+    engine_it = this->logits_processors.find(this->llama.get());
+  }
+
+  for (const auto &name : names) {
+
+    if (engine_it == this->logits_processors.end() ||
+        !engine_it->second.count(name)) {
+      RCLCPP_ERROR(this->get_logger(), "Unknown logits processor %s",
+                   name.c_str());
+      return false;
+    }
+
+    out.push_back(engine_it->second.at(name));
+  }
+
+  return true;
+}
+
+/*
+*****************************
+*       NUMA REPLICAS       *
+*****************************
+*/
+void LlamaNode::stop_numa_replicas() {
+
+  this->stop_replicas = true;
+
+  for (auto &replica : this->replicas) {
+    std::lock_guard<std::mutex> lk(replica->mutex);
+    replica->cv.notify_all();
+
+    if (replica->llama != nullptr) {
+      replica->llama->cancel();
+    }
+  }
+
+  for (auto &replica : this->replicas) {
+    if (replica->worker.joinable()) {
+      replica->worker.join();
+    }
+  }
+
+  this->replicas.clear();
+}
+
+bool LlamaNode::create_numa_replicas() {
+
+  auto nodes = llama_utils::get_numa_nodes();
+
+  if (nodes.size() < 2) {
+    RCLCPP_WARN(this->get_logger(),
+                "Found %ld NUMA nodes, running a single llama instance",
+                nodes.size());
+    return false;
+  }
+
+  // replicas are loaded one by one to avoid competing for the storage
+  for (auto node : nodes) {
+
+    auto replica = std::make_unique<LlamaReplica>();
+    replica->node = node;
+    replica->retrieving = false;
+
+    // private params: weights are read by the pinned worker so they are
+    // first touched in local memory instead of shared through the page cache
+    replica->gpt_params = this->gpt_params;
+    replica->gpt_params.params =
+        std::make_shared<struct gpt_params>(*this->gpt_params.params);
+    replica->gpt_params.params->use_mmap = false;
+    replica->gpt_params.params->cb_eval = nullptr;
+    replica->gpt_params.params->cb_eval_user_data = nullptr;
+    replica->gpt_params.params->n_threads = std::min(
+        replica->gpt_params.params->n_threads, (int32_t)node.cpus.size());
+    replica->gpt_params.params->n_threads_batch = std::min(
+        replica->gpt_params.params->n_threads_batch, (int32_t)node.cpus.size());
+
+    std::promise<bool> loaded;
+    auto loaded_future = loaded.get_future();
+    replica->worker = std::thread(&LlamaNode::run_replica, this, replica.get(),
+                                  std::move(loaded));
+
+    if (!loaded_future.get()) {
+      RCLCPP_ERROR(this->get_logger(), "Failed to load replica on NUMA node %d",
+                   node.id);
+      this->replicas.push_back(std::move(replica));
+      this->stop_numa_replicas();
+      this->stop_replicas = false;
+      return false;
+    }
+
+    RCLCPP_INFO(this->get_logger(),
+                "Loaded replica on NUMA node %d with %d threads", node.id,
+                replica->gpt_params.params->n_threads);
+
+    this->replicas.push_back(std::move(replica));
+  }
+
+  // services use the first replica
+  this->llama = this->replicas.front()->llama;
+
+  return true;
+}
+
+void LlamaNode::run_replica(LlamaReplica *replica, std::promise<bool> loaded) {
+
+  if (!llama_utils::pin_thread_to_cpus(replica->node.cpus)) {
+    RCLCPP_WARN(this->get_logger(), "Failed to pin thread to NUMA node %d",
+                replica->node.id);
+  }
+
+  replica->llama = std::make_shared<Llama>(replica->gpt_params.params,
+                                           replica->gpt_params.debug);
+
+  if (!replica->gpt_params.kv_tier_type.empty()) {
+    replica->llama->enable_kv_tiering(replica->gpt_params.kv_tier_type,
+                                      replica->gpt_params.kv_tier_threshold,
+                                      replica->gpt_params.kv_tier_n_ctx);
+  }
+
+  loaded.set_value(replica->llama->get_ctx() != nullptr);
+
+  while (true) {
+
+    std::shared_ptr<GoalHandleGenerateResponse> goal_handle;
+
+    {
+      std::unique_lock<std::mutex> lk(replica->mutex);
+      // goals wait while a retrieval goal runs on the replica
+      replica->cv.wait(lk, [this, replica] {
+        return this->stop_replicas ||
+               (!replica->goals.empty() && !replica->retrieving);
+      });
+
+      if (this->stop_replicas) {
+        break;
+      }
+
+      goal_handle = replica->goals.front();
+      replica->goals.pop_front();
+      replica->current_goal = goal_handle;
+    }
+
+    // canceled while waiting in the queue and nobody else waits for it
+    if (goal_handle->is_canceling() && !this->is_flight_shared(goal_handle)) {
+      this->finish_goal(goal_handle,
+                        std::make_shared<GenerateResponse::Result>(),
+                        stop_type::CANCEL);
+
+    } else {
+      this->generate(goal_handle, replica->llama, replica->gpt_params);
+    }
+
+    std::lock_guard<std::mutex> lk(replica->mutex);
+    replica->current_goal = nullptr;
+  }
+}
+
+LlamaNode::LlamaReplica *LlamaNode::get_least_loaded_replica() {
+
+  LlamaReplica *best = nullptr;
+  size_t best_load = 0;
+
+  for (auto &replica : this->replicas) {
+    std::lock_guard<std::mutex> lk(replica->mutex);
+    size_t load = replica->goals.size() +
+                  (replica->current_goal != nullptr ? 1 : 0) +
+                  (replica->retrieving ? 1 : 0);
+
+    if (best == nullptr || load < best_load) {
+      best = replica.get();
+      best_load = load;
+    }
+  }
+
+  return best;
+}
+
+LlamaNode::LlamaReplica *LlamaNode::get_idle_replica(bool reserve) {
+
+  // retrieval goals set the sampling params, regex and processors of the
+  // engine, so they only run on a replica without goals and keep it until
+  // they finish
+  for (auto &replica : this->replicas) {
+    std::lock_guard<std::mutex> lk(replica->mutex);
+
+    if (replica->current_goal == nullptr && replica->goals.empty() &&
+        !replica->retrieving) {
+      replica->retrieving = reserve;
+      return replica.get();
+    }
+  }
+
+  return nullptr;
+}
+
+void LlamaNode::release_replica(LlamaReplica *replica) {
+  std::lock_guard<std::mutex> lk(replica->mutex);
+  replica->retrieving = false;
+  replica->cv.notify_one();
+}
+
+std::shared_ptr<Llama> LlamaNode::get_least_loaded_llama() {
+
+  // services and retrieval would wait behind the goals of a busy replica
+  if (this->replicas.empty()) {
+    return this->llama;
+  }
+
+  return this->get_least_loaded_replica()->llama;
+}
+
 /*
 *****************************
 *     TOKENIZE SERVICE      *
@@ -73,7 +445,8 @@ void LlamaNode::tokenize_service_callback(
     const std::shared_ptr<llama_msgs::srv::Tokenize::Request> request,
     std::shared_ptr<llama_msgs::srv::Tokenize::Response> response) {
 
-  response->tokens = this->llama->tokenize(request->prompt, false);
+  response->tokens =
+      this->get_least_loaded_llama()->tokenize(request->prompt, false);
 }
 
 /*
@@ -82,13 +455,119 @@ void LlamaNode::tokenize_service_callback(
 *****************************
 */
 void LlamaNode::generate_embeddings_service_callback(
-    const std::shared_ptr<llama_msgs::srv::GenerateEmbeddings::Request> request,
-    std::shared_ptr<llama_msgs::srv::GenerateEmbeddings::Response> response) {
+    const std::shared_ptr<rmw_request_id_t> request_header,
+    const std::shared_ptr<llama_msgs::srv::GenerateEmbeddings::Request>
+        request) {
+
+  struct EmbeddingsRequest pending;
+  pending.header = request_header;
+  pending.request = request;
+  pending.n_tokens =
+      this->get_least_loaded_llama()->tokenize(request->prompt, true).size() +
+      1;
+  pending.stamp = std::chrono::steady_clock::now();
+
+  std::lock_guard<std::mutex> lk(this->embeddings_mutex);
+  this->embeddings_queue.push_back(pending);
+  this->embeddings_cv.notify_one();
+}
+
+void LlamaNode::stop_embeddings_worker() {
+
+  {
+    std::lock_guard<std::mutex> lk(this->embeddings_mutex);
+    this->stop_embeddings = true;
+    this->embeddings_cv.notify_all();
+  }
+
+  if (this->embeddings_worker.joinable()) {
+    this->embeddings_worker.join();
+  }
+}
+
+void LlamaNode::run_embeddings_worker() {
+
+  while (true) {
+
+    std::vector<struct EmbeddingsRequest> requests;
+
+    {
+      std::unique_lock<std::mutex> lk(this->embeddings_mutex);
+      this->embeddings_cv.wait(lk, [this] {
+        return this->stop_embeddings || !this->embeddings_queue.empty();
+      });
+
+      if (this->stop_embeddings) {
+        break;
+      }
+
+      // wait for more requests until the window closes or a ubatch is full
+      auto count_tokens = [this] {
+        int n_tokens = 0;
+        for (const auto &pending : this->embeddings_queue) {
+          n_tokens += pending.n_tokens;
+        }
+        return n_tokens;
+      };
+
+      auto deadline = this->embeddings_queue.front().stamp +
+                      std::chrono::microseconds(
+                          this->gpt_params.embeddings_batch_window_us);
+
+      this->embeddings_cv.wait_until(lk, deadline, [this, &count_tokens] {
+        return this->stop_embeddings ||
+               count_tokens() >= this->gpt_params.params->n_ubatch;
+      });
+
+      if (this->stop_embeddings) {
+        break;
+      }
+
+      // take the requests that fit in one ubatch, at least one
+      int n_tokens = 0;
+      while (!this->embeddings_queue.empty()) {
+        const auto &pending = this->embeddings_queue.front();
+
+        if (!requests.empty() &&
+            n_tokens + pending.n_tokens > this->gpt_params.params->n_ubatch) {
+          break;
+        }
+
+        n_tokens += pending.n_tokens;
+        requests.push_back(pending);
+        this->embeddings_queue.pop_front();
+      }
+    }
+
+    // evaluate the batch, normalization is done per request
+    std::vector<std::string> prompts;
+    for (const auto &pending : requests) {
+      prompts.push_back(pending.request->prompt);
+    }
+
+    auto embeddings =
+        this->get_least_loaded_llama()->generate_embeddings(prompts, false);
+
+    if (this->gpt_params.debug && requests.size() > 1) {
+      RCLCPP_INFO(this->get_logger(), "Batched %ld embeddings requests",
+                  requests.size());
+    }
 
-  auto embeddings =
-      this->llama->generate_embeddings(request->prompt, request->normalize);
-  response->embeddings = embeddings.embeddings;
-  response->n_tokens = embeddings.n_tokens;
+    for (size_t i = 0; i < requests.size(); i++) {
+      llama_msgs::srv::GenerateEmbeddings::Response response;
+      response.embeddings = embeddings[i].embeddings;
+      response.n_tokens = embeddings[i].n_tokens;
+
+      if (requests[i].request->normalize) {
+        llama_embd_normalize(response.embeddings.data(),
+                             response.embeddings.data(),
+                             response.embeddings.size());
+      }
+
+      this->generate_embeddings_service_->send_response(*requests[i].header,
+                                                        response);
+    }
+  }
 }
 
 /*
@@ -96,13 +575,28 @@ void LlamaNode::generate_embeddings_service_callback(
 *     GENERATE RESPONSE     *
 *****************************
 */
+bool LlamaNode::is_busy() {
+  return (this->goal_handle_ != nullptr && this->goal_handle_->is_active()) ||
+         (this->retrieval_goal_handle_ != nullptr &&
+          this->retrieval_goal_handle_->is_active());
+}
+
 rclcpp_action::GoalResponse
 LlamaNode::handle_goal(const rclcpp_action::GoalUUID &uuid,
                        std::shared_ptr<const GenerateResponse::Goal> goal) {
   (void)uuid;
-  (void)goal;
 
-  if (this->goal_handle_ != nullptr && this->goal_handle_->is_active()) {
+  // identical goals attach to the running generation
+  if (this->can_join_flight(goal)) {
+    return rclcpp_action::GoalResponse::ACCEPT_AND_EXECUTE;
+  }
+
+  // replicas queue goals
+  if (!this->replicas.empty()) {
+    return rclcpp_action::GoalResponse::ACCEPT_AND_EXECUTE;
+  }
+
+  if (this->is_busy()) {
     return rclcpp_action::GoalResponse::REJECT;
   }
 
@@ -111,14 +605,60 @@ LlamaNode::handle_goal(const rclcpp_action::GoalUUID &uuid,
 
 rclcpp_action::CancelResponse LlamaNode::handle_cancel(
     const std::shared_ptr<GoalHandleGenerateResponse> goal_handle) {
-  (void)goal_handle;
   RCLCPP_INFO(this->get_logger(), "Received request to cancel Llama node");
-  this->llama->cancel();
+
+  // the generation goes on while other goals are subscribed to it
+  if (this->is_flight_shared(goal_handle)) {
+    return rclcpp_action::CancelResponse::ACCEPT;
+  }
+
+  if (this->replicas.empty()) {
+    this->llama->cancel();
+    if (this->cascade_llama != nullptr) {
+      this->cascade_llama->cancel();
+    }
+    return rclcpp_action::CancelResponse::ACCEPT;
+  }
+
+  // queued goals are canceled when they are dequeued
+  auto leader = this->get_flight_leader(goal_handle);
+  for (auto &replica : this->replicas) {
+    std::lock_guard<std::mutex> lk(replica->mutex);
+    if (replica->current_goal == leader) {
+      replica->llama->cancel();
+    }
+  }
+
   return rclcpp_action::CancelResponse::ACCEPT;
 }
 
 void LlamaNode::handle_accepted(
     const std::shared_ptr<GoalHandleGenerateResponse> goal_handle) {
+
+  this->watch_client(goal_handle->get_goal_id());
+
+  if (this->join_flight(goal_handle)) {
+    return;
+  }
+
+  // the flight the goal was accepted for may have ended since handle_goal
+  if (this->replicas.empty() && this->is_busy()) {
+    RCLCPP_WARN(this->get_logger(),
+                "Generation ended before the goal could join it");
+    goal_handle->abort(std::make_shared<GenerateResponse::Result>());
+    return;
+  }
+
+  this->start_flight(goal_handle);
+
+  if (!this->replicas.empty()) {
+    LlamaReplica *replica = this->get_least_loaded_replica();
+    std::lock_guard<std::mutex> lk(replica->mutex);
+    replica->goals.push_back(goal_handle);
+    replica->cv.notify_one();
+    return;
+  }
+
   this->goal_handle_ = goal_handle;
   std::thread{std::bind(&LlamaNode::execute, this, _1), goal_handle}.detach();
 }
@@ -129,92 +669,1258 @@ bool LlamaNode::goal_empty(std::shared_ptr<const GenerateResponse::Goal> goal) {
 
 void LlamaNode::execute(
     const std::shared_ptr<GoalHandleGenerateResponse> goal_handle) {
+  this->goal_handle_ = goal_handle;
+  this->generate(goal_handle, this->llama, this->gpt_params);
+}
+
+void LlamaNode::generate(
+    const std::shared_ptr<GoalHandleGenerateResponse> goal_handle,
+    std::shared_ptr<Llama> llama, llama_utils::GptParams &gpt_params,
+    std::shared_ptr<GenerateResponse::Result> result) {
 
   // get goal data
-  this->goal_handle_ = goal_handle;
   auto goal = goal_handle->get_goal();
   std::string prompt = goal->prompt;
   bool reset = goal_handle->get_goal()->reset;
-  auto result = std::make_shared<GenerateResponse::Result>();
+
+  if (result == nullptr) {
+    result = std::make_shared<GenerateResponse::Result>();
+  }
 
   // check if goal is empty
   if (this->goal_empty(goal)) {
-    this->goal_handle_->abort(result);
+    this->finish_goal(goal_handle, result, stop_type::ABORT);
     return;
   }
 
-  if (this->gpt_params.debug) {
+  if (gpt_params.debug) {
     RCLCPP_INFO(this->get_logger(), "Prompt received:\n%s", prompt.c_str());
   }
 
+  // cascade: conversations start on the small model and later goals stay on
+  // the model that answered them
+  bool cascade = false;
+  if (this->cascade_llama != nullptr && llama == this->llama) {
+    if (reset) {
+      this->cascade_llama->reset();
+      this->cascade_owner = nullptr;
+    }
+
+    if (this->cascade_owner == nullptr) {
+      cascade = true;
+    } else {
+      llama = this->cascade_owner;
+    }
+  }
+
   // reset llama
   if (reset) {
-    this->llama->reset();
+    llama->reset();
+  }
+
+  // drop low-information tokens from the retrieved context
+  if (this->prompt_compressor != nullptr) {
+    prompt = this->prompt_compressor->compress(prompt);
   }
 
   // update sampling params of gpt_params
   auto sampling_config = goal_handle->get_goal()->sampling_config;
-  this->gpt_params.update_sampling_params(sampling_config,
-                                          this->llama->get_n_vocab(),
-                                          this->llama->get_token_eos());
+  gpt_params.update_sampling_params(sampling_config, llama->get_n_vocab(),
+                                    llama->get_token_eos());
+
+  // the cascade model reads the sampling params from its own copy
+  if (this->cascade_params != nullptr) {
+    this->cascade_params->sparams = gpt_params.params->sparams;
+    this->cascade_params->ignore_eos = gpt_params.params->ignore_eos;
+  }
+
+  if (!llama->set_regex(sampling_config.regex)) {
+    this->finish_goal(goal_handle, result, stop_type::ABORT);
+    return;
+  }
+
+  if (!llama->set_logit_bias_profile(sampling_config.logit_bias_profile)) {
+    this->finish_goal(goal_handle, result, stop_type::ABORT);
+    return;
+  }
+
+  std::vector<std::shared_ptr<LogitsProcessor>> processors;
+  if (!this->get_logits_processors(llama, sampling_config.logits_processors,
+                                   processors)) {
+    this->finish_goal(goal_handle, result, stop_type::ABORT);
+    return;
+  }
+  llama->set_logits_processors(processors);
+
+  if (cascade) {
+    this->cascade_llama->set_regex(sampling_config.regex);
+    this->cascade_llama->set_logit_bias_profile(
+        sampling_config.logit_bias_profile);
+    this->cascade_llama->set_logits_processors(processors);
+  }
 
   // call llama
-  struct response_output output = this->llama->generate_response(
-      prompt, std::bind(&LlamaNode::send_text, this, _1));
+  int phase = PHASE_IDLE;
+  this->set_phase(phase, PHASE_PREFILL);
 
-  if (output.stop == stop_type::FULL_STOP) {
-    auto completion_results = output.completions;
+  auto callback = [this, goal_handle, llama,
+                   &phase](struct completion_output completion) {
+    this->record_token();
+    this->set_phase(phase, PHASE_PUBLISHING);
+    this->send_text(completion, goal_handle, llama);
+    this->set_phase(phase, PHASE_DECODE);
+  };
 
-    for (auto completion : completion_results) {
-      result->response.text.append(this->llama->detokenize({completion.token}));
-      result->response.tokens.push_back(completion.token);
+  struct response_output output =
+      cascade ? this->generate_cascade(prompt, callback)
+              : llama->generate_response(prompt, callback);
 
-      llama_msgs::msg::TokenProbArray probs_msg;
-      for (auto prob : completion.probs) {
-        llama_msgs::msg::TokenProb aux;
-        aux.token = prob.token;
-        aux.probability = prob.probability;
-        aux.token_text = this->llama->detokenize({prob.token});
-        probs_msg.data.push_back(aux);
-      }
-      result->response.probs.push_back(probs_msg);
+  this->set_phase(phase, PHASE_IDLE);
+
+  // nobody waits for the rest of the conversation
+  if (this->take_orphaned(goal_handle->get_goal_id())) {
+    RCLCPP_WARN(this->get_logger(), "Client lost, aborting generation");
+    if (output.stop == stop_type::CANCEL) {
+      output.stop = stop_type::ABORT;
+    }
+    llama->reset();
+
+    if (cascade) {
+      this->cascade_llama->reset();
+      this->cascade_owner = nullptr;
     }
   }
 
+  if (output.stop == stop_type::FULL_STOP) {
+    result->response = this->create_response(output.completions, llama);
+  }
+
+  this->finish_goal(goal_handle, result, output.stop);
+  this->log_weight_streaming(gpt_params);
+}
+
+void LlamaNode::log_weight_streaming(llama_utils::GptParams &gpt_params) {
+
+  if (gpt_params.weight_streamer == nullptr) {
+    return;
+  }
+
+  auto stats = gpt_params.weight_streamer->get_stats();
+  RCLCPP_INFO(this->get_logger(),
+              "Weight streaming: %.1f%% of %d layers resident, %ld prefetches, "
+              "%ld stalls (%.1f ms)",
+              100.0f * stats.residency, stats.n_layers, stats.n_prefetches,
+              stats.n_stalls, stats.stall_us / 1000.0);
+}
+
+void LlamaNode::finish_goal(
+    const std::shared_ptr<GoalHandleGenerateResponse> goal_handle,
+    std::shared_ptr<GenerateResponse::Result> result, stop_type stop) {
+
+  // goals attached to this generation get the same result
+  auto goal_handles = this->end_flight(goal_handle);
+  goal_handles.insert(goal_handles.begin(), goal_handle);
+
   if (rclcpp::ok()) {
 
-    if (output.stop == stop_type::CANCEL) {
-      this->goal_handle_->canceled(result);
+    for (auto &gh : goal_handles) {
 
-    } else if (output.stop == stop_type::ABORT) {
-      this->goal_handle_->abort(result);
+      if (!gh->is_active()) {
+        continue;
+      }
 
-    } else {
-      this->goal_handle_->succeed(result);
+      std::string reason;
+
+      if (stop == stop_type::CANCEL || gh->is_canceling()) {
+        gh->canceled(result);
+        reason = "canceled";
+
+      } else if (stop == stop_type::ABORT) {
+        gh->abort(result);
+        reason = "aborted";
+
+      } else {
+        gh->succeed(result);
+        reason = "succeeded";
+      }
+
+      if (this->token_ring != nullptr) {
+        this->token_ring->end(gh->get_goal_id().data(), reason);
+      }
     }
 
-    this->goal_handle_ = nullptr;
+    if (this->goal_handle_ == goal_handle) {
+      this->goal_handle_ = nullptr;
+    }
   }
 }
 
-void LlamaNode::send_text(const struct completion_output &completion) {
+void LlamaNode::send_text(
+    const struct completion_output &completion,
+    std::shared_ptr<GoalHandleGenerateResponse> goal_handle,
+    std::shared_ptr<Llama> llama) {
 
-  if (this->goal_handle_ != nullptr) {
+  if (goal_handle != nullptr) {
     auto feedback = std::make_shared<GenerateResponse::Feedback>();
+    feedback->partial_response =
+        this->create_partial_response(completion, llama);
 
-    feedback->partial_response.text =
-        this->llama->detokenize({completion.token});
-    feedback->partial_response.token = completion.token;
-    feedback->partial_response.probs.chosen_token = completion.token;
-
-    for (auto prob : completion.probs) {
-      llama_msgs::msg::TokenProb aux;
-      aux.token = prob.token;
-      aux.probability = prob.probability;
-      aux.token_text = this->llama->detokenize({prob.token});
-      feedback->partial_response.probs.data.push_back(aux);
+    for (auto &gh : this->get_flight_subscribers(goal_handle, feedback)) {
+      gh->publish_feedback(feedback);
     }
 
-    this->goal_handle_->publish_feedback(feedback);
+    // followers read the stream of the leader, see join_flight
+    if (this->token_ring != nullptr) {
+      this->token_ring->write(goal_handle->get_goal_id().data(),
+                              completion.token,
+                              feedback->partial_response.text);
+    }
+  }
+}
+
+/*
+*****************************
+*       MODEL CASCADE       *
+*****************************
+*/
+void LlamaNode::load_cascade() {
+
+  if (this->gpt_params.cascade_model.empty() || this->llama == nullptr) {
+    return;
+  }
+
+  if (!this->replicas.empty()) {
+    RCLCPP_WARN(this->get_logger(),
+                "Model cascade is not available with NUMA replicas");
+    return;
+  }
+
+  // the small model gets its own copy of the params, without the extras of
+  // the main model, and the sampling params of each goal are copied in it
+  auto params = std::make_shared<struct gpt_params>(*this->gpt_params.params);
+  params->model = this->gpt_params.cascade_model;
+  params->lora_adapter.clear();
+  params->lora_base.clear();
+  params->cb_eval = nullptr;
+  params->cb_eval_user_data = nullptr;
+
+  auto cascade_llama = std::make_shared<Llama>(params, this->gpt_params.debug);
+
+  if (cascade_llama->get_ctx() == nullptr) {
+    RCLCPP_ERROR(this->get_logger(), "Failed to load cascade model %s",
+                 this->gpt_params.cascade_model.c_str());
+    return;
+  }
+
+  // tokens of the small model are passed to the main model
+  if (cascade_llama->get_n_vocab() != this->llama->get_n_vocab() ||
+      cascade_llama->get_token_eos() != this->llama->get_token_eos()) {
+    RCLCPP_ERROR(this->get_logger(),
+                 "Cascade model %s does not share the vocabulary of the main "
+                 "model",
+                 this->gpt_params.cascade_model.c_str());
+    return;
+  }
+
+  this->cascade_params = params;
+  this->cascade_llama = cascade_llama;
+
+  RCLCPP_INFO(this->get_logger(), "Cascade model %s loaded",
+              this->gpt_params.cascade_model.c_str());
+}
+
+struct response_output
+LlamaNode::generate_cascade(const std::string &prompt,
+                            GenerateResponseCallback callback) {
+
+  int32_t n_probs = this->cascade_params->sparams.n_probs;
+  float threshold = this->gpt_params.cascade_threshold;
+  size_t window = std::max(1, this->gpt_params.cascade_window);
+
+  // tokens are sent a window late so the tokens that trigger the escalation
+  // are never sent, without reuse nothing is sent before the end
+  size_t lag = this->gpt_params.cascade_reuse_output ? window : SIZE_MAX;
+
+  std::deque<float> confidences;
+  float confidence_sum = 0.0f;
+  std::deque<struct completion_output> pending;
+  std::vector<struct completion_output> sent;
+  bool escalate = false;
+
+  auto is_confident = [&confidences, &confidence_sum, threshold]() {
+    return confidences.empty() ||
+           confidence_sum / confidences.size() >= threshold;
+  };
+
+  // the probability of the sampled token comes with the top probs, the
+  // params of the goal are copied again before the next cascade
+  this->cascade_params->sparams.n_probs = std::max(n_probs, CASCADE_N_PROBS);
+
+  struct response_output output = this->cascade_llama->generate_response(
+      prompt, [&](struct completion_output completion) {
+        if (escalate) {
+          return;
+        }
+
+        float confidence = 0.0f;
+        for (const auto &prob : completion.probs) {
+          if (prob.token == completion.token) {
+            confidence = prob.probability;
+            break;
+          }
+        }
+
+        completion.probs.resize(
+            std::min(completion.probs.size(), (size_t)std::max(0, n_probs)));
+
+        confidences.push_back(confidence);
+        confidence_sum += confidence;
+
+        if (confidences.size() > window) {
+          confidence_sum -= confidences.front();
+          confidences.pop_front();
+        }
+
+        if ((confidences.size() == window && !is_confident()) ||
+            this->cascade_llama->has_constraint_failed()) {
+          escalate = true;
+          this->cascade_llama->cancel();
+          return;
+        }
+
+        pending.push_back(completion);
+
+        if (pending.size() > lag) {
+          callback(pending.front());
+          sent.push_back(pending.front());
+          pending.pop_front();
+        }
+      });
+
+  // short responses are judged with the tokens they have
+  if (!escalate) {
+    escalate = output.stop == stop_type::ABORT ||
+               (output.stop == stop_type::FULL_STOP &&
+                (!is_confident() ||
+                 this->cascade_llama->has_constraint_failed()));
+  }
+
+  if (!escalate) {
+    if (output.stop == stop_type::FULL_STOP) {
+      for (auto &completion : pending) {
+        callback(completion);
+        sent.push_back(completion);
+      }
+    }
+
+    output.completions = sent;
+    this->cascade_owner = this->cascade_llama;
+    return output;
+  }
+
+  // the main model continues the response or starts over
+  std::vector<llama_token> response_prefix;
+  for (const auto &completion : sent) {
+    response_prefix.push_back(completion.token);
+  }
+
+  RCLCPP_INFO(this->get_logger(),
+              "Escalating to the main model, reusing %ld tokens",
+              response_prefix.size());
+
+  this->cascade_owner = this->llama;
+  output = this->llama->generate_response(prompt, callback, response_prefix);
+  output.completions.insert(output.completions.begin(), sent.begin(),
+                            sent.end());
+
+  return output;
+}
+
+/*
+*****************************
+*      CLIENT LIVENESS      *
+*****************************
+*/
+void LlamaNode::start_client_liveness() {
+
+  if (this->gpt_params.client_timeout_ms <= 0 ||
+      this->liveness_timer_ != nullptr) {
+    return;
+  }
+
+  this->liveness_group_ = this->create_callback_group(
+      rclcpp::CallbackGroupType::MutuallyExclusive);
+
+  rclcpp::SubscriptionOptions options;
+  options.callback_group = this->liveness_group_;
+
+  this->heartbeat_sub_ =
+      this->create_subscription<llama_msgs::msg::GoalHeartbeat>(
+          "goal_heartbeat", 100,
+          std::bind(&LlamaNode::heartbeat_callback, this, _1), options);
+
+  this->last_client_check = std::chrono::steady_clock::now();
+  this->liveness_timer_ = this->create_wall_timer(
+      std::chrono::milliseconds(
+          std::max(1, this->gpt_params.client_timeout_ms / 4)),
+      std::bind(&LlamaNode::check_clients, this), this->liveness_group_);
+}
+
+void LlamaNode::heartbeat_callback(
+    const llama_msgs::msg::GoalHeartbeat::SharedPtr msg) {
+  std::lock_guard<std::mutex> lk(this->liveness_mutex);
+  this->heartbeats[msg->goal_id] = std::chrono::steady_clock::now();
+}
+
+void LlamaNode::check_clients() {
+
+  // a late timer means the executor was busy and the heartbeats received
+  // meanwhile may still be queued, so wait for the next period
+  auto period = std::chrono::milliseconds(
+      std::max(1, this->gpt_params.client_timeout_ms / 4));
+  auto last_check = this->last_client_check;
+  this->last_client_check = std::chrono::steady_clock::now();
+
+  if (this->last_client_check - last_check > 2 * period) {
+    return;
+  }
+
+  {
+    // forget goals that stopped sending heartbeats long ago
+    auto now = std::chrono::steady_clock::now();
+    auto horizon = std::max(
+        std::chrono::milliseconds(10 * this->gpt_params.client_timeout_ms),
+        std::chrono::milliseconds(60000));
+
+    std::lock_guard<std::mutex> lk(this->liveness_mutex);
+    for (auto it = this->heartbeats.begin(); it != this->heartbeats.end();) {
+      if (now - it->second > horizon) {
+        it = this->heartbeats.erase(it);
+      } else {
+        it++;
+      }
+    }
+  }
+
+  // running goals are checked here rather than per token, so prompt eval and
+  // responses held back by the cascade are covered too
+  auto orphan = [this](const rclcpp_action::GoalUUID &goal_id) {
+    std::lock_guard<std::mutex> lk(this->liveness_mutex);
+    this->orphaned_goals.insert(goal_id);
+  };
+
+  auto goal_handle = this->goal_handle_;
+  if (goal_handle != nullptr && goal_handle->is_active() &&
+      this->is_orphaned(goal_handle)) {
+    orphan(goal_handle->get_goal_id());
+    this->llama->cancel();
+    if (this->cascade_llama != nullptr) {
+      this->cascade_llama->cancel();
+    }
+  }
+
+  for (auto &replica : this->replicas) {
+    std::lock_guard<std::mutex> lk(replica->mutex);
+    if (replica->current_goal != nullptr &&
+        this->is_orphaned(replica->current_goal)) {
+      orphan(replica->current_goal->get_goal_id());
+      replica->llama->cancel();
+    }
+  }
+
+  auto retrieval_goal_handle = this->retrieval_goal_handle_;
+  if (retrieval_goal_handle != nullptr && retrieval_goal_handle->is_active() &&
+      !retrieval_goal_handle->is_canceling() &&
+      !this->is_client_alive(retrieval_goal_handle->get_goal_id())) {
+    orphan(retrieval_goal_handle->get_goal_id());
+    this->retrieval_llama->cancel();
+  }
+}
+
+void LlamaNode::watch_client(const rclcpp_action::GoalUUID &goal_id) {
+
+  if (this->gpt_params.client_timeout_ms <= 0) {
+    return;
+  }
+
+  // the client has a full timeout to send its first heartbeat
+  std::lock_guard<std::mutex> lk(this->liveness_mutex);
+  this->heartbeats.emplace(goal_id, std::chrono::steady_clock::now());
+}
+
+bool LlamaNode::is_client_alive(const rclcpp_action::GoalUUID &goal_id) {
+
+  if (this->gpt_params.client_timeout_ms <= 0) {
+    return true;
+  }
+
+  auto timeout = std::chrono::milliseconds(this->gpt_params.client_timeout_ms);
+  auto now = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> lk(this->liveness_mutex);
+
+  auto it = this->heartbeats.find(goal_id);
+  return it != this->heartbeats.end() && now - it->second < timeout;
+}
+
+bool LlamaNode::is_orphaned(
+    const std::shared_ptr<GoalHandleGenerateResponse> leader) {
+
+  if (this->gpt_params.client_timeout_ms <= 0) {
+    return false;
+  }
+
+  // canceled goals are already stopping
+  auto subscribers = this->get_flight_subscribers(leader);
+  if (subscribers.empty()) {
+    return false;
+  }
+
+  // the generation goes on while any of its clients is alive
+  for (auto &gh : subscribers) {
+    if (this->is_client_alive(gh->get_goal_id())) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool LlamaNode::take_orphaned(const rclcpp_action::GoalUUID &goal_id) {
+  std::lock_guard<std::mutex> lk(this->liveness_mutex);
+  return this->orphaned_goals.erase(goal_id) > 0;
+}
+
+/*
+*****************************
+*        DIAGNOSTICS        *
+*****************************
+*/
+void LlamaNode::set_phase(int &phase, int next) {
+
+  if (phase != PHASE_IDLE) {
+    this->n_phase_goals[phase]--;
+  }
+
+  if (next != PHASE_IDLE) {
+    this->n_phase_goals[next]++;
+  }
+
+  phase = next;
+}
+
+void LlamaNode::record_token() {
+
+  std::lock_guard<std::mutex> lk(this->telemetry_mutex);
+  auto now = std::chrono::steady_clock::now();
+
+  // a new burst of tokens starts the decoding time
+  if (this->token_times.empty() ||
+      now - this->token_times.back() > std::chrono::seconds(1)) {
+    this->decode_start = now;
+  }
+
+  this->token_times.push_back(now);
+
+  while (now - this->token_times.front() >
+         std::chrono::seconds(TELEMETRY_LONG_WINDOW)) {
+    this->token_times.pop_front();
+  }
+}
+
+double LlamaNode::get_tokens_per_second(int window_s, double &decode_s) {
+
+  std::lock_guard<std::mutex> lk(this->telemetry_mutex);
+  auto now = std::chrono::steady_clock::now();
+  auto start = now - std::chrono::seconds(window_s);
+
+  size_t n_tokens = this->token_times.end() -
+                    std::lower_bound(this->token_times.begin(),
+                                     this->token_times.end(), start);
+
+  // rates of bursts shorter than the window are not diluted
+  decode_s = std::chrono::duration<double>(now - this->decode_start).count();
+  double span_s = std::max(1.0, std::min((double)window_s, decode_s));
+
+  return n_tokens / span_s;
+}
+
+void LlamaNode::update_diagnostics(
+    diagnostic_updater::DiagnosticStatusWrapper &stat) {
+
+  using diagnostic_msgs::msg::DiagnosticStatus;
+
+  bool loaded = this->llama != nullptr && this->llama->get_ctx() != nullptr;
+  stat.add("model loaded", loaded);
+
+  if (!loaded) {
+    stat.summary(DiagnosticStatus::ERROR, "Model not loaded");
+    return;
+  }
+
+  // phase of the most advanced generation
+  std::string phase = "idle";
+  if (this->n_phase_goals[PHASE_PUBLISHING] > 0) {
+    phase = "publishing";
+  } else if (this->n_phase_goals[PHASE_DECODE] > 0) {
+    phase = "decode";
+  } else if (this->n_phase_goals[PHASE_PREFILL] > 0) {
+    phase = "prefill";
+  }
+  stat.add("phase", phase);
+
+  double decode_s;
+  double tps_long =
+      this->get_tokens_per_second(TELEMETRY_LONG_WINDOW, decode_s);
+  double tps_short =
+      this->get_tokens_per_second(TELEMETRY_SHORT_WINDOW, decode_s);
+  stat.addf("tokens/s (short window)", "%.2f", tps_short);
+  stat.addf("tokens/s (long window)", "%.2f", tps_long);
+
+  // running, queued and coalesced goals, without replicas busy goals are
+  // rejected so only the running ones are counted
+  size_t n_running = 0;
+  size_t n_queued = 0;
+  size_t n_coalesced = 0;
+
+  auto goal_handle = this->goal_handle_;
+  if (goal_handle != nullptr && goal_handle->is_active()) {
+    n_running++;
+  }
+
+  auto retrieval_goal_handle = this->retrieval_goal_handle_;
+  if (retrieval_goal_handle != nullptr && retrieval_goal_handle->is_active()) {
+    n_running++;
+  }
+
+  for (auto &replica : this->replicas) {
+    std::lock_guard<std::mutex> lk(replica->mutex);
+    n_queued += replica->goals.size();
+    if (replica->current_goal != nullptr) {
+      n_running++;
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lk(this->flights_mutex);
+    for (const auto &flight : this->flights) {
+      n_coalesced += flight.followers.size();
+    }
+  }
+
+  stat.add("running goals", n_running);
+  stat.add("generation queue", n_queued);
+  stat.add("coalesced goals", n_coalesced);
+
+  {
+    std::lock_guard<std::mutex> lk(this->embeddings_mutex);
+    stat.add("embeddings queue", this->embeddings_queue.size());
+  }
+
+  // fullest cache
+  float kv_usage = 0.0f;
+  std::vector<std::shared_ptr<Llama>> engines = {this->llama};
+  for (auto &replica : this->replicas) {
+    engines.push_back(replica->llama);
+  }
+  for (auto &engine : engines) {
+    if (engine != nullptr && engine->get_kv_size() > 0) {
+      kv_usage = std::max(kv_usage, 100.0f * engine->get_kv_used() /
+                                        engine->get_kv_size());
+    }
+  }
+  stat.addf("KV usage", "%.1f %%", kv_usage);
+
+  float min_tps = this->gpt_params.min_tokens_per_second;
+  bool decoding = this->n_phase_goals[PHASE_DECODE] > 0 ||
+                  this->n_phase_goals[PHASE_PUBLISHING] > 0;
+
+  if (min_tps > 0.0f && decoding && decode_s >= 2.0 && tps_short < min_tps) {
+    stat.summary(DiagnosticStatus::WARN,
+                 "Throughput below " + std::to_string(min_tps) + " tokens/s");
+  } else if (phase != "idle") {
+    stat.summary(DiagnosticStatus::OK, "Generating");
+  } else {
+    stat.summary(DiagnosticStatus::OK, "Ready");
+  }
+}
+
+/*
+*****************************
+*      GOAL COALESCING      *
+*****************************
+*/
+bool LlamaNode::is_coalescable(
+    std::shared_ptr<const GenerateResponse::Goal> goal) {
+
+  // only greedy sampling gives the same response to every subscriber, and
+  // processors, constraints and bias profiles hold state of their own
+  const auto &sampling_config = goal->sampling_config;
+  return sampling_config.temp <= 0.0f && sampling_config.regex.empty() &&
+         sampling_config.grammar.empty() &&
+         sampling_config.grammar_schema.empty() &&
+         sampling_config.logits_processors.empty() &&
+         sampling_config.logit_bias_profile.empty();
+}
+
+bool LlamaNode::can_join_flight(
+    std::shared_ptr<const GenerateResponse::Goal> goal) {
+
+  if (!this->is_coalescable(goal)) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lk(this->flights_mutex);
+
+  for (const auto &flight : this->flights) {
+    if (*flight.leader->get_goal() == *goal) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool LlamaNode::join_flight(
+    const std::shared_ptr<GoalHandleGenerateResponse> goal_handle) {
+
+  auto goal = goal_handle->get_goal();
+
+  if (!this->is_coalescable(goal)) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lk(this->flights_mutex);
+
+  for (auto &flight : this->flights) {
+    if (*flight.leader->get_goal() == *goal) {
+      flight.followers.push_back(goal_handle);
+
+      if (this->token_ring != nullptr) {
+        this->token_ring->join(goal_handle->get_goal_id().data(),
+                               flight.leader->get_goal_id().data());
+      }
+
+      // late joiners get the partial responses already streamed, under the
+      // lock so none is missed or sent twice
+      for (auto &feedback : flight.feedbacks) {
+        goal_handle->publish_feedback(feedback);
+      }
+
+      if (this->gpt_params.debug) {
+        RCLCPP_INFO(this->get_logger(),
+                    "Goal attached to a running generation (%ld subscribers, "
+                    "%ld partial responses replayed)",
+                    flight.followers.size() + 1, flight.feedbacks.size());
+      }
+
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void LlamaNode::start_flight(
+    const std::shared_ptr<GoalHandleGenerateResponse> goal_handle) {
+
+  if (!this->is_coalescable(goal_handle->get_goal())) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lk(this->flights_mutex);
+  this->flights.push_back({goal_handle, {}, {}});
+}
+
+std::vector<std::shared_ptr<LlamaNode::GoalHandleGenerateResponse>>
+LlamaNode::get_flight_subscribers(
+    const std::shared_ptr<GoalHandleGenerateResponse> leader,
+    std::shared_ptr<GenerateResponse::Feedback> feedback) {
+
+  std::vector<std::shared_ptr<GoalHandleGenerateResponse>> subscribers;
+
+  if (!leader->is_canceling()) {
+    subscribers.push_back(leader);
+  }
+
+  std::lock_guard<std::mutex> lk(this->flights_mutex);
+
+  for (auto &flight : this->flights) {
+    if (flight.leader != leader) {
+      continue;
+    }
+
+    if (feedback != nullptr) {
+      flight.feedbacks.push_back(feedback);
+    }
+
+    // canceled followers leave the flight right away
+    auto it = flight.followers.begin();
+    while (it != flight.followers.end()) {
+      if ((*it)->is_canceling()) {
+        (*it)->canceled(std::make_shared<GenerateResponse::Result>());
+        it = flight.followers.erase(it);
+      } else {
+        subscribers.push_back(*it);
+        it++;
+      }
+    }
+  }
+
+  return subscribers;
+}
+
+std::vector<std::shared_ptr<LlamaNode::GoalHandleGenerateResponse>>
+LlamaNode::end_flight(
+    const std::shared_ptr<GoalHandleGenerateResponse> leader) {
+
+  std::lock_guard<std::mutex> lk(this->flights_mutex);
+
+  for (auto it = this->flights.begin(); it != this->flights.end(); it++) {
+    if (it->leader == leader) {
+      auto followers = it->followers;
+      this->flights.erase(it);
+      return followers;
+    }
+  }
+
+  return {};
+}
+
+std::shared_ptr<LlamaNode::GoalHandleGenerateResponse>
+LlamaNode::get_flight_leader(
+    const std::shared_ptr<GoalHandleGenerateResponse> goal) {
+
+  std::lock_guard<std::mutex> lk(this->flights_mutex);
+
+  for (const auto &flight : this->flights) {
+    if (std::find(flight.followers.begin(), flight.followers.end(), goal) !=
+        flight.followers.end()) {
+      return flight.leader;
+    }
+  }
+
+  return goal;
+}
+
+bool LlamaNode::is_flight_shared(
+    const std::shared_ptr<GoalHandleGenerateResponse> goal) {
+
+  std::lock_guard<std::mutex> lk(this->flights_mutex);
+
+  for (const auto &flight : this->flights) {
+
+    std::vector<std::shared_ptr<GoalHandleGenerateResponse>> subscribers =
+        flight.followers;
+    subscribers.push_back(flight.leader);
+
+    if (std::find(subscribers.begin(), subscribers.end(), goal) ==
+        subscribers.end()) {
+      continue;
+    }
+
+    // other subscribers that still want the response
+    for (const auto &subscriber : subscribers) {
+      if (subscriber != goal && !subscriber->is_canceling()) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  return false;
+}
+
+llama_msgs::msg::PartialResponse
+LlamaNode::create_partial_response(const struct completion_output &completion,
+                                   std::shared_ptr<Llama> llama) {
+
+  llama_msgs::msg::PartialResponse partial_response;
+  partial_response.text = llama->detokenize({completion.token});
+  partial_response.token = completion.token;
+  partial_response.probs.chosen_token = completion.token;
+
+  for (auto prob : completion.probs) {
+    llama_msgs::msg::TokenProb aux;
+    aux.token = prob.token;
+    aux.probability = prob.probability;
+    aux.token_text = llama->detokenize({prob.token});
+    partial_response.probs.data.push_back(aux);
+  }
+
+  return partial_response;
+}
+
+llama_msgs::msg::Response LlamaNode::create_response(
+    const std::vector<struct completion_output> &completions,
+    std::shared_ptr<Llama> llama) {
+
+  llama_msgs::msg::Response response;
+
+  for (auto completion : completions) {
+    response.text.append(llama->detokenize({completion.token}));
+    response.tokens.push_back(completion.token);
+
+    llama_msgs::msg::TokenProbArray probs_msg;
+    for (auto prob : completion.probs) {
+      llama_msgs::msg::TokenProb aux;
+      aux.token = prob.token;
+      aux.probability = prob.probability;
+      aux.token_text = llama->detokenize({prob.token});
+      probs_msg.data.push_back(aux);
+    }
+    response.probs.push_back(probs_msg);
+  }
+
+  return response;
+}
+
+/*
+*****************************
+*    ADD DOCUMENTS SERVICE  *
+*****************************
+*/
+void LlamaNode::add_documents_service_callback(
+    const std::shared_ptr<llama_msgs::srv::AddDocuments::Request> request,
+    std::shared_ptr<llama_msgs::srv::AddDocuments::Response> response) {
+
+  auto llama = this->get_least_loaded_llama();
+
+  if (request->clear) {
+    this->document_index.clear();
+  }
+
+  for (const auto &document : request->documents) {
+
+    std::vector<std::string> chunks;
+
+    if (request->chunk_size > 0) {
+      auto tokens = llama->tokenize(document, false);
+
+      for (size_t i = 0; i < tokens.size(); i += request->chunk_size) {
+        std::vector<llama_token> chunk_tokens(
+            tokens.begin() + i,
+            tokens.begin() +
+                std::min(tokens.size(), i + (size_t)request->chunk_size));
+        chunks.push_back(llama->detokenize(chunk_tokens));
+      }
+
+    } else {
+      chunks.push_back(document);
+    }
+
+    auto embeddings = llama->generate_embeddings(chunks, true);
+
+    for (size_t i = 0; i < chunks.size(); i++) {
+      if (embeddings[i].n_tokens == 0) {
+        RCLCPP_ERROR(this->get_logger(), "Failed to embed document chunk");
+        continue;
+      }
+
+      this->document_index.add(chunks[i], embeddings[i].embeddings);
+    }
+  }
+
+  response->n_chunks = this->document_index.size();
+}
+
+void LlamaNode::set_logit_bias_profile_service_callback(
+    const std::shared_ptr<llama_msgs::srv::SetLogitBiasProfile::Request>
+        request,
+    std::shared_ptr<llama_msgs::srv::SetLogitBiasProfile::Response>
+        response) {
+
+  std::vector<std::shared_ptr<Llama>> engines = {this->llama};
+  for (auto &replica : this->replicas) {
+    if (replica->llama != this->llama) {
+      engines.push_back(replica->llama);
+    }
+  }
+
+  if (this->cascade_llama != nullptr) {
+    engines.push_back(this->cascade_llama);
+  }
+
+  std::vector<std::pair<llama_token, float>> logit_bias;
+  for (const auto &bias : request->logit_bias.data) {
+    logit_bias.push_back({bias.token, bias.bias});
+  }
+
+  response->success = true;
+
+  // every engine holds the profile, removing it succeeds only if all had it
+  for (auto &engine : engines) {
+    if (logit_bias.empty()) {
+      bool removed = engine->remove_logit_bias_profile(request->name);
+      response->success = response->success && removed;
+    } else {
+      engine->add_logit_bias_profile(request->name, logit_bias);
+    }
+  }
+}
+
+/*
+*****************************
+* GENERATE WITH RETRIEVAL   *
+*****************************
+*/
+rclcpp_action::GoalResponse LlamaNode::handle_retrieval_goal(
+    const rclcpp_action::GoalUUID &uuid,
+    std::shared_ptr<const GenerateWithRetrieval::Goal> goal) {
+  (void)uuid;
+
+  if (goal->query.empty()) {
+    return rclcpp_action::GoalResponse::REJECT;
+  }
+
+  if (this->is_busy()) {
+    return rclcpp_action::GoalResponse::REJECT;
+  }
+
+  if (!this->replicas.empty() && this->get_idle_replica(false) == nullptr) {
+    return rclcpp_action::GoalResponse::REJECT;
+  }
+
+  return rclcpp_action::GoalResponse::ACCEPT_AND_EXECUTE;
+}
+
+rclcpp_action::CancelResponse LlamaNode::handle_retrieval_cancel(
+    const std::shared_ptr<GoalHandleGenerateWithRetrieval> goal_handle) {
+  (void)goal_handle;
+  RCLCPP_INFO(this->get_logger(), "Received request to cancel Llama node");
+  auto llama = this->retrieval_llama;
+  if (llama != nullptr) {
+    llama->cancel();
+  }
+  return rclcpp_action::CancelResponse::ACCEPT;
+}
+
+void LlamaNode::handle_retrieval_accepted(
+    const std::shared_ptr<GoalHandleGenerateWithRetrieval> goal_handle) {
+  this->watch_client(goal_handle->get_goal_id());
+
+  LlamaReplica *replica = nullptr;
+
+  if (this->replicas.empty()) {
+    this->retrieval_llama = this->llama;
+
+  } else {
+    // the idle replica seen by handle_retrieval_goal may have taken a goal
+    replica = this->get_idle_replica(true);
+
+    if (replica == nullptr) {
+      RCLCPP_WARN(this->get_logger(),
+                  "No idle replica left for the retrieval goal");
+      goal_handle->abort(std::make_shared<GenerateWithRetrieval::Result>());
+      return;
+    }
+
+    this->retrieval_llama = replica->llama;
+  }
+
+  this->retrieval_goal_handle_ = goal_handle;
+  std::thread{[this, goal_handle, replica]() {
+                this->execute_retrieval(goal_handle);
+
+                if (replica != nullptr) {
+                  this->release_replica(replica);
+                }
+              }}
+      .detach();
+}
+
+std::string LlamaNode::build_retrieval_prompt(
+    std::shared_ptr<Llama> llama,
+    std::shared_ptr<const GenerateWithRetrieval::Goal> goal,
+    std::shared_ptr<GenerateWithRetrieval::Result> result) {
+
+  std::string prompt_template = goal->prompt_template;
+  if (prompt_template.empty()) {
+    prompt_template = "Answer using the following context.\n\n"
+                      "Context:\n{context}\n\nQuestion: {query}";
+  }
+
+  auto fill = [&prompt_template](const std::string &context,
+                                 const std::string &query) {
+    std::string prompt = prompt_template;
+    for (auto field : {std::make_pair(std::string("{context}"), context),
+                       std::make_pair(std::string("{query}"), query)}) {
+      size_t pos = prompt.find(field.first);
+      if (pos != std::string::npos) {
+        prompt.replace(pos, field.first.size(), field.second);
+      }
+    }
+    return prompt;
+  };
+
+  // retrieve chunks
+  auto query_embeddings = llama->generate_embeddings(goal->query, true);
+  int top_k = std::max(1, goal->top_k);
+  std::vector<struct retrieved_document> documents;
+
+  if (goal->rerank) {
+    documents = this->document_index.search(query_embeddings.embeddings,
+                                            top_k * 4);
+    documents = this->document_index.rerank(
+        query_embeddings.embeddings, documents, top_k, goal->rerank_lambda);
+  } else {
+    documents =
+        this->document_index.search(query_embeddings.embeddings, top_k);
+  }
+
+  // token budget left for the context after the template, the query and
+  // the response
+  int n_predict = this->gpt_params.params->n_predict;
+  int budget = llama->get_n_ctx() -
+               (int)llama->tokenize(fill("", goal->query), false).size() -
+               (n_predict > 0 ? n_predict : llama->get_n_ctx() / 4);
+
+  if (goal->context_budget > 0) {
+    budget = std::min(budget, goal->context_budget);
+  }
+
+  // add chunks in rank order while they fit, each chunk is tokenized once
+  // and the context is counted as the sum of its chunks and separators
+  const std::string separator = "\n\n";
+  const int n_separator_tokens = llama->tokenize(separator, false).size();
+  std::string context;
+  int n_context_tokens = 0;
+
+  for (const auto &document : documents) {
+    int n_tokens = n_context_tokens +
+                   (context.empty() ? 0 : n_separator_tokens) +
+                   (int)llama->tokenize(document.text, false).size();
+
+    if (n_tokens > budget) {
+      continue;
+    }
+
+    context = context.empty() ? document.text
+                              : context + separator + document.text;
+    n_context_tokens = n_tokens;
+    result->documents.push_back(document.text);
+    result->scores.push_back(document.score);
+  }
+
+  // drop low-information tokens from the chunks, the template and the query
+  // are kept as they are
+  if (this->prompt_compressor != nullptr && !context.empty()) {
+    context = this->prompt_compressor->compress(
+        PromptCompressor::CONTEXT_BEGIN + context +
+        PromptCompressor::CONTEXT_END);
+    n_context_tokens = llama->tokenize(context, false).size();
+  }
+
+  result->n_context_tokens = n_context_tokens;
+
+  return fill(context, goal->query);
+}
+
+void LlamaNode::execute_retrieval(
+    const std::shared_ptr<GoalHandleGenerateWithRetrieval> goal_handle) {
+
+  auto goal = goal_handle->get_goal();
+  auto result = std::make_shared<GenerateWithRetrieval::Result>();
+  auto llama = this->retrieval_llama;
+
+  // the query is embedded with the same model as the documents
+  if (!llama->is_embedding()) {
+    RCLCPP_ERROR(this->get_logger(),
+                 "Llama must be created with embedding=true to retrieve "
+                 "documents");
+    goal_handle->abort(result);
+    return;
+  }
+
+  if (goal->reset) {
+    llama->reset();
+  }
+
+  std::string prompt = this->build_retrieval_prompt(llama, goal, result);
+
+  if (this->gpt_params.debug) {
+    RCLCPP_INFO(this->get_logger(),
+                "Retrieved %ld chunks (%d tokens), prompt:\n%s",
+                result->documents.size(), result->n_context_tokens,
+                prompt.c_str());
+  }
+
+  // update sampling params of gpt_params, replicas sample with their copy
+  llama_utils::GptParams *gpt_params = &this->gpt_params;
+  for (auto &replica : this->replicas) {
+    if (replica->llama == llama) {
+      gpt_params = &replica->gpt_params;
+    }
+  }
+
+  gpt_params->update_sampling_params(goal->sampling_config,
+                                     llama->get_n_vocab(),
+                                     llama->get_token_eos());
+
+  if (!llama->set_regex(goal->sampling_config.regex)) {
+    goal_handle->abort(result);
+    return;
+  }
+
+  if (!llama->set_logit_bias_profile(
+          goal->sampling_config.logit_bias_profile)) {
+    goal_handle->abort(result);
+    return;
+  }
+
+  std::vector<std::shared_ptr<LogitsProcessor>> processors;
+  if (!this->get_logits_processors(
+          llama, goal->sampling_config.logits_processors, processors)) {
+    goal_handle->abort(result);
+    return;
+  }
+  llama->set_logits_processors(processors);
+
+  // call llama
+  int phase = PHASE_IDLE;
+  this->set_phase(phase, PHASE_PREFILL);
+
+  struct response_output output = llama->generate_response(
+      prompt,
+      [this, goal_handle, llama,
+       &phase](struct completion_output completion) {
+        this->record_token();
+        this->set_phase(phase, PHASE_PUBLISHING);
+        auto feedback = std::make_shared<GenerateWithRetrieval::Feedback>();
+        feedback->partial_response =
+            this->create_partial_response(completion, llama);
+        goal_handle->publish_feedback(feedback);
+        this->set_phase(phase, PHASE_DECODE);
+      });
+
+  this->set_phase(phase, PHASE_IDLE);
+
+  if (this->take_orphaned(goal_handle->get_goal_id())) {
+    RCLCPP_WARN(this->get_logger(), "Client lost, aborting generation");
+    if (output.stop == stop_type::CANCEL) {
+      output.stop = stop_type::ABORT;
+    }
+    llama->reset();
+  }
+
+  if (output.stop == stop_type::FULL_STOP) {
+    result->response = this->create_response(output.completions, llama);
+  }
+
+  if (rclcpp::ok()) {
+
+    if (output.stop == stop_type::CANCEL) {
+      goal_handle->canceled(result);
+
+    } else if (output.stop == stop_type::ABORT) {
+      goal_handle->abort(result);
+
+    } else {
+      goal_handle->succeed(result);
+    }
+
+    if (this->retrieval_goal_handle_ == goal_handle) {
+      this->retrieval_goal_handle_ = nullptr;
+    }
   }
 }
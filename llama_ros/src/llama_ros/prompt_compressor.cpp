@@ -0,0 +1,245 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+#include "common.h"
+#include "llama_ros/llama.hpp"
+#include "llama_ros/prompt_compressor.hpp"
+#include "llama_utils/compute_pool.hpp"
+
+using namespace llama_ros;
+
+// scoring window and decode batch, the logits of one batch are turned into
+// scores before the next one is decoded
+#define COMPRESSOR_N_CTX 512
+#define COMPRESSOR_N_BATCH 32
+
+PromptCompressor::PromptCompressor(const std::string &model_path,
+                                   int n_threads, float ratio, int budget)
+    : ctx(nullptr), n_threads(n_threads), ratio(ratio), budget(budget) {
+
+  auto mparams = llama_model_default_params();
+  this->model = llama_load_model_from_file(model_path.c_str(), mparams);
+
+  if (this->model == NULL) {
+    LLAMA_LOG_ERROR("Unable to load compressor model %s", model_path.c_str());
+    return;
+  }
+
+  auto cparams = llama_context_default_params();
+  cparams.n_ctx = COMPRESSOR_N_CTX;
+  cparams.n_batch = COMPRESSOR_N_BATCH;
+  cparams.n_ubatch = COMPRESSOR_N_BATCH;
+  cparams.n_threads = n_threads;
+  cparams.n_threads_batch = n_threads;
+  this->ctx = llama_new_context_with_model(this->model, cparams);
+
+  if (this->ctx == NULL) {
+    LLAMA_LOG_ERROR("Unable to create compressor context");
+  }
+}
+
+PromptCompressor::~PromptCompressor() {
+  if (this->ctx != nullptr) {
+    llama_free(this->ctx);
+  }
+  if (this->model != nullptr) {
+    llama_free_model(this->model);
+  }
+}
+
+void PromptCompressor::split(const std::string &prompt,
+                             std::vector<std::string> &parts,
+                             std::vector<std::string> &blocks) {
+
+  const std::string begin_tag(CONTEXT_BEGIN);
+  const std::string end_tag(CONTEXT_END);
+  size_t pos = 0;
+
+  while (true) {
+    size_t begin = prompt.find(begin_tag, pos);
+    size_t end = begin == std::string::npos ? std::string::npos
+                                            : prompt.find(end_tag, begin);
+
+    if (end == std::string::npos) {
+      parts.push_back(prompt.substr(pos));
+      break;
+    }
+
+    parts.push_back(prompt.substr(pos, begin - pos));
+    blocks.push_back(prompt.substr(begin + begin_tag.size(),
+                                   end - begin - begin_tag.size()));
+    pos = end + end_tag.size();
+  }
+}
+
+float PromptCompressor::get_surprisal(const float *logits, int n_vocab,
+                                      llama_token token) {
+
+  const float max_logit = *std::max_element(logits, logits + n_vocab);
+
+  double sum = 0.0;
+  for (int v = 0; v < n_vocab; v++) {
+    sum += std::exp(logits[v] - max_logit);
+  }
+
+  return max_logit + std::log(sum) - logits[token];
+}
+
+std::vector<std::vector<bool>>
+PromptCompressor::select(const std::vector<std::vector<float>> &scores,
+                         float ratio, int budget) {
+
+  std::vector<std::vector<bool>> keep;
+  std::vector<std::pair<size_t, size_t>> index;
+  size_t n_tokens = 0;
+
+  for (size_t b = 0; b < scores.size(); b++) {
+    keep.push_back(std::vector<bool>(scores[b].size(), false));
+
+    for (size_t i = 0; i < scores[b].size(); i++) {
+      index.push_back({b, i});
+    }
+    n_tokens += scores[b].size();
+  }
+
+  size_t n_keep = (size_t)std::ceil(n_tokens * ratio);
+  if (budget > 0) {
+    n_keep = std::min(n_keep, (size_t)budget);
+  }
+
+  if (n_keep < n_tokens) {
+    std::nth_element(index.begin(), index.begin() + n_keep, index.end(),
+                     [&scores](const std::pair<size_t, size_t> &a,
+                               const std::pair<size_t, size_t> &b) {
+                       return scores[a.first][a.second] >
+                              scores[b.first][b.second];
+                     });
+    index.resize(n_keep);
+  }
+
+  for (auto &i : index) {
+    keep[i.first][i.second] = true;
+  }
+
+  return keep;
+}
+
+std::vector<float>
+PromptCompressor::score(const std::vector<llama_token> &tokens) {
+
+  const int n_vocab = llama_n_vocab(this->model);
+
+  // the first token of each window has no context, so it is always kept
+  std::vector<float> surprisal(tokens.size(), INFINITY);
+  struct llama_batch batch = llama_batch_init(COMPRESSOR_N_BATCH, 0, 1);
+
+  for (size_t start = 0; start < tokens.size(); start += COMPRESSOR_N_CTX) {
+
+    size_t end = std::min(tokens.size(), start + COMPRESSOR_N_CTX);
+    llama_kv_cache_clear(this->ctx);
+
+    for (size_t first = start; first < end; first += COMPRESSOR_N_BATCH) {
+
+      size_t last = std::min(end, first + COMPRESSOR_N_BATCH);
+      llama_batch_clear(batch);
+
+      for (size_t i = first; i < last; i++) {
+        llama_batch_add(batch, tokens[i], i - start, {0}, true);
+      }
+
+      llama_utils::ComputeLease lease(this->n_threads,
+                                      llama_utils::GENERATION);
+      llama_set_n_threads(this->ctx, lease.get_n_threads(),
+                          lease.get_n_threads());
+
+      if (llama_decode(this->ctx, batch)) {
+        LLAMA_LOG_ERROR("Failed to eval compressor window");
+        llama_batch_free(batch);
+        return surprisal;
+      }
+
+      // the logits of position i score the token at i + 1
+      for (size_t i = first; i < last && i + 1 < end; i++) {
+        surprisal[i + 1] =
+            get_surprisal(llama_get_logits_ith(this->ctx, i - first), n_vocab,
+                          tokens[i + 1]);
+      }
+    }
+  }
+
+  llama_batch_free(batch);
+  return surprisal;
+}
+
+std::string PromptCompressor::compress(const std::string &prompt) {
+
+  std::lock_guard<std::mutex> lk(this->mutex);
+
+  if (!this->is_loaded()) {
+    return prompt;
+  }
+
+  // split the prompt into kept text and compressible blocks
+  std::vector<std::string> parts;
+  std::vector<std::string> texts;
+  split(prompt, parts, texts);
+
+  if (texts.empty()) {
+    return prompt;
+  }
+
+  // score every block
+  std::vector<std::vector<llama_token>> blocks;
+  std::vector<std::vector<float>> scores;
+  size_t n_tokens = 0;
+
+  for (const auto &text : texts) {
+    blocks.push_back(llama_tokenize(this->ctx, text, false, false));
+    scores.push_back(this->score(blocks.back()));
+    n_tokens += blocks.back().size();
+  }
+
+  // keep the most surprising tokens and rebuild the prompt
+  auto keep = select(scores, this->ratio, this->budget);
+  std::string compressed = parts[0];
+  size_t n_kept = 0;
+
+  for (size_t b = 0; b < blocks.size(); b++) {
+    for (size_t i = 0; i < blocks[b].size(); i++) {
+      if (keep[b][i]) {
+        compressed.append(llama_token_to_piece(this->ctx, blocks[b][i]));
+        n_kept++;
+      }
+    }
+    compressed.append(parts[b + 1]);
+  }
+
+  LLAMA_LOG_INFO("Prompt compressed from %ld to %ld context tokens", n_tokens,
+                 n_kept);
+
+  return compressed;
+}
@@ -0,0 +1,169 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "llama_utils/compute_pool.hpp"
+
+using namespace llama_utils;
+
+ComputePool &ComputePool::get_instance() {
+  static ComputePool instance;
+  return instance;
+}
+
+ComputePool::ComputePool() : yield_us(0) {
+  this->n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+  this->n_available = this->n_threads;
+  this->stats = {0, 0, 0, 0};
+
+  for (int i = 0; i < N_WORKLOADS; i++) {
+    this->rank[i] = i;
+    this->n_waiting[i] = 0;
+  }
+}
+
+void ComputePool::configure(int n_threads, int yield_us,
+                            const std::vector<compute_workload> &priority) {
+
+  std::lock_guard<std::mutex> lk(this->mutex);
+
+  if (n_threads <= 0) {
+    n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+  }
+
+  this->n_available += n_threads - this->n_threads;
+  this->n_threads = n_threads;
+  this->yield_us = std::max(0, yield_us);
+
+  // workloads not listed keep their default order after the listed ones
+  int next_rank = 0;
+  bool ranked[N_WORKLOADS] = {false};
+
+  for (auto workload : priority) {
+    if (workload < N_WORKLOADS && !ranked[workload]) {
+      this->rank[workload] = next_rank++;
+      ranked[workload] = true;
+    }
+  }
+
+  for (int i = 0; i < N_WORKLOADS; i++) {
+    if (!ranked[i]) {
+      this->rank[i] = next_rank++;
+    }
+  }
+
+  this->cv.notify_all();
+}
+
+compute_workload ComputePool::workload_from_string(const std::string &name) {
+  if (name == "generation") {
+    return GENERATION;
+  } else if (name == "vision") {
+    return VISION;
+  } else if (name == "embeddings") {
+    return EMBEDDINGS;
+  }
+  return N_WORKLOADS;
+}
+
+bool ComputePool::can_acquire(int n_threads, compute_workload workload) {
+
+  if (this->n_available < n_threads) {
+    return false;
+  }
+
+  // let waiting workloads with higher priority go first
+  for (int i = 0; i < N_WORKLOADS; i++) {
+    if (this->rank[i] < this->rank[workload] && this->n_waiting[i] > 0) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int ComputePool::acquire(int n_threads, compute_workload workload) {
+
+  auto start = std::chrono::steady_clock::now();
+
+  // configure may resize the budget meanwhile
+  std::unique_lock<std::mutex> lk(this->mutex);
+  n_threads = std::max(1, std::min(n_threads, this->n_threads));
+  auto yield_end = start + std::chrono::microseconds(this->yield_us);
+  this->stats.n_leases++;
+
+  if (this->can_acquire(n_threads, workload)) {
+    this->n_available -= n_threads;
+    return n_threads;
+  }
+
+  this->n_waiting[workload]++;
+
+  // yield: short waits between tokens are cheaper than a futex round trip
+  while (std::chrono::steady_clock::now() < yield_end) {
+    lk.unlock();
+    std::this_thread::yield();
+    lk.lock();
+
+    if (this->can_acquire(n_threads, workload)) {
+      this->stats.n_yield_hits++;
+      break;
+    }
+  }
+
+  // sleep
+  if (!this->can_acquire(n_threads, workload)) {
+    this->stats.n_sleeps++;
+    this->cv.wait(lk, [this, &n_threads, workload] {
+      n_threads = std::min(n_threads, this->n_threads);
+      return this->can_acquire(n_threads, workload);
+    });
+  }
+
+  this->n_waiting[workload]--;
+  this->n_available -= n_threads;
+  this->stats.wait_us += std::chrono::duration_cast<std::chrono::microseconds>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+
+  return n_threads;
+}
+
+void ComputePool::release(int n_threads) {
+  std::lock_guard<std::mutex> lk(this->mutex);
+  this->n_available += n_threads;
+  this->cv.notify_all();
+}
+
+int ComputePool::get_n_threads() {
+  std::lock_guard<std::mutex> lk(this->mutex);
+  return this->n_threads;
+}
+
+struct compute_pool_stats ComputePool::get_stats() {
+  std::lock_guard<std::mutex> lk(this->mutex);
+  return this->stats;
+}
@@ -26,6 +26,7 @@
 #include "json-schema-to-grammar.h"
 #include "json.hpp"
 
+#include "llama_utils/compute_pool.hpp"
 #include "llama_utils/gpt_params.hpp"
 
 using namespace llama_utils;
@@ -39,13 +40,23 @@ void replace_all(std::string &input, const std::string &old_str,
   }
 }
 
-GptParams::GptParams() : debug(false) {
+GptParams::GptParams()
+    : debug(false), numa_replicas(false), compression_ratio(0.5f),
+      compression_budget(0), image_change_threshold(0.0f),
+      embeddings_batch_window_us(0), max_image_tiles(1), vision_workers(1),
+      lazy_vision(false), kv_tier_threshold(0), kv_tier_n_ctx(0),
+      prefetch_layers(0), min_tokens_per_second(0.0f),
+      token_ring_capacity(0), client_timeout_ms(0), cascade_threshold(0.5f),
+      cascade_window(4), cascade_reuse_output(true) {
   this->params = std::make_shared<struct gpt_params>();
 }
 
 std::shared_ptr<struct gpt_params> GptParams::load_params(rclcpp::Node *node) {
 
   std::vector<std::string> stopping_words;
+  std::vector<std::string> thread_budget_priority;
+  int32_t thread_budget;
+  int32_t thread_budget_yield_us;
   std::string file_path;
   std::string lora_adapter;
 
@@ -73,6 +84,18 @@ std::shared_ptr<struct gpt_params> GptParams::load_params(rclcpp::Node *node) {
                                             {"n_parallel", 1},
                                             {"n_sequences", 1},
                                             {"yarn_orig_ctx", 0},
+                                            {"thread_budget", -1},
+                                            {"thread_budget_yield_us", 50},
+                                            {"compression_budget", 0},
+                                            {"embeddings_batch_window_us", 0},
+                                            {"max_image_tiles", 1},
+                                            {"vision_workers", 1},
+                                            {"kv_tier_threshold", 0},
+                                            {"kv_tier_n_ctx", 0},
+                                            {"prefetch_layers", 0},
+                                            {"token_ring_capacity", 0},
+                                            {"client_timeout_ms", 0},
+                                            {"cascade_window", 4},
                                         });
   node->declare_parameters<std::string>("", {
                                                 {"model", ""},
@@ -85,13 +108,21 @@ std::shared_ptr<struct gpt_params> GptParams::load_params(rclcpp::Node *node) {
                                                 {"pooling_type", ""},
                                                 {"cache_type_k", "f16"},
                                                 {"cache_type_v", "f16"},
+                                                {"kv_tier_type", ""},
                                                 {"system_prompt", ""},
                                                 {"system_prompt_file", ""},
                                                 {"prefix", ""},
                                                 {"suffix", ""},
+                                                {"compressor_model", ""},
+                                                {"cascade_model", ""},
                                             });
   node->declare_parameter<std::vector<std::string>>(
       "stopping_words", std::vector<std::string>({}));
+  node->declare_parameter<std::vector<std::string>>(
+      "logits_processors", std::vector<std::string>({}));
+  node->declare_parameter<std::vector<std::string>>(
+      "thread_budget_priority",
+      std::vector<std::string>({"generation", "vision", "embeddings"}));
   node->declare_parameters<float>("", {
                                           {"rope_freq_base", 0.0f},
                                           {"rope_freq_scale", 0.0f},
@@ -99,6 +130,10 @@ std::shared_ptr<struct gpt_params> GptParams::load_params(rclcpp::Node *node) {
                                           {"yarn_attn_factor", 1.0f},
                                           {"yarn_beta_fast", 32.0f},
                                           {"yarn_beta_slow", 1.0f},
+                                          {"compression_ratio", 0.5f},
+                                          {"image_change_threshold", 0.0f},
+                                          {"min_tokens_per_second", 0.0f},
+                                          {"cascade_threshold", 0.5f},
                                       });
   node->declare_parameter<std::vector<double>>("tensor_split",
                                                std::vector<double>({0.0}));
@@ -114,6 +149,8 @@ std::shared_ptr<struct gpt_params> GptParams::load_params(rclcpp::Node *node) {
                                          {"warmup", true},
                                          {"check_tensors", false},
                                          {"flash_attn", false},
+                                         {"lazy_vision", false},
+                                         {"cascade_reuse_output", true},
                                      });
 
   node->get_parameter("seed", this->params->seed);
@@ -173,6 +210,38 @@ std::shared_ptr<struct gpt_params> GptParams::load_params(rclcpp::Node *node) {
   node->get_parameter("suffix", this->params->input_suffix);
   node->get_parameter("stopping_words", stopping_words);
 
+  node->get_parameter("compressor_model", this->compressor_model);
+  node->get_parameter("compression_ratio", this->compression_ratio);
+  node->get_parameter("compression_budget", this->compression_budget);
+  node->get_parameter("embeddings_batch_window_us",
+                      this->embeddings_batch_window_us);
+
+  node->get_parameter("image_change_threshold",
+                      this->image_change_threshold);
+
+  node->get_parameter("max_image_tiles", this->max_image_tiles);
+  node->get_parameter("vision_workers", this->vision_workers);
+  node->get_parameter("lazy_vision", this->lazy_vision);
+
+  node->get_parameter("kv_tier_type", this->kv_tier_type);
+  node->get_parameter("kv_tier_threshold", this->kv_tier_threshold);
+  node->get_parameter("kv_tier_n_ctx", this->kv_tier_n_ctx);
+
+  node->get_parameter("prefetch_layers", this->prefetch_layers);
+  node->get_parameter("logits_processors", this->logits_processors);
+  node->get_parameter("min_tokens_per_second", this->min_tokens_per_second);
+  node->get_parameter("token_ring_capacity", this->token_ring_capacity);
+  node->get_parameter("client_timeout_ms", this->client_timeout_ms);
+
+  node->get_parameter("cascade_model", this->cascade_model);
+  node->get_parameter("cascade_threshold", this->cascade_threshold);
+  node->get_parameter("cascade_window", this->cascade_window);
+  node->get_parameter("cascade_reuse_output", this->cascade_reuse_output);
+
+  node->get_parameter("thread_budget", thread_budget);
+  node->get_parameter("thread_budget_yield_us", thread_budget_yield_us);
+  node->get_parameter("thread_budget_priority", thread_budget_priority);
+
   node->get_parameter("system_prompt", this->params->prompt);
   node->get_parameter("system_prompt_file", file_path);
   node->get_parameter("debug", this->debug);
@@ -186,12 +255,42 @@ std::shared_ptr<struct gpt_params> GptParams::load_params(rclcpp::Node *node) {
     this->params->n_threads_batch = get_math_cpu_count();
   }
 
+  // thread budget shared by every compute call of the node
+  std::vector<compute_workload> workloads;
+  for (auto name : thread_budget_priority) {
+    auto workload = ComputePool::workload_from_string(name);
+    if (workload == N_WORKLOADS) {
+      RCLCPP_WARN(node->get_logger(), "Unknown compute workload %s",
+                  name.c_str());
+      continue;
+    }
+    workloads.push_back(workload);
+  }
+  ComputePool::get_instance().configure(thread_budget, thread_budget_yield_us,
+                                        workloads);
+
   // lora_adapter
   if (lora_adapter.size()) {
     this->params->lora_adapter.push_back({lora_adapter, 1.0f});
     this->params->use_mmap = false;
   }
 
+  // weight streaming
+  if (this->prefetch_layers > 0) {
+    if (this->params->use_mlock) {
+      RCLCPP_WARN(node->get_logger(),
+                  "Weights are locked in memory, prefetch_layers ignored");
+    } else if (this->params->use_mmap) {
+      this->weight_streamer =
+          std::make_shared<WeightStreamer>(this->prefetch_layers);
+      this->params->cb_eval = WeightStreamer::eval_callback;
+      this->params->cb_eval_user_data = this->weight_streamer.get();
+    } else {
+      RCLCPP_WARN(node->get_logger(),
+                  "Weight streaming needs use_mmap, prefetch_layers ignored");
+    }
+  }
+
   // stopping words are the antiprompt
   for (std::string word : stopping_words) {
     replace_all(word, "\\n", "\n");
@@ -229,6 +328,10 @@ std::shared_ptr<struct gpt_params> GptParams::load_params(rclcpp::Node *node) {
     this->params->numa = GGML_NUMA_STRATEGY_NUMACTL;
   } else if (numa == "mirror") {
     this->params->numa = GGML_NUMA_STRATEGY_MIRROR;
+  } else if (numa == "replicas") {
+    // one engine per node, pinned by llama_ros instead of ggml
+    this->params->numa = GGML_NUMA_STRATEGY_DISABLED;
+    this->numa_replicas = true;
   }
 
   // pooling
@@ -316,7 +419,8 @@ bool GptParams::update_sampling_params(
   this->params->sparams.top_k =
       this->params->sparams.top_k <= 0 ? n_vocab : this->params->sparams.top_k;
 
-  // add logit bias
+  // add logit bias, biases of previous goals are dropped
+  this->params->sparams.logit_bias.clear();
   for (auto logit_bias : sampling_config.logit_bias.data) {
     this->params->sparams.logit_bias[logit_bias.token] = logit_bias.bias;
   }
@@ -0,0 +1,97 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <cstdio>
+#include <cstring>
+
+#include "ggml-backend.h"
+#include "llama_utils/imatrix.hpp"
+
+using namespace llama_utils;
+
+bool ImatrixCollector::eval_callback(struct ggml_tensor *t, bool ask,
+                                     void *user_data) {
+  return static_cast<ImatrixCollector *>(user_data)->collect(t, ask);
+}
+
+bool ImatrixCollector::collect(struct ggml_tensor *t, bool ask) {
+
+  const struct ggml_tensor *src0 = t->src[0];
+  const struct ggml_tensor *src1 = t->src[1];
+
+  // only dense matmuls of repeating layers with enough tokens are collected,
+  // MoE (GGML_OP_MUL_MAT_ID) is not supported
+  if (ask) {
+    return t->op == GGML_OP_MUL_MAT && src1->ne[1] >= 16 &&
+           src1->type == GGML_TYPE_F32 &&
+           std::strncmp(src0->name, "blk.", 4) == 0;
+  }
+
+  std::lock_guard<std::mutex> lk(this->mutex);
+
+  // activations may live in device memory
+  const float *data = (const float *)src1->data;
+  if (!ggml_backend_buffer_is_host(src1->buffer)) {
+    this->buffer.resize(ggml_nbytes(src1) / sizeof(float));
+    ggml_backend_tensor_get(src1, this->buffer.data(), 0, ggml_nbytes(src1));
+    data = this->buffer.data();
+  }
+
+  auto &e = this->stats[src0->name];
+
+  if (e.values.empty()) {
+    e.values.resize(src1->ne[0], 0.0f);
+
+  } else if ((int64_t)e.values.size() != src1->ne[0]) {
+    fprintf(stderr, "[ERROR] inconsistent size for %s\n", src0->name);
+    return false;
+  }
+
+  ++e.ncall;
+
+  for (int64_t row = 0; row < src1->ne[1]; ++row) {
+    const float *x = (const float *)((const char *)data + row * src1->nb[1]);
+    for (int64_t j = 0; j < src1->ne[0]; ++j) {
+      e.values[j] += x[j] * x[j];
+    }
+  }
+
+  return true;
+}
+
+std::unordered_map<std::string, std::vector<float>>
+ImatrixCollector::get_imatrix() {
+
+  std::lock_guard<std::mutex> lk(this->mutex);
+  std::unordered_map<std::string, std::vector<float>> imatrix;
+
+  for (auto &s : this->stats) {
+    std::vector<float> values(s.second.values);
+    for (auto &v : values) {
+      v /= s.second.ncall;
+    }
+    imatrix[s.first] = values;
+  }
+
+  return imatrix;
+}
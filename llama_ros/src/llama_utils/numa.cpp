@@ -0,0 +1,112 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#include <sstream>
+
+#include "llama_utils/numa.hpp"
+
+using namespace llama_utils;
+
+std::vector<int> llama_utils::parse_cpu_list(const std::string &list) {
+
+  std::vector<int> cpus;
+  std::stringstream ss(list);
+  std::string range;
+
+  while (std::getline(ss, range, ',')) {
+
+    if (range.empty() || range == "\n") {
+      continue;
+    }
+
+    try {
+      size_t dash = range.find('-');
+
+      if (dash == std::string::npos) {
+        cpus.push_back(std::stoi(range));
+
+      } else {
+        int first = std::stoi(range.substr(0, dash));
+        int last = std::stoi(range.substr(dash + 1));
+
+        for (int i = first; i <= last; i++) {
+          cpus.push_back(i);
+        }
+      }
+    } catch (const std::exception &) {
+      return {};
+    }
+  }
+
+  return cpus;
+}
+
+std::vector<struct numa_node> llama_utils::get_numa_nodes() {
+
+  std::vector<struct numa_node> nodes;
+  const std::string sysfs = "/sys/devices/system/node/";
+
+  std::ifstream online_file(sysfs + "online");
+  if (!online_file) {
+    return nodes;
+  }
+
+  std::string online;
+  std::getline(online_file, online);
+
+  for (int id : parse_cpu_list(online)) {
+
+    std::ifstream cpulist_file(sysfs + "node" + std::to_string(id) +
+                               "/cpulist");
+    std::string cpulist;
+
+    if (!cpulist_file || !std::getline(cpulist_file, cpulist)) {
+      continue;
+    }
+
+    struct numa_node node = {id, parse_cpu_list(cpulist)};
+    if (!node.cpus.empty()) {
+      nodes.push_back(node);
+    }
+  }
+
+  return nodes;
+}
+
+bool llama_utils::pin_thread_to_cpus(const std::vector<int> &cpus) {
+
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+
+  for (int cpu : cpus) {
+    if (cpu >= 0 && cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &cpuset);
+    }
+  }
+
+  return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) ==
+         0;
+}
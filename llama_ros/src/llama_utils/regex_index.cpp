@@ -0,0 +1,638 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <algorithm>
+#include <bitset>
+#include <iterator>
+#include <map>
+#include <stdexcept>
+
+#include "llama_utils/regex_index.hpp"
+
+using namespace llama_utils;
+
+namespace {
+
+const int MAX_REPEAT = 256;
+const int MAX_DFA_STATES = 4096;
+
+using byte_set = std::bitset<256>;
+
+int first_byte(const byte_set &set) {
+  for (int b = 0; b < 256; b++) {
+    if (set.test(b)) {
+      return b;
+    }
+  }
+  return -1;
+}
+
+/*
+*****************************
+*          PARSER           *
+*****************************
+*/
+struct regex_node {
+  enum { SET, CONCAT, ALT, REPEAT } type;
+  byte_set set;
+  std::vector<std::unique_ptr<regex_node>> children;
+  int min = 0;
+  int max = 0; // -1 = unbounded
+};
+
+class RegexParser {
+
+public:
+  RegexParser(const std::string &pattern) : pattern(pattern), pos(0) {}
+
+  std::unique_ptr<regex_node> parse() {
+
+    // the whole text is always matched, anchors are redundant
+    if (this->peek('^')) {
+      this->pos++;
+    }
+
+    auto node = this->parse_alt();
+
+    if (this->pos < this->pattern.size()) {
+      throw std::runtime_error("Unexpected '" +
+                               std::string(1, this->pattern[this->pos]) +
+                               "' at " + std::to_string(this->pos));
+    }
+
+    return node;
+  }
+
+private:
+  const std::string &pattern;
+  size_t pos;
+
+  bool peek(char c) {
+    return this->pos < this->pattern.size() && this->pattern[this->pos] == c;
+  }
+
+  bool at_end() {
+    return this->pos >= this->pattern.size() ||
+           (this->pattern[this->pos] == '$' &&
+            this->pos == this->pattern.size() - 1);
+  }
+
+  std::unique_ptr<regex_node> parse_alt() {
+    auto node = std::make_unique<regex_node>();
+    node->type = regex_node::ALT;
+    node->children.push_back(this->parse_concat());
+
+    while (this->peek('|')) {
+      this->pos++;
+      node->children.push_back(this->parse_concat());
+    }
+
+    if (node->children.size() == 1) {
+      return std::move(node->children.front());
+    }
+
+    return node;
+  }
+
+  std::unique_ptr<regex_node> parse_concat() {
+    auto node = std::make_unique<regex_node>();
+    node->type = regex_node::CONCAT;
+
+    while (!this->at_end() && !this->peek('|') && !this->peek(')')) {
+      node->children.push_back(this->parse_repeat());
+    }
+
+    if (this->peek('$')) {
+      this->pos++;
+    }
+
+    return node;
+  }
+
+  std::unique_ptr<regex_node> parse_repeat() {
+    auto node = this->parse_atom();
+
+    while (this->pos < this->pattern.size()) {
+      int min, max;
+      char c = this->pattern[this->pos];
+
+      if (c == '*') {
+        min = 0;
+        max = -1;
+        this->pos++;
+      } else if (c == '+') {
+        min = 1;
+        max = -1;
+        this->pos++;
+      } else if (c == '?') {
+        min = 0;
+        max = 1;
+        this->pos++;
+      } else if (c == '{') {
+        this->parse_bounds(min, max);
+      } else {
+        break;
+      }
+
+      auto repeat = std::make_unique<regex_node>();
+      repeat->type = regex_node::REPEAT;
+      repeat->min = min;
+      repeat->max = max;
+      repeat->children.push_back(std::move(node));
+      node = std::move(repeat);
+    }
+
+    return node;
+  }
+
+  void parse_bounds(int &min, int &max) {
+    this->pos++; // {
+    min = this->parse_int();
+    max = min;
+
+    if (this->peek(',')) {
+      this->pos++;
+      max = this->peek('}') ? -1 : this->parse_int();
+    }
+
+    if (!this->peek('}')) {
+      throw std::runtime_error("Expected '}' at " + std::to_string(this->pos));
+    }
+    this->pos++;
+
+    if (min > MAX_REPEAT || max > MAX_REPEAT || (max != -1 && max < min)) {
+      throw std::runtime_error("Invalid repetition bounds");
+    }
+  }
+
+  int parse_int() {
+    size_t start = this->pos;
+    while (this->pos < this->pattern.size() &&
+           isdigit((unsigned char)this->pattern[this->pos])) {
+      this->pos++;
+    }
+
+    if (start == this->pos) {
+      throw std::runtime_error("Expected number at " +
+                               std::to_string(this->pos));
+    }
+
+    return std::stoi(this->pattern.substr(start, this->pos - start));
+  }
+
+  std::unique_ptr<regex_node> parse_atom() {
+    auto node = std::make_unique<regex_node>();
+    node->type = regex_node::SET;
+    char c = this->pattern[this->pos++];
+
+    if (c == '(') {
+      // non-capturing groups are the same as groups here
+      if (this->pattern.compare(this->pos, 2, "?:") == 0) {
+        this->pos += 2;
+      }
+
+      node = this->parse_alt();
+
+      if (!this->peek(')')) {
+        throw std::runtime_error("Expected ')' at " +
+                                 std::to_string(this->pos));
+      }
+      this->pos++;
+
+    } else if (c == '[') {
+      node->set = this->parse_class();
+
+    } else if (c == '.') {
+      node->set.set();
+      node->set.reset('\n');
+
+    } else if (c == '\\') {
+      node->set = this->parse_escape();
+
+    } else if (c == '*' || c == '+' || c == '?' || c == '{' || c == ')') {
+      throw std::runtime_error("Unexpected '" + std::string(1, c) + "' at " +
+                               std::to_string(this->pos - 1));
+
+    } else {
+      node->set.set((unsigned char)c);
+    }
+
+    return node;
+  }
+
+  byte_set parse_escape() {
+    if (this->pos >= this->pattern.size()) {
+      throw std::runtime_error("Trailing '\\'");
+    }
+
+    byte_set set;
+    char c = this->pattern[this->pos++];
+
+    switch (c) {
+    case 'd':
+    case 'D':
+      for (int b = '0'; b <= '9'; b++) {
+        set.set(b);
+      }
+      break;
+    case 'w':
+    case 'W':
+      for (int b = 0; b < 256; b++) {
+        if (isalnum(b) || b == '_') {
+          set.set(b);
+        }
+      }
+      break;
+    case 's':
+    case 'S':
+      for (char b : std::string(" \t\n\r\f\v")) {
+        set.set((unsigned char)b);
+      }
+      break;
+    case 'n':
+      set.set('\n');
+      break;
+    case 't':
+      set.set('\t');
+      break;
+    case 'r':
+      set.set('\r');
+      break;
+    default:
+      set.set((unsigned char)c);
+      return set;
+    }
+
+    if (isupper((unsigned char)c)) {
+      set.flip();
+    }
+
+    return set;
+  }
+
+  byte_set parse_class() {
+    byte_set set;
+    bool negate = false;
+
+    if (this->peek('^')) {
+      negate = true;
+      this->pos++;
+    }
+
+    bool first = true;
+    while (this->pos < this->pattern.size() && (first || !this->peek(']'))) {
+      first = false;
+      byte_set item;
+      int lo = -1;
+
+      if (this->peek('\\')) {
+        this->pos++;
+        item = this->parse_escape();
+        if (item.count() == 1) {
+          lo = first_byte(item);
+        }
+      } else {
+        lo = (unsigned char)this->pattern[this->pos++];
+        item.set(lo);
+      }
+
+      // range
+      if (lo != -1 && this->peek('-') && this->pos + 1 < this->pattern.size() &&
+          this->pattern[this->pos + 1] != ']') {
+        this->pos++;
+        int hi = (unsigned char)this->pattern[this->pos++];
+        if (hi == '\\') {
+          byte_set hi_set = this->parse_escape();
+          hi = first_byte(hi_set);
+        }
+
+        if (hi < lo) {
+          throw std::runtime_error("Invalid class range");
+        }
+
+        for (int b = lo; b <= hi; b++) {
+          item.set(b);
+        }
+      }
+
+      set |= item;
+    }
+
+    if (!this->peek(']')) {
+      throw std::runtime_error("Expected ']'");
+    }
+    this->pos++;
+
+    if (negate) {
+      set.flip();
+    }
+
+    return set;
+  }
+};
+
+/*
+*****************************
+*           NFA             *
+*****************************
+*/
+struct nfa_state {
+  std::vector<std::pair<byte_set, int>> edges;
+  std::vector<int> eps;
+};
+
+struct nfa_fragment {
+  int start;
+  int end;
+};
+
+class NfaBuilder {
+
+public:
+  std::vector<nfa_state> states;
+
+  int new_state() {
+    this->states.emplace_back();
+    return (int)this->states.size() - 1;
+  }
+
+  struct nfa_fragment build(const regex_node *node) {
+    int start = this->new_state();
+    int end = start;
+
+    switch (node->type) {
+    case regex_node::SET:
+      end = this->new_state();
+      this->states[start].edges.push_back({node->set, end});
+      break;
+
+    case regex_node::CONCAT:
+      for (const auto &child : node->children) {
+        auto frag = this->build(child.get());
+        this->states[end].eps.push_back(frag.start);
+        end = frag.end;
+      }
+      break;
+
+    case regex_node::ALT:
+      end = this->new_state();
+      for (const auto &child : node->children) {
+        auto frag = this->build(child.get());
+        this->states[start].eps.push_back(frag.start);
+        this->states[frag.end].eps.push_back(end);
+      }
+      break;
+
+    case regex_node::REPEAT: {
+      const regex_node *child = node->children.front().get();
+
+      // mandatory copies
+      for (int i = 0; i < node->min; i++) {
+        auto frag = this->build(child);
+        this->states[end].eps.push_back(frag.start);
+        end = frag.end;
+      }
+
+      if (node->max == -1) {
+        // star
+        auto frag = this->build(child);
+        int loop_end = this->new_state();
+        this->states[end].eps.push_back(frag.start);
+        this->states[end].eps.push_back(loop_end);
+        this->states[frag.end].eps.push_back(frag.start);
+        this->states[frag.end].eps.push_back(loop_end);
+        end = loop_end;
+
+      } else {
+        // optional copies, each one can skip to the end
+        int opt_end = this->new_state();
+        for (int i = node->min; i < node->max; i++) {
+          auto frag = this->build(child);
+          this->states[end].eps.push_back(frag.start);
+          this->states[end].eps.push_back(opt_end);
+          end = frag.end;
+        }
+        this->states[end].eps.push_back(opt_end);
+        end = opt_end;
+      }
+      break;
+    }
+    }
+
+    return {start, end};
+  }
+
+  std::vector<int> closure(std::vector<int> set) {
+    std::vector<bool> seen(this->states.size(), false);
+    std::vector<int> stack = set;
+    set.clear();
+
+    while (!stack.empty()) {
+      int s = stack.back();
+      stack.pop_back();
+
+      if (seen[s]) {
+        continue;
+      }
+
+      seen[s] = true;
+      set.push_back(s);
+      stack.insert(stack.end(), this->states[s].eps.begin(),
+                   this->states[s].eps.end());
+    }
+
+    std::sort(set.begin(), set.end());
+    return set;
+  }
+};
+
+} // namespace
+
+/*
+*****************************
+*          COMPILE          *
+*****************************
+*/
+RegexIndex::RegexIndex(
+    const std::string &pattern,
+    std::shared_ptr<const std::vector<std::string>> token_pieces,
+    const std::vector<int32_t> &end_tokens)
+    : token_pieces(token_pieces), end_tokens(end_tokens) {
+
+  std::sort(this->end_tokens.begin(), this->end_tokens.end());
+  this->end_tokens.erase(
+      std::unique(this->end_tokens.begin(), this->end_tokens.end()),
+      this->end_tokens.end());
+
+  try {
+    this->compile(pattern);
+  } catch (const std::exception &e) {
+    this->error = e.what();
+    this->transitions.clear();
+    this->accepting.clear();
+  }
+
+  this->token_tables.resize(this->transitions.size());
+}
+
+void RegexIndex::compile(const std::string &pattern) {
+
+  auto root = RegexParser(pattern).parse();
+
+  NfaBuilder nfa;
+  auto frag = nfa.build(root.get());
+
+  // subset construction
+  std::map<std::vector<int>, int> dfa_ids;
+  std::vector<std::vector<int>> dfa_sets = {nfa.closure({frag.start})};
+  dfa_ids[dfa_sets.front()] = 0;
+
+  for (size_t d = 0; d < dfa_sets.size(); d++) {
+    std::array<int, 256> row;
+    row.fill(-1);
+
+    for (int b = 0; b < 256; b++) {
+      std::vector<int> next;
+
+      for (int s : dfa_sets[d]) {
+        for (const auto &edge : nfa.states[s].edges) {
+          if (edge.first.test(b)) {
+            next.push_back(edge.second);
+          }
+        }
+      }
+
+      if (next.empty()) {
+        continue;
+      }
+
+      next = nfa.closure(next);
+      auto it = dfa_ids.find(next);
+
+      if (it == dfa_ids.end()) {
+        if ((int)dfa_sets.size() >= MAX_DFA_STATES) {
+          throw std::runtime_error("Regex is too complex");
+        }
+
+        it = dfa_ids.emplace(next, (int)dfa_sets.size()).first;
+        dfa_sets.push_back(next);
+      }
+
+      row[b] = it->second;
+    }
+
+    this->transitions.push_back(row);
+    this->accepting.push_back(std::binary_search(
+        dfa_sets[d].begin(), dfa_sets[d].end(), frag.end));
+  }
+}
+
+/*
+*****************************
+*       TOKEN TABLES        *
+*****************************
+*/
+bool RegexIndex::is_accepting(int state) {
+  return state >= 0 && state < (int)this->accepting.size() &&
+         this->accepting[state];
+}
+
+bool RegexIndex::is_end_token(int32_t token) {
+  return std::binary_search(this->end_tokens.begin(), this->end_tokens.end(),
+                            token);
+}
+
+const std::vector<int32_t> &RegexIndex::get_allowed_tokens(int state) {
+  this->build_token_table(state);
+  return this->token_tables[state].tokens;
+}
+
+const std::vector<int32_t> &RegexIndex::get_token_mask(int state) {
+  this->build_token_table(state);
+  return this->token_tables[state].mask;
+}
+
+int RegexIndex::get_next_state(int state, int32_t token) {
+
+  // the text ends here, whether it matches is checked before sampling
+  if (this->is_end_token(token)) {
+    return state;
+  }
+
+  this->build_token_table(state);
+
+  const auto &table = this->token_tables[state];
+  auto it = std::lower_bound(table.tokens.begin(), table.tokens.end(), token);
+
+  if (it == table.tokens.end() || *it != token) {
+    return -1;
+  }
+
+  return table.next_states[it - table.tokens.begin()];
+}
+
+void RegexIndex::build_token_table(int state) {
+
+  if (state < 0 || state >= (int)this->token_tables.size()) {
+    throw std::out_of_range("Invalid regex state " + std::to_string(state));
+  }
+
+  auto &table = this->token_tables[state];
+
+  if (table.built) {
+    return;
+  }
+
+  // walk every token piece through the DFA once per state
+  for (size_t t = 0; t < this->token_pieces->size(); t++) {
+    const std::string &piece = (*this->token_pieces)[t];
+
+    if (piece.empty()) {
+      continue;
+    }
+
+    int s = state;
+    for (char c : piece) {
+      s = this->transitions[s][(unsigned char)c];
+      if (s == -1) {
+        break;
+      }
+    }
+
+    if (s != -1) {
+      table.tokens.push_back((int32_t)t);
+      table.next_states.push_back(s);
+    }
+  }
+
+  // end tokens finish the text only when it matches, or when nothing else can
+  if (this->accepting[state] || table.tokens.empty()) {
+    std::set_union(table.tokens.begin(), table.tokens.end(),
+                   this->end_tokens.begin(), this->end_tokens.end(),
+                   std::back_inserter(table.mask));
+  } else {
+    table.mask = table.tokens;
+  }
+
+  table.built = true;
+}
@@ -0,0 +1,133 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#include "llama_utils/token_ring.hpp"
+
+using namespace llama_utils;
+
+TokenRingWriter::TokenRingWriter(const std::string &name, uint32_t capacity,
+                                 mode_t mode)
+    : name(name), capacity(capacity), header(nullptr), slots(nullptr) {
+
+  // the header takes the first slot
+  this->size = sizeof(struct token_ring_slot) * (capacity + 1);
+
+  // an existing object may belong to a running node or another user
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, mode);
+  if (fd < 0) {
+    fprintf(stderr, "[ERROR] Failed to create shared memory %s: %s\n",
+            name.c_str(), strerror(errno));
+    return;
+  }
+
+  if (ftruncate(fd, this->size) != 0) {
+    fprintf(stderr, "[ERROR] Failed to size shared memory %s\n", name.c_str());
+    close(fd);
+    shm_unlink(name.c_str());
+    return;
+  }
+
+  void *data =
+      mmap(nullptr, this->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (data == MAP_FAILED) {
+    shm_unlink(name.c_str());
+    return;
+  }
+
+  // the object is zero filled, slots are empty
+  this->slots = (struct token_ring_slot *)data + 1;
+  this->header = new (data) token_ring_header;
+  this->header->capacity = capacity;
+  this->header->slot_size = sizeof(struct token_ring_slot);
+  this->header->version = TOKEN_RING_VERSION;
+  this->header->write_seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  this->header->magic = TOKEN_RING_MAGIC;
+}
+
+TokenRingWriter::~TokenRingWriter() {
+  if (this->header != nullptr) {
+    munmap(this->header, this->size);
+    shm_unlink(this->name.c_str());
+  }
+}
+
+void TokenRingWriter::write(const uint8_t *goal_id, int32_t token,
+                            const std::string &text) {
+
+  std::lock_guard<std::mutex> lk(this->mutex);
+
+  // long pieces continue in the next slots
+  size_t offset = 0;
+  uint32_t flags = 0;
+  do {
+    size_t n = std::min(text.size() - offset, TOKEN_RING_TEXT_SIZE);
+    this->write_slot(goal_id, token, flags, text.data() + offset, n);
+    flags = TOKEN_RING_CONTINUATION;
+    offset += n;
+  } while (offset < text.size());
+}
+
+void TokenRingWriter::end(const uint8_t *goal_id, const std::string &reason) {
+  std::lock_guard<std::mutex> lk(this->mutex);
+  this->write_slot(goal_id, -1, TOKEN_RING_END, reason.data(),
+                   std::min(reason.size(), TOKEN_RING_TEXT_SIZE));
+}
+
+void TokenRingWriter::join(const uint8_t *goal_id, const uint8_t *leader_id) {
+  std::lock_guard<std::mutex> lk(this->mutex);
+  this->write_slot(goal_id, -1, TOKEN_RING_JOIN, (const char *)leader_id,
+                   sizeof(token_ring_slot::goal_id));
+}
+
+void TokenRingWriter::write_slot(const uint8_t *goal_id, int32_t token,
+                                 uint32_t flags, const char *text,
+                                 size_t text_len) {
+
+  if (this->header == nullptr) {
+    return;
+  }
+
+  uint64_t seq = this->header->write_seq.load(std::memory_order_relaxed);
+  auto &slot = this->slots[seq % this->capacity];
+
+  slot.seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  std::memcpy(slot.goal_id, goal_id, sizeof(slot.goal_id));
+  slot.token = token;
+  slot.flags = flags;
+  slot.text_len = text_len;
+  std::memcpy(slot.text, text, text_len);
+
+  slot.seq.store(seq + 1, std::memory_order_release);
+  this->header->write_seq.store(seq + 1, std::memory_order_release);
+}
@@ -0,0 +1,101 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <algorithm>
+
+#include "llama_utils/token_trie.hpp"
+
+using namespace llama_utils;
+
+TokenTrie::TokenTrie() { this->clear(); }
+
+void TokenTrie::clear() {
+  this->nodes.assign(1, trie_node());
+  this->active.clear();
+  this->n_sequences = 0;
+}
+
+void TokenTrie::add(const std::vector<int32_t> &tokens) {
+
+  if (tokens.empty()) {
+    return;
+  }
+
+  int node = 0;
+
+  for (int32_t token : tokens) {
+    auto &children = this->nodes[node].children;
+    auto it = std::lower_bound(children.begin(), children.end(),
+                               std::make_pair(token, -1));
+
+    if (it != children.end() && it->first == token) {
+      node = it->second;
+    } else {
+      int child = this->nodes.size();
+      children.insert(it, {token, child});
+      this->nodes.emplace_back();
+      node = child;
+    }
+  }
+
+  if (!this->nodes[node].terminal) {
+    this->nodes[node].terminal = true;
+    this->n_sequences++;
+  }
+}
+
+int TokenTrie::get_child(int node, int32_t token) {
+
+  const auto &children = this->nodes[node].children;
+  auto it = std::lower_bound(children.begin(), children.end(),
+                             std::make_pair(token, -1));
+
+  if (it != children.end() && it->first == token) {
+    return it->second;
+  }
+  return -1;
+}
+
+token_trie_match TokenTrie::push(int32_t token) {
+
+  std::vector<int> next;
+  this->active.push_back(0);
+
+  for (int node : this->active) {
+    int child = this->get_child(node, token);
+
+    if (child < 0) {
+      continue;
+    }
+
+    if (this->nodes[child].terminal) {
+      this->active.clear();
+      return TRIE_FULL_MATCH;
+    }
+
+    next.push_back(child);
+  }
+
+  this->active = std::move(next);
+  return this->active.empty() ? TRIE_NO_MATCH : TRIE_PARTIAL_MATCH;
+}
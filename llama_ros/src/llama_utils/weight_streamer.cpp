@@ -0,0 +1,252 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "ggml-backend.h"
+#include "llama_utils/weight_streamer.hpp"
+
+using namespace llama_utils;
+
+static int64_t get_time_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+WeightStreamer::WeightStreamer(int n_prefetch_layers)
+    : n_prefetch_layers(n_prefetch_layers), stats({0, 0.0f, 0, 0, 0}),
+      streaming(true), running(true) {
+  this->page_size = sysconf(_SC_PAGESIZE);
+  this->worker = std::thread(&WeightStreamer::run_prefetch, this);
+}
+
+WeightStreamer::~WeightStreamer() {
+  {
+    std::lock_guard<std::mutex> lk(this->mutex);
+    this->running = false;
+  }
+  this->cv.notify_all();
+  this->worker.join();
+}
+
+bool WeightStreamer::eval_callback(struct ggml_tensor *t, bool ask,
+                                   void *user_data) {
+  return static_cast<WeightStreamer *>(user_data)->on_eval(t, ask);
+}
+
+bool WeightStreamer::on_eval(struct ggml_tensor *t, bool ask) {
+
+  // warm weights are evaluated without splitting the graph
+  if (!this->streaming) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lk(this->mutex);
+  auto &state = this->states[std::this_thread::get_id()];
+
+  // the chunk of the graph holding one layer is done
+  if (!ask) {
+    if (!state.chunk_resident) {
+      this->stats.n_stalls++;
+      this->stats.stall_us += get_time_us() - state.chunk_start_us;
+    }
+    return true;
+  }
+
+  // every node is asked before its chunk is computed, so the weights of a
+  // layer are known when its output node is reached
+  this->get_layer(t);
+
+  int layer;
+  if (std::sscanf(t->name, "l_out-%d", &layer) != 1) {
+    return false;
+  }
+
+  // a new graph, the previous one may have run with every layer in memory
+  if (layer <= state.chunk_layer) {
+    if (state.pass_resident) {
+      this->streaming = false;
+    }
+    state.pass_resident = true;
+  }
+
+  state.chunk_layer = layer;
+  state.chunk_resident = layer >= (int)this->layers.size() ||
+                         this->is_resident(layer);
+  state.pass_resident = state.pass_resident && state.chunk_resident;
+  state.chunk_start_us = get_time_us();
+
+  for (int i = layer + 1;
+       i <= layer + this->n_prefetch_layers && i < (int)this->layers.size();
+       i++) {
+    if (std::find(this->prefetch_queue.begin(), this->prefetch_queue.end(),
+                  i) == this->prefetch_queue.end()) {
+      this->prefetch_queue.push_back(i);
+    }
+  }
+  this->cv.notify_one();
+
+  return true;
+}
+
+int WeightStreamer::get_layer(struct ggml_tensor *t) {
+
+  int layer = -1;
+
+  for (int i = 0; i < GGML_MAX_SRC; i++) {
+    const struct ggml_tensor *src = t->src[i];
+    int src_layer;
+
+    // only weights in host memory, offloaded layers are not streamed
+    if (src == nullptr || src->op != GGML_OP_NONE || src->data == nullptr ||
+        src->buffer == nullptr || !ggml_backend_buffer_is_host(src->buffer) ||
+        std::sscanf(src->name, "blk.%d.", &src_layer) != 1) {
+      continue;
+    }
+
+    layer = src_layer;
+
+    // weights are found while the first graphs are evaluated
+    if (!this->known_weights.insert(src->data).second) {
+      continue;
+    }
+
+    if ((int)this->layers.size() <= layer) {
+      this->layers.resize(layer + 1);
+    }
+
+    uintptr_t start = (uintptr_t)src->data & ~(this->page_size - 1);
+    uintptr_t end = (uintptr_t)src->data + ggml_nbytes(src);
+    this->layers[layer].push_back({start, end - start});
+  }
+
+  return layer;
+}
+
+bool WeightStreamer::is_resident(int layer) {
+
+  std::vector<unsigned char> pages;
+
+  for (auto &range : this->layers[layer]) {
+    pages.resize((range.size + this->page_size - 1) / this->page_size);
+
+    if (mincore((void *)range.start, range.size, pages.data()) != 0) {
+      continue;
+    }
+
+    for (auto page : pages) {
+      if (!(page & 1)) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+bool WeightStreamer::is_all_resident() {
+
+  for (int layer = 0; layer < (int)this->layers.size(); layer++) {
+    if (!this->is_resident(layer)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void WeightStreamer::run_prefetch() {
+
+  while (true) {
+
+    std::vector<struct page_range> ranges;
+
+    {
+      std::unique_lock<std::mutex> lk(this->mutex);
+      this->cv.wait_for(lk, std::chrono::seconds(1), [this] {
+        return !this->running || !this->prefetch_queue.empty();
+      });
+
+      if (!this->running) {
+        return;
+      }
+
+      // weights evicted after the warm-up bring the streaming back
+      if (this->prefetch_queue.empty()) {
+        if (!this->streaming && !this->is_all_resident()) {
+          this->streaming = true;
+        }
+        continue;
+      }
+
+      ranges = this->layers[this->prefetch_queue.front()];
+      this->prefetch_queue.pop_front();
+      this->stats.n_prefetches++;
+    }
+
+    // WILLNEED starts the readahead and touching the pages waits for it,
+    // so the layer is in memory before the context reaches it
+    for (auto &range : ranges) {
+      madvise((void *)range.start, range.size, MADV_WILLNEED);
+
+      for (size_t offset = 0; offset < range.size; offset += this->page_size) {
+        (void)*(volatile const char *)(range.start + offset);
+      }
+    }
+  }
+}
+
+struct weight_streamer_stats WeightStreamer::get_stats() {
+
+  std::lock_guard<std::mutex> lk(this->mutex);
+  struct weight_streamer_stats stats = this->stats;
+
+  std::vector<unsigned char> pages;
+  size_t n_pages = 0;
+  size_t n_resident = 0;
+
+  for (auto &layer : this->layers) {
+    for (auto &range : layer) {
+      pages.resize((range.size + this->page_size - 1) / this->page_size);
+
+      if (mincore((void *)range.start, range.size, pages.data()) != 0) {
+        continue;
+      }
+
+      for (auto page : pages) {
+        n_resident += page & 1;
+      }
+      n_pages += pages.size();
+    }
+  }
+
+  stats.n_layers = this->layers.size();
+  stats.residency = n_pages > 0 ? (float)n_resident / n_pages : 0.0f;
+
+  return stats;
+}
@@ -45,7 +45,11 @@ int main(int argc, char *argv[]) {
   sigaction(SIGINT, &sigint_action, NULL);
 
   rclcpp::init(argc, argv);
-  rclcpp::spin(std::make_shared<LlavaNode>());
+  // the client liveness callbacks run beside the blocking service callbacks
+  auto node = std::make_shared<LlavaNode>();
+  rclcpp::executors::MultiThreadedExecutor executor;
+  executor.add_node(node);
+  executor.spin();
   rclcpp::shutdown();
   return 0;
 }
@@ -0,0 +1,67 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <cstdlib>
+#include <vector>
+
+#include "llava_ros/image_cache.hpp"
+
+using namespace llava_ros;
+
+ImageCache::ImageCache() : n_tiles(0) {}
+
+float ImageCache::get_difference(const std::vector<uint8_t> &thumbnail) {
+
+  if (this->thumbnail.empty() ||
+      this->thumbnail.size() != thumbnail.size()) {
+    return 1.0f;
+  }
+
+  // mean absolute difference in [0, 1]
+  uint64_t sum = 0;
+  for (size_t i = 0; i < thumbnail.size(); i++) {
+    sum += std::abs((int)thumbnail[i] - (int)this->thumbnail[i]);
+  }
+
+  return sum / (thumbnail.size() * 255.0f);
+}
+
+bool ImageCache::can_reuse(const std::vector<uint8_t> &thumbnail, int n_tiles,
+                           float threshold, float &difference) {
+
+  difference = this->get_difference(thumbnail);
+
+  // an embedding encoded with another tiling is not the one asked for
+  return threshold > 0.0f && n_tiles == this->n_tiles &&
+         difference <= threshold;
+}
+
+void ImageCache::set_encoded(const std::vector<uint8_t> &thumbnail,
+                             int n_tiles) {
+  this->thumbnail = thumbnail;
+  this->n_tiles = n_tiles;
+}
+
+void ImageCache::clear() {
+  this->thumbnail.clear();
+  this->n_tiles = 0;
+}
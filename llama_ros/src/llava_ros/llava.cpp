@@ -20,43 +20,88 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cmath>
 #include <thread>
 
 #include "base64.hpp"
 #include "common.h"
+#include "llama_utils/compute_pool.hpp"
 #include "llava_ros/llava.hpp"
 
 using namespace llava_ros;
 
-Llava::Llava(std::shared_ptr<struct gpt_params> params, bool debug)
-    : llama_ros::Llama(params, debug) {
+Llava::Llava(std::shared_ptr<struct gpt_params> params, bool debug,
+             int n_vision_workers, bool lazy_vision)
+    : llama_ros::Llama(params, debug), n_vision_workers(n_vision_workers) {
 
-  // load clip model
-  const char *clip_path = this->params->mmproj.c_str();
-  auto ctx_clip = clip_model_load(clip_path, 1);
   this->image_embed = nullptr;
+  this->last_image_embed = nullptr;
 
   // create llava ctx
   this->ctx_llava = (struct llava_context *)malloc(sizeof(llava_context));
 
   this->ctx_llava->ctx_llama = this->ctx;
-  this->ctx_llava->ctx_clip = ctx_clip;
+  this->ctx_llava->ctx_clip = NULL;
   this->ctx_llava->model = this->model;
+
+  // load clip model, it may be deferred until the first image arrives
+  if (!lazy_vision) {
+    this->load_clip();
+  }
 }
 
 Llava::~Llava() {
+  for (size_t i = 1; i < this->clip_workers.size(); i++) {
+    clip_free(this->clip_workers[i]);
+  }
+
   if (this->ctx_llava->ctx_clip) {
     clip_free(this->ctx_llava->ctx_clip);
     this->ctx_llava->ctx_clip = NULL;
   }
 
   this->free_image();
+  free(this->ctx_llava);
+}
+
+/*
+*****************************
+*        LOAD CLIP          *
+*****************************
+*/
+bool Llava::load_clip() {
 
-  this->llama_ros::Llama::~Llama();
+  std::lock_guard<std::recursive_mutex> lk(this->mutex);
 
-  free(this->ctx_llava);
+  if (this->ctx_llava->ctx_clip != NULL) {
+    return true;
+  }
+
+  const char *clip_path = this->params->mmproj.c_str();
+  auto ctx_clip = clip_model_load(clip_path, 1);
+
+  if (ctx_clip == NULL) {
+    LLAMA_LOG_ERROR("Failed to load clip model %s", clip_path);
+    return false;
+  }
+
+  this->ctx_llava->ctx_clip = ctx_clip;
+
+  // clip workers, the first one is the main clip ctx
+  this->clip_workers.push_back(ctx_clip);
+  for (int i = 1; i < this->n_vision_workers; i++) {
+    auto worker = clip_model_load(clip_path, 0);
+    if (worker == nullptr) {
+      LLAMA_LOG_ERROR("Failed to load clip worker %d", i);
+      break;
+    }
+    this->clip_workers.push_back(worker);
+  }
+
+  return true;
 }
 
 /*
@@ -111,34 +156,235 @@ void Llava::load_prompt(const std::string &input_prompt, bool add_pfx,
 
 bool Llava::load_image(std::string base64_str) {
 
+  std::lock_guard<std::recursive_mutex> lk(this->mutex);
+
   this->free_image();
 
-  this->image_embed = this->base64_image_to_embed(base64_str);
+  this->last_image_embed = this->base64_image_to_embed(base64_str);
 
-  if (this->image_embed == nullptr) {
+  if (this->last_image_embed == nullptr) {
     LLAMA_LOG_ERROR("Can't load base64 image");
     return false;
   }
 
+  this->image_embed = this->last_image_embed;
+  return true;
+}
+
+bool Llava::load_image_tiles(const std::vector<struct rgb_image> &tiles) {
+
+  std::lock_guard<std::recursive_mutex> lk(this->mutex);
+
+  this->free_image();
+
+  if (tiles.empty()) {
+    return false;
+  }
+
+  std::vector<float *> tile_embeds;
+  std::vector<int> tile_n_pos;
+  bool encoded = this->encode_images(tiles, tile_embeds, tile_n_pos);
+
+  // assemble the tile embeddings in order
+  if (encoded) {
+    const int n_embd = clip_n_mmproj_embd(this->ctx_llava->ctx_clip);
+    int n_image_pos = 0;
+
+    for (int n_pos : tile_n_pos) {
+      n_image_pos += n_pos;
+    }
+
+    auto embed =
+        (struct llava_image_embed *)malloc(sizeof(struct llava_image_embed));
+    embed->embed = (float *)malloc(sizeof(float) * n_embd * n_image_pos);
+    embed->n_image_pos = n_image_pos;
+
+    float *dst = embed->embed;
+    for (size_t i = 0; i < tiles.size(); i++) {
+      std::copy(tile_embeds[i], tile_embeds[i] + n_embd * tile_n_pos[i], dst);
+      dst += n_embd * tile_n_pos[i];
+    }
+
+    this->last_image_embed = embed;
+    this->image_embed = embed;
+  }
+
+  for (auto tile_embed : tile_embeds) {
+    free(tile_embed);
+  }
+
+  if (!encoded) {
+    LLAMA_LOG_ERROR("Failed to encode image tiles");
+    return false;
+  }
+
+  return true;
+}
+
+bool Llava::encode_images(const std::vector<struct rgb_image> &images,
+                          std::vector<float *> &embeds,
+                          std::vector<int> &n_pos) {
+
+  std::lock_guard<std::recursive_mutex> lk(this->mutex);
+
+  embeds.assign(images.size(), nullptr);
+  n_pos.assign(images.size(), 0);
+
+  if (images.empty()) {
+    return true;
+  }
+
+  if (!this->load_clip()) {
+    return false;
+  }
+
+  std::atomic<size_t> next_image(0);
+  std::atomic<bool> failed(false);
+
+  const int n_workers =
+      (int)std::min(this->clip_workers.size(), images.size());
+  const int n_threads = std::max(1, this->params->n_threads / n_workers);
+
+  // each worker encodes the next pending image with its own clip ctx
+  auto encode = [&](struct clip_ctx *ctx_clip) {
+    struct clip_image_u8 *img = clip_image_u8_init();
+
+    for (size_t i = next_image++; i < images.size() && !failed;
+         i = next_image++) {
+
+      clip_build_img_from_pixels(images[i].data.data(), images[i].width,
+                                 images[i].height, img);
+
+      llama_utils::ComputeLease lease(n_threads, llama_utils::VISION);
+      if (!llava_image_embed_make_with_clip_img(ctx_clip,
+                                                lease.get_n_threads(), img,
+                                                &embeds[i], &n_pos[i])) {
+        failed = true;
+      }
+    }
+
+    clip_image_u8_free(img);
+  };
+
+  std::vector<std::thread> workers;
+  for (int i = 1; i < n_workers; i++) {
+    workers.emplace_back(encode, this->clip_workers[i]);
+  }
+  encode(this->clip_workers[0]);
+
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  return !failed;
+}
+
+/*
+*****************************
+*     IMAGE EMBEDDINGS      *
+*****************************
+*/
+std::vector<std::vector<float>>
+Llava::generate_image_embeddings(const std::vector<struct rgb_image> &images,
+                                 bool normalize) {
+
+  std::lock_guard<std::recursive_mutex> lk(this->mutex);
+
+  std::vector<std::vector<float>> output;
+  std::vector<float *> embeds;
+  std::vector<int> n_pos;
+
+  if (images.empty()) {
+    return output;
+  }
+
+  if (!this->encode_images(images, embeds, n_pos)) {
+    LLAMA_LOG_ERROR("Failed to encode images");
+
+  } else {
+    const int n_embd = clip_n_mmproj_embd(this->ctx_llava->ctx_clip);
+
+    // mean pooling over the projected patches of each image
+    for (size_t i = 0; i < images.size(); i++) {
+      std::vector<float> pooled(n_embd, 0.0f);
+
+      for (int p = 0; p < n_pos[i]; p++) {
+        const float *patch = embeds[i] + p * n_embd;
+        for (int j = 0; j < n_embd; j++) {
+          pooled[j] += patch[j];
+        }
+      }
+
+      for (int j = 0; j < n_embd; j++) {
+        pooled[j] /= std::max(1, n_pos[i]);
+      }
+
+      if (normalize) {
+        llama_embd_normalize(pooled.data(), pooled.data(), n_embd);
+      }
+
+      output.push_back(pooled);
+    }
+  }
+
+  for (auto embed : embeds) {
+    free(embed);
+  }
+
+  return output;
+}
+
+int Llava::get_clip_image_size() {
+
+  std::lock_guard<std::recursive_mutex> lk(this->mutex);
+
+  if (!this->load_clip()) {
+    return 0;
+  }
+
+  return clip_image_size(this->ctx_llava->ctx_clip);
+}
+
+bool Llava::reuse_image() {
+
+  std::lock_guard<std::recursive_mutex> lk(this->mutex);
+
+  // the embedding of the last loaded image is kept after its eval
+  if (this->last_image_embed == nullptr) {
+    return false;
+  }
+
+  this->image_embed = this->last_image_embed;
   return true;
 }
 
 void Llava::free_image() {
-  if (this->image_embed != nullptr) {
-    llava_image_embed_free(this->image_embed);
-    this->image_embed = nullptr;
+  std::lock_guard<std::recursive_mutex> lk(this->mutex);
+
+  if (this->last_image_embed != nullptr) {
+    llava_image_embed_free(this->last_image_embed);
+    this->last_image_embed = nullptr;
   }
+  this->image_embed = nullptr;
 }
 
 struct llava_image_embed *
 Llava::base64_image_to_embed(const std::string &base64_str) {
 
+  std::lock_guard<std::recursive_mutex> lk(this->mutex);
+
+  if (!this->load_clip()) {
+    return nullptr;
+  }
+
   auto required_bytes = base64::required_encode_size(base64_str.size());
   auto img_bytes = std::vector<unsigned char>(required_bytes);
   base64::decode(base64_str.begin(), base64_str.end(), img_bytes.begin());
 
+  llama_utils::ComputeLease lease(this->params->n_threads,
+                                  llama_utils::VISION);
   auto embed = llava_image_embed_make_with_bytes(
-      this->ctx_llava->ctx_clip, this->params->n_threads, img_bytes.data(),
+      this->ctx_llava->ctx_clip, lease.get_n_threads(), img_bytes.data(),
       img_bytes.size());
 
   if (!embed) {
@@ -187,7 +433,7 @@ bool Llava::eval_image(struct llava_image_embed *image_embed) {
     }
   }
 
-  this->free_image();
+  this->image_embed = nullptr;
   return succ;
 }
 
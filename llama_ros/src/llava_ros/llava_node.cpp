@@ -21,6 +21,8 @@
 // SOFTWARE.
 
 #include <cv_bridge/cv_bridge.h>
+#include <algorithm>
+#include <cmath>
 #include <memory>
 #include <opencv2/opencv.hpp>
 #include <string>
@@ -33,13 +35,51 @@ using namespace llava_ros;
 using std::placeholders::_1;
 using std::placeholders::_2;
 
-LlavaNode::LlavaNode() : llama_ros::LlamaNode(false) {
+LlavaNode::LlavaNode()
+    : llama_ros::LlamaNode(false), stop_image_embeddings(false) {
   this->llava = std::make_shared<Llava>(this->gpt_params.load_params(this),
-                                        this->gpt_params.debug);
+                                        this->gpt_params.debug,
+                                        this->gpt_params.vision_workers,
+                                        this->gpt_params.lazy_vision);
   this->llama = std::dynamic_pointer_cast<llama_ros::Llama>(this->llava);
+  this->load_prompt_compressor();
+  this->load_logits_processors();
+  this->load_token_ring();
+  this->start_client_liveness();
+
+  if (!this->gpt_params.cascade_model.empty()) {
+    RCLCPP_WARN(this->get_logger(),
+                "Model cascade is not available with vision models, "
+                "cascade_model is ignored");
+  }
+
+  if (this->gpt_params.numa_replicas) {
+    RCLCPP_WARN(this->get_logger(),
+                "NUMA replicas are not available with vision models, "
+                "numa_replicas is ignored");
+  }
+
+  if (!this->gpt_params.kv_tier_type.empty()) {
+    this->llava->enable_kv_tiering(this->gpt_params.kv_tier_type,
+                                   this->gpt_params.kv_tier_threshold,
+                                   this->gpt_params.kv_tier_n_ctx);
+  }
+
+  this->generate_image_embeddings_service_ =
+      this->create_service<llama_msgs::srv::GenerateImageEmbeddings>(
+          "generate_image_embeddings",
+          std::bind(&LlavaNode::generate_image_embeddings_service_callback,
+                    this, _1, _2));
+
+  // image embeddings requests are answered from their own worker
+  this->image_embeddings_worker =
+      std::thread(&LlavaNode::run_image_embeddings_worker, this);
+
   RCLCPP_INFO(this->get_logger(), "%s started", this->get_name());
 }
 
+LlavaNode::~LlavaNode() { this->stop_image_embeddings_worker(); }
+
 bool LlavaNode::goal_empty(std::shared_ptr<const GenerateResponse::Goal> goal) {
   return goal->prompt.size() == 0 && goal->image.data.size() == 0;
 }
@@ -49,6 +89,9 @@ void LlavaNode::execute(
 
   auto result = std::make_shared<GenerateResponse::Result>();
   auto image_msg = goal_handle->get_goal()->image;
+  int max_tiles = goal_handle->get_goal()->max_image_tiles > 0
+                      ? goal_handle->get_goal()->max_image_tiles
+                      : this->gpt_params.max_image_tiles;
 
   // load image
   if (image_msg.data.size() > 0) {
@@ -60,20 +103,145 @@ void LlavaNode::execute(
     cv_bridge::CvImagePtr cv_ptr =
         cv_bridge::toCvCopy(image_msg, image_msg.encoding);
 
-    std::vector<uchar> buf;
-    cv::imencode(".jpg", cv_ptr->image, buf);
-    auto *enc_msg = reinterpret_cast<unsigned char *>(buf.data());
-    std::string encoded_image = this->base64_encode(enc_msg, buf.size());
+    // skip the encoding of frames that barely changed since the last encode
+    std::vector<uint8_t> thumbnail = this->get_thumbnail(cv_ptr->image);
+    int n_tiles = std::max(1, max_tiles);
+
+    // tiling needs the global view and at least two tiles
+    if (n_tiles == 2) {
+      RCLCPP_WARN(this->get_logger(),
+                  "2 image tiles leave no room for tiles, using 3");
+      n_tiles = 3;
+    }
+
+    if (this->image_cache.can_reuse(thumbnail, n_tiles,
+                                    this->gpt_params.image_change_threshold,
+                                    result->image_difference) &&
+        this->llava->reuse_image()) {
+      result->image_reused = true;
+
+      if (this->gpt_params.debug) {
+        RCLCPP_INFO(this->get_logger(),
+                    "Reusing previous image embedding (difference %f)",
+                    result->image_difference);
+      }
+
+    } else {
+      bool loaded;
+
+      if (n_tiles > 1) {
+        loaded = this->llava->load_image_tiles(
+            this->get_image_tiles(cv_ptr->image, n_tiles));
 
-    if (!this->llava->load_image(encoded_image)) {
-      this->goal_handle_->abort(result);
-      RCLCPP_INFO(this->get_logger(), "Failed to load image");
-      return;
+      } else {
+        std::vector<uchar> buf;
+        cv::imencode(".jpg", cv_ptr->image, buf);
+        auto *enc_msg = reinterpret_cast<unsigned char *>(buf.data());
+        std::string encoded_image = this->base64_encode(enc_msg, buf.size());
+        loaded = this->llava->load_image(encoded_image);
+      }
+
+      if (!loaded) {
+        this->image_cache.clear();
+        this->finish_goal(goal_handle, result, stop_type::ABORT);
+        RCLCPP_INFO(this->get_logger(), "Failed to load image");
+        return;
+      }
+
+      this->image_cache.set_encoded(thumbnail, n_tiles);
     }
   }
 
   // llama_node execute
-  llama_ros::LlamaNode::execute(goal_handle);
+  this->goal_handle_ = goal_handle;
+  this->generate(goal_handle, this->llama, this->gpt_params, result);
+}
+
+static struct rgb_image to_rgb_image(const cv::Mat &mat) {
+  cv::Mat continuous = mat.clone();
+  struct rgb_image img;
+  img.width = continuous.cols;
+  img.height = continuous.rows;
+  img.data.assign(continuous.data, continuous.data + continuous.total() * 3);
+  return img;
+}
+
+std::vector<struct rgb_image>
+LlavaNode::get_image_tiles(const cv::Mat &image, int max_tiles) {
+
+  cv::Mat rgb;
+  if (image.channels() == 4) {
+    cv::cvtColor(image, rgb, cv::COLOR_BGRA2RGB);
+  } else if (image.channels() == 3) {
+    cv::cvtColor(image, rgb, cv::COLOR_BGR2RGB);
+  } else {
+    cv::cvtColor(image, rgb, cv::COLOR_GRAY2RGB);
+  }
+
+  // grid of clip-sized tiles, shrunk until it fits with the global view
+  const int tile_size = std::max(1, this->llava->get_clip_image_size());
+  int cols = std::max(1, (rgb.cols + tile_size - 1) / tile_size);
+  int rows = std::max(1, (rgb.rows + tile_size - 1) / tile_size);
+
+  while (cols * rows > max_tiles - 1 && cols * rows > 1) {
+    if (cols >= rows) {
+      cols--;
+    } else {
+      rows--;
+    }
+  }
+
+  // global thumbnail first, downscaled to the clip size since clip would
+  // resize it anyway, then the tiles in row-major order
+  cv::Mat global = rgb;
+  float scale = (float)tile_size / std::max(rgb.cols, rgb.rows);
+
+  if (scale < 1.0f) {
+    cv::resize(rgb, global,
+               cv::Size(std::max(1, (int)std::round(rgb.cols * scale)),
+                        std::max(1, (int)std::round(rgb.rows * scale))),
+               0, 0, cv::INTER_AREA);
+  }
+
+  std::vector<struct rgb_image> tiles = {to_rgb_image(global)};
+
+  if (cols * rows > 1) {
+    for (int r = 0; r < rows; r++) {
+      for (int c = 0; c < cols; c++) {
+        int x0 = c * rgb.cols / cols;
+        int y0 = r * rgb.rows / rows;
+        int x1 = (c + 1) * rgb.cols / cols;
+        int y1 = (r + 1) * rgb.rows / rows;
+        tiles.push_back(to_rgb_image(rgb(cv::Rect(x0, y0, x1 - x0, y1 - y0))));
+      }
+    }
+  }
+
+  if (this->gpt_params.debug) {
+    RCLCPP_INFO(this->get_logger(), "Encoding image as %dx%d tiles + global",
+                cols, rows);
+  }
+
+  return tiles;
+}
+
+std::vector<uint8_t> LlavaNode::get_thumbnail(const cv::Mat &image) {
+
+  cv::Mat gray;
+  if (image.channels() == 4) {
+    cv::cvtColor(image, gray, cv::COLOR_BGRA2GRAY);
+  } else if (image.channels() == 3) {
+    cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+  } else {
+    gray = image;
+  }
+
+  // area downsampling averages out most of the sensor noise
+  cv::Mat thumbnail;
+  cv::resize(gray, thumbnail, cv::Size(32, 32), 0, 0, cv::INTER_AREA);
+  thumbnail.convertTo(thumbnail, CV_8U);
+  return std::vector<uint8_t>(thumbnail.data,
+                              thumbnail.data + thumbnail.total());
 }
 
 // https://renenyffenegger.ch/notes/development/Base64/Encoding-and-decoding-base-64-with-cpp/
@@ -137,3 +305,125 @@ std::string LlavaNode::base64_encode(unsigned char const *bytes_to_encode,
 
   return ret;
 }
+
+/*
+*****************************
+*  IMAGE EMBEEDINGS SERVICE *
+*****************************
+*/
+void LlavaNode::generate_image_embeddings_service_callback(
+    const std::shared_ptr<rmw_request_id_t> request_header,
+    const std::shared_ptr<llama_msgs::srv::GenerateImageEmbeddings::Request>
+        request) {
+
+  std::lock_guard<std::mutex> lk(this->image_embeddings_mutex);
+  this->image_embeddings_queue.push_back({request_header, request});
+  this->image_embeddings_cv.notify_one();
+}
+
+void LlavaNode::stop_image_embeddings_worker() {
+
+  {
+    std::lock_guard<std::mutex> lk(this->image_embeddings_mutex);
+    this->stop_image_embeddings = true;
+    this->image_embeddings_cv.notify_all();
+  }
+
+  if (this->image_embeddings_worker.joinable()) {
+    this->image_embeddings_worker.join();
+  }
+}
+
+void LlavaNode::run_image_embeddings_worker() {
+
+  while (true) {
+
+    struct ImageEmbeddingsRequest pending;
+
+    {
+      std::unique_lock<std::mutex> lk(this->image_embeddings_mutex);
+      this->image_embeddings_cv.wait(lk, [this] {
+        return this->stop_image_embeddings ||
+               !this->image_embeddings_queue.empty();
+      });
+
+      if (this->stop_image_embeddings) {
+        break;
+      }
+
+      pending = this->image_embeddings_queue.front();
+      this->image_embeddings_queue.pop_front();
+    }
+
+    llama_msgs::srv::GenerateImageEmbeddings::Response response;
+    response.success =
+        this->generate_image_embeddings(*pending.request, response);
+
+    if (!response.success) {
+      response.embeddings.clear();
+      response.quantized_embeddings.clear();
+      response.scales.clear();
+      response.n_embd = 0;
+    }
+
+    this->generate_image_embeddings_service_->send_response(*pending.header,
+                                                            response);
+  }
+}
+
+bool LlavaNode::generate_image_embeddings(
+    const llama_msgs::srv::GenerateImageEmbeddings::Request &request,
+    llama_msgs::srv::GenerateImageEmbeddings::Response &response) {
+
+  std::vector<struct rgb_image> images;
+
+  for (const auto &image_msg : request.images) {
+    try {
+      images.push_back(
+          to_rgb_image(cv_bridge::toCvCopy(image_msg, "rgb8")->image));
+    } catch (cv_bridge::Exception &e) {
+      RCLCPP_ERROR(this->get_logger(), "Failed to convert image: %s",
+                   e.what());
+      return false;
+    }
+  }
+
+  auto embeddings =
+      this->llava->generate_image_embeddings(images, request.normalize);
+
+  if (embeddings.size() != images.size() || embeddings.empty()) {
+    RCLCPP_ERROR(this->get_logger(), "Failed to embed %ld images",
+                 images.size());
+    return false;
+  }
+
+  response.n_embd = embeddings.front().size();
+
+  for (const auto &embd : embeddings) {
+    response.embeddings.insert(response.embeddings.end(), embd.begin(),
+                               embd.end());
+
+    // symmetric int8 quantization with one scale per image
+    if (request.quantize) {
+      float max_abs = 0.0f;
+      for (float v : embd) {
+        max_abs = std::max(max_abs, std::fabs(v));
+      }
+
+      float scale = max_abs > 0.0f ? max_abs / 127.0f : 1.0f;
+      response.scales.push_back(scale);
+
+      for (float v : embd) {
+        response.quantized_embeddings.push_back(
+            (int8_t)std::round(v / scale));
+      }
+    }
+  }
+
+  // keep only the int8 copy when quantizing
+  if (request.quantize) {
+    response.embeddings.clear();
+  }
+
+  return true;
+}
@@ -0,0 +1,139 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <rclcpp/rclcpp.hpp>
+
+#include "llama_ros/banned_words_processor.hpp"
+
+using llama_ros::BannedWordsProcessor;
+
+namespace {
+
+const int N_VOCAB = 100;
+
+// "big" ends with a token outside of the vocabulary
+const std::map<std::string, std::vector<llama_token>> VOCAB = {
+    {"foo", {10}},
+    {" foo", {11}},
+    {"bar baz", {20, 21, 22}},
+    {" bar baz", {23, 21, 22}},
+    {"big", {500}},
+    {" big", {30}},
+};
+
+std::vector<llama_token> tokenize(const std::string &text) {
+  auto it = VOCAB.find(text);
+  return it == VOCAB.end() ? std::vector<llama_token>() : it->second;
+}
+
+std::vector<int> get_banned(BannedWordsProcessor &processor,
+                            const std::vector<llama_token> &prev) {
+  std::vector<float> logits(N_VOCAB, 0.0f);
+  processor.process(logits.data(), N_VOCAB, prev);
+
+  std::vector<int> banned;
+  for (int i = 0; i < N_VOCAB; i++) {
+    if (std::isinf(logits[i])) {
+      banned.push_back(i);
+    }
+  }
+  return banned;
+}
+
+class BannedWordsProcessorTest : public ::testing::Test {
+
+protected:
+  static void SetUpTestSuite() { rclcpp::init(0, nullptr); }
+  static void TearDownTestSuite() { rclcpp::shutdown(); }
+
+  void SetUp() override {
+    std::vector<std::string> words = {"foo", "bar baz", "big"};
+    this->node = std::make_shared<rclcpp::Node>(
+        "banned_words_test",
+        rclcpp::NodeOptions().parameter_overrides(
+            {rclcpp::Parameter("banned.words", words)}));
+  }
+
+  std::shared_ptr<rclcpp::Node> node;
+};
+
+} // namespace
+
+TEST_F(BannedWordsProcessorTest, SingleTokenWordsAreAlwaysBanned) {
+  BannedWordsProcessor processor;
+  processor.initialize(this->node.get(), "banned", tokenize, N_VOCAB);
+
+  EXPECT_EQ(get_banned(processor, {}), std::vector<int>({10, 11, 30}));
+}
+
+TEST_F(BannedWordsProcessorTest, LastTokenIsBannedAfterThePrefix) {
+  BannedWordsProcessor processor;
+  processor.initialize(this->node.get(), "banned", tokenize, N_VOCAB);
+
+  EXPECT_EQ(get_banned(processor, {5, 20, 21}),
+            std::vector<int>({10, 11, 22, 30}));
+  EXPECT_EQ(get_banned(processor, {23, 21}),
+            std::vector<int>({10, 11, 22, 30}));
+
+  // the whole prefix must match, not only its last token
+  EXPECT_EQ(get_banned(processor, {5, 21}), std::vector<int>({10, 11, 30}));
+  EXPECT_EQ(get_banned(processor, {21}), std::vector<int>({10, 11, 30}));
+}
+
+TEST_F(BannedWordsProcessorTest, TokensOutsideTheVocabularyAreIgnored) {
+  BannedWordsProcessor processor;
+  processor.initialize(this->node.get(), "banned", tokenize, 20);
+
+  std::vector<float> logits(20, 0.0f);
+  processor.process(logits.data(), 20, {20, 21});
+
+  for (int i = 0; i < 20; i++) {
+    EXPECT_EQ(std::isinf(logits[i]), i == 10 || i == 11);
+  }
+}
+
+TEST_F(BannedWordsProcessorTest, UnknownNameBansNothing) {
+  BannedWordsProcessor processor;
+  processor.initialize(this->node.get(), "other", tokenize, N_VOCAB);
+
+  EXPECT_TRUE(get_banned(processor, {20, 21}).empty());
+}
+
+TEST_F(BannedWordsProcessorTest, OneInstancePerEngineSharesTheParameter) {
+  BannedWordsProcessor first;
+  BannedWordsProcessor second;
+
+  first.initialize(this->node.get(), "banned", tokenize, N_VOCAB);
+  EXPECT_NO_THROW(
+      second.initialize(this->node.get(), "banned", tokenize, N_VOCAB));
+
+  EXPECT_EQ(get_banned(first, {}), get_banned(second, {}));
+  EXPECT_EQ(get_banned(second, {}), std::vector<int>({10, 11, 30}));
+}
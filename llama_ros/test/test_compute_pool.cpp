@@ -0,0 +1,195 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "llama_utils/compute_pool.hpp"
+
+using namespace llama_utils;
+
+namespace {
+
+// the pool is a singleton, every test configures it and releases its leases
+ComputePool &get_pool(int n_threads) {
+  auto &pool = ComputePool::get_instance();
+  pool.configure(n_threads, 0, {GENERATION, VISION, EMBEDDINGS});
+  return pool;
+}
+
+// waits until n more callers are asleep in the pool
+void wait_sleeps(ComputePool &pool, int64_t n_sleeps) {
+  while (pool.get_stats().n_sleeps < n_sleeps) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+class LeaseOrder {
+
+public:
+  void push(compute_workload workload) {
+    std::lock_guard<std::mutex> lk(this->mutex);
+    this->order.push_back(workload);
+  }
+
+  std::vector<compute_workload> get() {
+    std::lock_guard<std::mutex> lk(this->mutex);
+    return this->order;
+  }
+
+private:
+  std::mutex mutex;
+  std::vector<compute_workload> order;
+};
+
+} // namespace
+
+TEST(ComputePoolTest, LeasesAreClampedToThePool) {
+  auto &pool = get_pool(2);
+
+  int n_threads = pool.acquire(8, GENERATION);
+  EXPECT_EQ(n_threads, 2);
+  pool.release(n_threads);
+
+  n_threads = pool.acquire(0, GENERATION);
+  EXPECT_EQ(n_threads, 1);
+  pool.release(n_threads);
+}
+
+TEST(ComputePoolTest, WorkloadNamesAreParsed) {
+  EXPECT_EQ(ComputePool::workload_from_string("generation"), GENERATION);
+  EXPECT_EQ(ComputePool::workload_from_string("vision"), VISION);
+  EXPECT_EQ(ComputePool::workload_from_string("embeddings"), EMBEDDINGS);
+  EXPECT_EQ(ComputePool::workload_from_string("audio"), N_WORKLOADS);
+}
+
+TEST(ComputePoolTest, HigherPriorityWaiterGoesFirst) {
+  auto &pool = get_pool(2);
+  int64_t n_sleeps = pool.get_stats().n_sleeps;
+  LeaseOrder order;
+
+  int held = pool.acquire(2, VISION);
+
+  auto client = [&pool, &order](compute_workload workload) {
+    int n_threads = pool.acquire(2, workload);
+    order.push(workload);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    pool.release(n_threads);
+  };
+
+  std::thread embeddings(client, EMBEDDINGS);
+  wait_sleeps(pool, n_sleeps + 1);
+  std::thread generation(client, GENERATION);
+  wait_sleeps(pool, n_sleeps + 2);
+
+  pool.release(held);
+  embeddings.join();
+  generation.join();
+
+  EXPECT_EQ(order.get(),
+            (std::vector<compute_workload>{GENERATION, EMBEDDINGS}));
+}
+
+TEST(ComputePoolTest, FreeThreadsAreKeptForHigherPriorityWaiters) {
+  auto &pool = get_pool(4);
+  int64_t n_sleeps = pool.get_stats().n_sleeps;
+  LeaseOrder order;
+
+  int held = pool.acquire(3, VISION);
+
+  auto client = [&pool, &order](compute_workload workload, int n_threads) {
+    n_threads = pool.acquire(n_threads, workload);
+    order.push(workload);
+    pool.release(n_threads);
+  };
+
+  // one thread is free, but generation waits for two
+  std::thread generation(client, GENERATION, 2);
+  wait_sleeps(pool, n_sleeps + 1);
+  std::thread embeddings(client, EMBEDDINGS, 1);
+  wait_sleeps(pool, n_sleeps + 2);
+
+  EXPECT_TRUE(order.get().empty());
+
+  // both fit once the threads are back
+  pool.release(held);
+  generation.join();
+  embeddings.join();
+
+  EXPECT_EQ(order.get().size(), 2u);
+}
+
+TEST(ComputePoolTest, PriorityOrderIsConfigurable) {
+  auto &pool = ComputePool::get_instance();
+  pool.configure(2, 0, {EMBEDDINGS});
+  int64_t n_sleeps = pool.get_stats().n_sleeps;
+  LeaseOrder order;
+
+  int held = pool.acquire(2, GENERATION);
+
+  auto client = [&pool, &order](compute_workload workload) {
+    int n_threads = pool.acquire(2, workload);
+    order.push(workload);
+    pool.release(n_threads);
+  };
+
+  // unlisted workloads keep their default order after the listed ones
+  std::thread vision(client, VISION);
+  wait_sleeps(pool, n_sleeps + 1);
+  std::thread generation(client, GENERATION);
+  wait_sleeps(pool, n_sleeps + 2);
+  std::thread embeddings(client, EMBEDDINGS);
+  wait_sleeps(pool, n_sleeps + 3);
+
+  pool.release(held);
+  vision.join();
+  generation.join();
+  embeddings.join();
+
+  EXPECT_EQ(order.get(), (std::vector<compute_workload>{EMBEDDINGS, GENERATION,
+                                                         VISION}));
+}
+
+TEST(ComputePoolTest, GrowingThePoolWakesWaiters) {
+  auto &pool = get_pool(2);
+  int64_t n_sleeps = pool.get_stats().n_sleeps;
+
+  int held = pool.acquire(2, GENERATION);
+
+  int n_threads = 0;
+  std::thread waiter([&pool, &n_threads] {
+    n_threads = pool.acquire(2, EMBEDDINGS);
+  });
+  wait_sleeps(pool, n_sleeps + 1);
+
+  pool.configure(4, 0, {GENERATION, VISION, EMBEDDINGS});
+  waiter.join();
+
+  EXPECT_EQ(n_threads, 2);
+  pool.release(n_threads);
+  pool.release(held);
+}
@@ -0,0 +1,102 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+#include "llama_ros/document_index.hpp"
+
+using llama_ros::DocumentIndex;
+
+TEST(DocumentIndexTest, EmptyIndexReturnsNothing) {
+  DocumentIndex index;
+  EXPECT_EQ(index.size(), 0u);
+  EXPECT_TRUE(index.search({1.0f, 0.0f}, 3).empty());
+}
+
+TEST(DocumentIndexTest, SearchRanksByInnerProduct) {
+  DocumentIndex index;
+  index.add("x", {1.0f, 0.0f});
+  index.add("y", {0.0f, 1.0f});
+  index.add("xy", {0.6f, 0.8f});
+
+  auto results = index.search({1.0f, 0.0f}, 2);
+  ASSERT_EQ(results.size(), 2u);
+  EXPECT_EQ(results[0].text, "x");
+  EXPECT_EQ(results[0].id, 0);
+  EXPECT_FLOAT_EQ(results[0].score, 1.0f);
+  EXPECT_EQ(results[1].text, "xy");
+  EXPECT_FLOAT_EQ(results[1].score, 0.6f);
+}
+
+TEST(DocumentIndexTest, SearchIsClampedToTheIndexSize) {
+  DocumentIndex index;
+  index.add("x", {1.0f, 0.0f});
+
+  EXPECT_EQ(index.search({1.0f, 0.0f}, 5).size(), 1u);
+}
+
+TEST(DocumentIndexTest, ClearEmptiesTheIndex) {
+  DocumentIndex index;
+  index.add("x", {1.0f, 0.0f});
+  index.clear();
+
+  EXPECT_EQ(index.size(), 0u);
+  EXPECT_TRUE(index.search({1.0f, 0.0f}, 1).empty());
+}
+
+TEST(DocumentIndexTest, RerankPrefersDiverseDocuments) {
+  DocumentIndex index;
+  index.add("a", {1.0f, 0.0f});
+  index.add("a copy", {0.99f, 0.141f});
+  index.add("b", {0.6f, 0.8f});
+
+  std::vector<float> query = {1.0f, 0.0f};
+  auto candidates = index.search(query, 3);
+  ASSERT_EQ(candidates[1].text, "a copy");
+
+  // the near duplicate loses to the less relevant but different document
+  auto results = index.rerank(query, candidates, 2, 0.3f);
+  ASSERT_EQ(results.size(), 2u);
+  EXPECT_EQ(results[0].text, "a");
+  EXPECT_EQ(results[1].text, "b");
+
+  // with lambda 1 the ranking is by relevance only
+  results = index.rerank(query, candidates, 2, 1.0f);
+  EXPECT_EQ(results[1].text, "a copy");
+}
+
+TEST(DocumentIndexTest, RerankSkipsCandidatesOfAClearedIndex) {
+  DocumentIndex index;
+  index.add("a", {1.0f, 0.0f});
+  index.add("b", {0.0f, 1.0f});
+
+  auto candidates = index.search({1.0f, 0.0f}, 2);
+  index.clear();
+  index.add("c", {1.0f, 0.0f});
+
+  auto results = index.rerank({1.0f, 0.0f}, candidates, 2, 0.5f);
+  ASSERT_EQ(results.size(), 1u);
+  EXPECT_EQ(results[0].id, 0);
+}
@@ -0,0 +1,102 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "llava_ros/image_cache.hpp"
+
+using llava_ros::ImageCache;
+
+namespace {
+
+const float THRESHOLD = 0.02f;
+
+std::vector<uint8_t> make_thumbnail(uint8_t value) {
+  return std::vector<uint8_t>(32 * 32, value);
+}
+
+} // namespace
+
+TEST(ImageCacheTest, EmptyCacheIsNeverReused) {
+  ImageCache cache;
+  float difference = 0.0f;
+
+  EXPECT_FALSE(cache.can_reuse(make_thumbnail(100), 1, THRESHOLD, difference));
+  EXPECT_FLOAT_EQ(difference, 1.0f);
+}
+
+TEST(ImageCacheTest, SimilarFrameIsReused) {
+  ImageCache cache;
+  float difference = 0.0f;
+  cache.set_encoded(make_thumbnail(100), 1);
+
+  EXPECT_TRUE(cache.can_reuse(make_thumbnail(102), 1, THRESHOLD, difference));
+  EXPECT_NEAR(difference, 2.0f / 255.0f, 1e-6f);
+}
+
+TEST(ImageCacheTest, ReuseIsDisabledWithoutThreshold) {
+  ImageCache cache;
+  float difference = 0.0f;
+  cache.set_encoded(make_thumbnail(100), 1);
+
+  EXPECT_FALSE(cache.can_reuse(make_thumbnail(100), 1, 0.0f, difference));
+  EXPECT_FLOAT_EQ(difference, 0.0f);
+}
+
+TEST(ImageCacheTest, SlowDriftIsMeasuredFromTheEncodedFrame) {
+  ImageCache cache;
+  float difference = 0.0f;
+  cache.set_encoded(make_thumbnail(100), 1);
+
+  // every frame is within the threshold of the previous one
+  EXPECT_TRUE(cache.can_reuse(make_thumbnail(103), 1, THRESHOLD, difference));
+  EXPECT_FALSE(cache.can_reuse(make_thumbnail(106), 1, THRESHOLD, difference));
+  EXPECT_NEAR(difference, 6.0f / 255.0f, 1e-6f);
+
+  // the re-encoded frame becomes the new reference
+  cache.set_encoded(make_thumbnail(106), 1);
+  EXPECT_TRUE(cache.can_reuse(make_thumbnail(107), 1, THRESHOLD, difference));
+}
+
+TEST(ImageCacheTest, TileCountChangeInvalidatesTheCache) {
+  ImageCache cache;
+  float difference = 0.0f;
+  cache.set_encoded(make_thumbnail(100), 4);
+
+  EXPECT_TRUE(cache.can_reuse(make_thumbnail(100), 4, THRESHOLD, difference));
+  EXPECT_FALSE(cache.can_reuse(make_thumbnail(100), 1, THRESHOLD, difference));
+  EXPECT_FALSE(cache.can_reuse(make_thumbnail(100), 9, THRESHOLD, difference));
+}
+
+TEST(ImageCacheTest, ClearDropsTheEncodedFrame) {
+  ImageCache cache;
+  float difference = 0.0f;
+  cache.set_encoded(make_thumbnail(100), 1);
+  cache.clear();
+
+  EXPECT_TRUE(cache.empty());
+  EXPECT_FALSE(cache.can_reuse(make_thumbnail(100), 1, THRESHOLD, difference));
+}
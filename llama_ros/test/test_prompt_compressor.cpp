@@ -0,0 +1,92 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "llama_ros/prompt_compressor.hpp"
+
+using llama_ros::PromptCompressor;
+
+TEST(PromptCompressorTest, PromptWithoutBlocksIsOnePart) {
+  std::vector<std::string> parts;
+  std::vector<std::string> blocks;
+  PromptCompressor::split("no context here", parts, blocks);
+
+  EXPECT_EQ(parts, std::vector<std::string>({"no context here"}));
+  EXPECT_TRUE(blocks.empty());
+}
+
+TEST(PromptCompressorTest, BlocksAreSplitFromTheKeptText) {
+  std::vector<std::string> parts;
+  std::vector<std::string> blocks;
+  PromptCompressor::split("a<context>b</context>c<context>d</context>", parts,
+                          blocks);
+
+  EXPECT_EQ(parts, std::vector<std::string>({"a", "c", ""}));
+  EXPECT_EQ(blocks, std::vector<std::string>({"b", "d"}));
+}
+
+TEST(PromptCompressorTest, UnclosedBlockIsKept) {
+  std::vector<std::string> parts;
+  std::vector<std::string> blocks;
+  PromptCompressor::split("a<context>b</context>c<context>d", parts, blocks);
+
+  EXPECT_EQ(parts, std::vector<std::string>({"a", "c<context>d"}));
+  EXPECT_EQ(blocks, std::vector<std::string>({"b"}));
+}
+
+TEST(PromptCompressorTest, SurprisalOfUniformLogitsIsTheVocabularySize) {
+  std::vector<float> logits(8, 3.0f);
+  EXPECT_NEAR(PromptCompressor::get_surprisal(logits.data(), 8, 5),
+              std::log(8.0f), 1e-5);
+
+  // a likelier token is less surprising
+  logits[5] = 10.0f;
+  EXPECT_LT(PromptCompressor::get_surprisal(logits.data(), 8, 5),
+            PromptCompressor::get_surprisal(logits.data(), 8, 4));
+}
+
+TEST(PromptCompressorTest, RatioKeepsTheMostSurprisingTokens) {
+  std::vector<std::vector<float>> scores = {{INFINITY, 0.1f, 5.0f},
+                                            {2.0f, 0.2f, 0.3f}};
+  auto keep = PromptCompressor::select(scores, 0.5f, 0);
+
+  EXPECT_EQ(keep[0], std::vector<bool>({true, false, true}));
+  EXPECT_EQ(keep[1], std::vector<bool>({true, false, false}));
+}
+
+TEST(PromptCompressorTest, BudgetCapsTheKeptTokens) {
+  std::vector<std::vector<float>> scores = {{INFINITY, 0.1f, 5.0f},
+                                            {2.0f, 0.2f, 0.3f}};
+  auto keep = PromptCompressor::select(scores, 1.0f, 2);
+
+  EXPECT_EQ(keep[0], std::vector<bool>({true, false, true}));
+  EXPECT_EQ(keep[1], std::vector<bool>({false, false, false}));
+
+  // a full ratio without budget keeps everything
+  keep = PromptCompressor::select(scores, 1.0f, 0);
+  EXPECT_EQ(keep[1], std::vector<bool>({true, true, true}));
+}
@@ -0,0 +1,152 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llama_utils/regex_index.hpp"
+
+using llama_utils::RegexIndex;
+
+namespace {
+
+// 0 eos, 1 "a", 2 "b", 3 "ab", 4 "1", 5 <|im_end|> (end-of-turn marker not
+// flagged as eog by the model), both control tokens have no text
+const int32_t TOKEN_EOS = 0;
+const int32_t TOKEN_IM_END = 5;
+
+std::shared_ptr<const std::vector<std::string>> make_pieces() {
+  return std::make_shared<const std::vector<std::string>>(
+      std::vector<std::string>{"", "a", "b", "ab", "1", ""});
+}
+
+} // namespace
+
+TEST(RegexIndexTest, EndOfTurnTokenKeepsTheState) {
+  RegexIndex index("a+b", make_pieces(), {TOKEN_EOS, TOKEN_IM_END});
+  ASSERT_TRUE(index.is_valid());
+
+  int state = index.get_start_state();
+  state = index.get_next_state(state, 1);
+  state = index.get_next_state(state, 2);
+  ASSERT_NE(state, -1);
+  ASSERT_TRUE(index.is_accepting(state));
+
+  int end_state = index.get_next_state(state, TOKEN_IM_END);
+  EXPECT_EQ(end_state, state);
+  EXPECT_TRUE(index.is_accepting(end_state));
+  EXPECT_EQ(index.get_next_state(state, TOKEN_EOS), state);
+}
+
+TEST(RegexIndexTest, TextlessTokenOutsideTheEndSetBreaksTheRegex) {
+  RegexIndex index("a+b", make_pieces(), {TOKEN_EOS});
+  ASSERT_TRUE(index.is_valid());
+
+  int state = index.get_next_state(index.get_start_state(), 3);
+  ASSERT_TRUE(index.is_accepting(state));
+  EXPECT_EQ(index.get_next_state(state, TOKEN_IM_END), -1);
+}
+
+TEST(RegexIndexTest, InvalidPatternReportsAnError) {
+  RegexIndex index("(ab", make_pieces());
+  EXPECT_FALSE(index.is_valid());
+  EXPECT_FALSE(index.get_error().empty());
+}
+
+TEST(RegexIndexTest, AcceptsOnlyTheWholeMatch) {
+  RegexIndex index("[ab]1{2}", make_pieces());
+  ASSERT_TRUE(index.is_valid());
+
+  int state = index.get_start_state();
+  EXPECT_FALSE(index.is_accepting(state));
+
+  state = index.get_next_state(state, 2);
+  EXPECT_FALSE(index.is_accepting(state));
+  state = index.get_next_state(state, 4);
+  EXPECT_FALSE(index.is_accepting(state));
+  state = index.get_next_state(state, 4);
+  EXPECT_TRUE(index.is_accepting(state));
+}
+
+TEST(RegexIndexTest, TokensLeavingTheMatchLeadToTheDeadState) {
+  RegexIndex index("a1", make_pieces());
+  ASSERT_TRUE(index.is_valid());
+
+  int state = index.get_start_state();
+  EXPECT_EQ(index.get_next_state(state, 2), -1);
+  EXPECT_EQ(index.get_next_state(state, 3), -1);
+
+  // nothing follows a complete match
+  state = index.get_next_state(state, 1);
+  state = index.get_next_state(state, 4);
+  ASSERT_TRUE(index.is_accepting(state));
+  EXPECT_TRUE(index.get_allowed_tokens(state).empty());
+  EXPECT_EQ(index.get_next_state(state, 1), -1);
+}
+
+TEST(RegexIndexTest, MultiByteCharactersSpanTokens) {
+  // "é" is 0xc3 0xa9 in UTF-8, split in two tokens or in one
+  auto pieces = std::make_shared<const std::vector<std::string>>(
+      std::vector<std::string>{"", "\xc3", "\xa9", "\xc3\xa9", "e"});
+  RegexIndex index("(\xc3\xa9)+", pieces);
+  ASSERT_TRUE(index.is_valid());
+
+  int start = index.get_start_state();
+  EXPECT_EQ(index.get_allowed_tokens(start), (std::vector<int32_t>{1, 3}));
+
+  int state = index.get_next_state(start, 1);
+  ASSERT_NE(state, -1);
+  EXPECT_FALSE(index.is_accepting(state));
+  EXPECT_EQ(index.get_allowed_tokens(state), (std::vector<int32_t>{2}));
+
+  state = index.get_next_state(state, 2);
+  EXPECT_TRUE(index.is_accepting(state));
+  EXPECT_TRUE(index.is_accepting(index.get_next_state(state, 3)));
+  EXPECT_EQ(index.get_next_state(state, 2), -1);
+  EXPECT_EQ(index.get_next_state(start, 4), -1);
+}
+
+TEST(RegexIndexTest, TokenMaskAddsEndTokensOnlyWhenTheTextCanEnd) {
+  RegexIndex index("a+b", make_pieces(), {TOKEN_IM_END, TOKEN_EOS, TOKEN_EOS});
+  ASSERT_TRUE(index.is_valid());
+
+  int state = index.get_next_state(index.get_start_state(), 1);
+  EXPECT_EQ(index.get_token_mask(state), (std::vector<int32_t>{1, 2, 3}));
+
+  state = index.get_next_state(state, 2);
+  ASSERT_TRUE(index.is_accepting(state));
+  EXPECT_EQ(index.get_token_mask(state),
+            (std::vector<int32_t>{TOKEN_EOS, TOKEN_IM_END}));
+}
+
+TEST(RegexIndexTest, TokenMaskFallsBackToEndTokensWhenNothingMatches) {
+  RegexIndex index("z", make_pieces(), {TOKEN_EOS});
+  ASSERT_TRUE(index.is_valid());
+
+  int start = index.get_start_state();
+  EXPECT_TRUE(index.get_allowed_tokens(start).empty());
+  EXPECT_EQ(index.get_token_mask(start), (std::vector<int32_t>{TOKEN_EOS}));
+}
@@ -0,0 +1,197 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+#include "llama_utils/token_ring.hpp"
+
+using namespace llama_utils;
+
+namespace {
+
+std::string get_ring_name(const std::string &test) {
+  return "/llama_ros_test_" + test + "_" + std::to_string(getpid());
+}
+
+std::string get_text(const token_ring_slot &slot) {
+  return std::string(slot.text, slot.text_len);
+}
+
+const uint8_t GOAL_A[16] = {1};
+const uint8_t GOAL_B[16] = {2};
+
+} // namespace
+
+TEST(TokenRingTest, ReaderStartsAtTheNewestToken) {
+  TokenRingWriter writer(get_ring_name("newest"), 8);
+  ASSERT_TRUE(writer.is_open());
+  writer.write(GOAL_A, 1, "old");
+
+  TokenRingReader reader(get_ring_name("newest"));
+  ASSERT_TRUE(reader.is_open());
+
+  token_ring_slot slot;
+  EXPECT_EQ(reader.read(slot), TokenRingReader::READ_EMPTY);
+
+  writer.write(GOAL_A, 2, "new");
+  ASSERT_EQ(reader.read(slot), TokenRingReader::READ_OK);
+  EXPECT_EQ(slot.token, 2);
+  EXPECT_EQ(slot.flags, 0u);
+  EXPECT_EQ(get_text(slot), "new");
+  EXPECT_EQ(std::memcmp(slot.goal_id, GOAL_A, sizeof(GOAL_A)), 0);
+  EXPECT_EQ(reader.read(slot), TokenRingReader::READ_EMPTY);
+}
+
+TEST(TokenRingTest, MissingRingIsNotOpen) {
+  TokenRingReader reader(get_ring_name("missing"));
+  EXPECT_FALSE(reader.is_open());
+}
+
+TEST(TokenRingTest, ExistingRingIsNotTakenOver) {
+  TokenRingWriter writer(get_ring_name("existing"), 8);
+  ASSERT_TRUE(writer.is_open());
+
+  TokenRingWriter other(get_ring_name("existing"), 8);
+  EXPECT_FALSE(other.is_open());
+
+  // the first ring is still there
+  TokenRingReader reader(get_ring_name("existing"));
+  EXPECT_TRUE(reader.is_open());
+}
+
+TEST(TokenRingTest, RingIsOnlyReadableByItsUser) {
+  TokenRingWriter writer(get_ring_name("mode"), 8);
+  ASSERT_TRUE(writer.is_open());
+
+  struct stat st;
+  ASSERT_EQ(stat(("/dev/shm" + get_ring_name("mode")).c_str(), &st), 0);
+  EXPECT_EQ(st.st_mode & 0777, 0600u);
+}
+
+TEST(TokenRingTest, LongTextContinuesInTheNextSlots) {
+  TokenRingWriter writer(get_ring_name("long"), 8);
+  TokenRingReader reader(get_ring_name("long"));
+
+  std::string text(TOKEN_RING_TEXT_SIZE * 2 + 5, 'x');
+  writer.write(GOAL_A, 7, text);
+
+  token_ring_slot slot;
+  std::string read_text;
+
+  for (uint32_t flags : {0u, (uint32_t)TOKEN_RING_CONTINUATION,
+                         (uint32_t)TOKEN_RING_CONTINUATION}) {
+    ASSERT_EQ(reader.read(slot), TokenRingReader::READ_OK);
+    EXPECT_EQ(slot.token, 7);
+    EXPECT_EQ(slot.flags, flags);
+    read_text += get_text(slot);
+  }
+
+  EXPECT_EQ(read_text, text);
+  EXPECT_EQ(reader.read(slot), TokenRingReader::READ_EMPTY);
+}
+
+TEST(TokenRingTest, EndAndJoinSlots) {
+  TokenRingWriter writer(get_ring_name("end"), 8);
+  TokenRingReader reader(get_ring_name("end"));
+
+  writer.join(GOAL_B, GOAL_A);
+  writer.end(GOAL_B, "succeeded");
+
+  token_ring_slot slot;
+  ASSERT_EQ(reader.read(slot), TokenRingReader::READ_OK);
+  EXPECT_EQ(slot.flags, (uint32_t)TOKEN_RING_JOIN);
+  EXPECT_EQ(std::memcmp(slot.goal_id, GOAL_B, sizeof(GOAL_B)), 0);
+  ASSERT_EQ(slot.text_len, sizeof(GOAL_A));
+  EXPECT_EQ(std::memcmp(slot.text, GOAL_A, sizeof(GOAL_A)), 0);
+
+  ASSERT_EQ(reader.read(slot), TokenRingReader::READ_OK);
+  EXPECT_EQ(slot.flags, (uint32_t)TOKEN_RING_END);
+  EXPECT_EQ(get_text(slot), "succeeded");
+}
+
+TEST(TokenRingTest, SlowReaderSkipsTheOverwrittenSlots) {
+  TokenRingWriter writer(get_ring_name("wrap"), 4);
+  TokenRingReader reader(get_ring_name("wrap"));
+
+  for (int i = 0; i < 10; i++) {
+    writer.write(GOAL_A, i, std::to_string(i));
+  }
+
+  token_ring_slot slot;
+  EXPECT_EQ(reader.read(slot), TokenRingReader::READ_LOST);
+
+  // the oldest slot left is the capacity-th newest
+  for (int i = 6; i < 10; i++) {
+    ASSERT_EQ(reader.read(slot), TokenRingReader::READ_OK);
+    EXPECT_EQ(slot.token, i);
+    EXPECT_EQ(slot.seq.load(), (uint64_t)i + 1);
+  }
+
+  EXPECT_EQ(reader.read(slot), TokenRingReader::READ_EMPTY);
+}
+
+TEST(TokenRingTest, ConcurrentReadsAreNeverTorn) {
+  TokenRingWriter writer(get_ring_name("torn"), 4);
+  TokenRingReader reader(get_ring_name("torn"));
+
+  const int n_tokens = 200000;
+  std::atomic<bool> done(false);
+
+  std::thread producer([&writer, &done]() {
+    for (int i = 0; i < n_tokens; i++) {
+      writer.write(GOAL_A, i, std::string(1 + i % 32, 'a' + i % 26));
+    }
+    done = true;
+  });
+
+  int n_ok = 0;
+  uint64_t last_seq = 0;
+  token_ring_slot slot;
+
+  while (true) {
+    bool finished = done;
+    auto read = reader.read(slot);
+
+    if (read == TokenRingReader::READ_OK) {
+      int i = slot.token;
+      ASSERT_EQ(get_text(slot), std::string(1 + i % 32, 'a' + i % 26));
+      ASSERT_EQ(slot.seq.load(), (uint64_t)i + 1);
+      ASSERT_GT(slot.seq.load(), last_seq);
+      last_seq = slot.seq.load();
+      n_ok++;
+
+    } else if (read == TokenRingReader::READ_EMPTY && finished) {
+      break;
+    }
+  }
+
+  producer.join();
+  EXPECT_GT(n_ok, 0);
+  EXPECT_EQ(last_seq, (uint64_t)n_tokens);
+}
@@ -0,0 +1,92 @@
+// MIT License
+
+// Copyright (c) 2024  Miguel Ángel González Santamarta
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "llama_utils/token_trie.hpp"
+
+using namespace llama_utils;
+
+TEST(TokenTrieTest, EmptyTrieNeverMatches) {
+  TokenTrie trie;
+  EXPECT_TRUE(trie.empty());
+  EXPECT_EQ(trie.push(1), TRIE_NO_MATCH);
+
+  trie.add({});
+  EXPECT_TRUE(trie.empty());
+}
+
+TEST(TokenTrieTest, SequenceMatchesAnywhereInTheStream) {
+  TokenTrie trie;
+  trie.add({1, 2, 3});
+  EXPECT_FALSE(trie.empty());
+
+  EXPECT_EQ(trie.push(7), TRIE_NO_MATCH);
+  EXPECT_EQ(trie.push(1), TRIE_PARTIAL_MATCH);
+  EXPECT_EQ(trie.push(2), TRIE_PARTIAL_MATCH);
+  EXPECT_EQ(trie.push(3), TRIE_FULL_MATCH);
+
+  // a full match starts over
+  EXPECT_EQ(trie.push(3), TRIE_NO_MATCH);
+}
+
+TEST(TokenTrieTest, OverlappingMatchesAreFollowed) {
+  TokenTrie trie;
+  trie.add({1, 1, 2});
+
+  EXPECT_EQ(trie.push(1), TRIE_PARTIAL_MATCH);
+  EXPECT_EQ(trie.push(1), TRIE_PARTIAL_MATCH);
+  EXPECT_EQ(trie.push(1), TRIE_PARTIAL_MATCH);
+  EXPECT_EQ(trie.push(2), TRIE_FULL_MATCH);
+}
+
+TEST(TokenTrieTest, ShortestSequenceWinsOnSharedPrefixes) {
+  TokenTrie trie;
+  trie.add({4, 5, 6});
+  trie.add({4, 5});
+  trie.add({4, 5});
+
+  EXPECT_EQ(trie.push(4), TRIE_PARTIAL_MATCH);
+  EXPECT_EQ(trie.push(5), TRIE_FULL_MATCH);
+}
+
+TEST(TokenTrieTest, ResetDropsTheMatchesInProgress) {
+  TokenTrie trie;
+  trie.add({1, 2});
+
+  EXPECT_EQ(trie.push(1), TRIE_PARTIAL_MATCH);
+  trie.reset();
+  EXPECT_EQ(trie.push(2), TRIE_NO_MATCH);
+}
+
+TEST(TokenTrieTest, ClearRemovesTheSequences) {
+  TokenTrie trie;
+  trie.add({1});
+  trie.clear();
+
+  EXPECT_TRUE(trie.empty());
+  EXPECT_EQ(trie.push(1), TRIE_NO_MATCH);
+}